@@ -6,9 +6,38 @@
 //            CJP Christopher Phillips christopher.j.phillips@curtin.edu.au
 // Commenced 2017-05-25
 //
-#define BUILD 99
-#define THISVER "2.21"
+#define BUILD 124
+#define THISVER "2.46"
 //
+// 2.46-124     2026-10-19 CJP  The packet ring and slot tables are on hugepages, on their node, faulted in and locked at startup.  -b pinned.
+// 2.45-123     2026-10-19 CJP  cpu columns of the config take cpu lists, a memory node and a SCHED_FIFO priority.  Threads are named, pinned on
+//                              every host and their buffers placed by node.
+// 2.44-122     2026-10-19 CJP  Slots are passed between stages on bounded MPMC queues instead of being found by scanning the slot tables.  -t traces them.
+// 2.43-121     2026-10-19 CJP  Idle stages wait on futex stage events, signalled on each slot/meta state hand-off and ring edge, instead of usleep polling.  -b wakeups.
+// 2.42-120     2026-10-19 CJP  rf_input, ws_delay and the delay polynomial/residuals moved out of tile_meta_t into dense per-input arrays (tile_hot_t)
+//                              for makesub and the delay table.
+// 2.41-119     2026-10-19 CJP  Input capacity comes from tiles/xgpu_tiles in mwax.cfg (default 544) instead of MAX_INPUTS.  Per-subobs tables are heap allocated and cache aligned.
+// 2.40-118     2026-10-19 CJP  clear_slot clears only the rows, rf2ndx entries and rf_inp rows the last subobs used (ndx2rf maps rows back), not the whole tables.
+// 2.39-117     2026-10-19 CJP  Slot tables hold 32 bit ring buffer references and 16 bit millisecond arrival times instead of pointers and floats (half the size).
+//                              ARRIVAL_TIMES change: margin packets carried into the next subobs now arrive at a small negative time instead of ~4.29e9.
+// 2.38-116     2026-10-19 CJP  Up to -j makesub writers, each claiming ready slots by compare-and-swap and building in its own temp file, so a backlog is written in parallel.
+// 2.37-115     2026-10-19 CJP  Configurable number of subobs slots (-n, default 4) taken from a free list instead of (GPS_time >> 3) & 3.  -b slots stalls makesub.
+// 2.36-114     2026-10-19 CJP  Sub file unmapped by a reclaimer thread after the fence and final rename, so makesub moves straight on.  -b unmap.
+// 2.35-113     2026-10-19 CJP  Next sub's .free file picked, mapped and prefaulted by a SCHED_IDLE thread while idle (-a).  Copy faults and time logged.  -b prefault.
+// 2.34-112     2026-10-19 CJP  inotify driven .free file allocator (size buckets of ctime min-heaps) replaces the per sub scan.  Free/bad counts in the monitor packet.
+//                              NB the monitor packet grows by 8 bytes (free_files, bad_free_files), so receivers need updating.
+// 2.33-111     2026-10-19 CJP  Free file pool (-p): .free files kept mapped and populated between uses, found again by inode when downstream frees them.
+// 2.32-110     2026-10-19 CJP  Missing inputs and runs of missing packets zero filled in one go (skipped with -z).  Dummy count taken from PACKET_MAP.
+// 2.31-109     2026-10-19 CJP  Whole packet copy for lines that are packet aligned (undelayed oversampled inputs), with streaming zero fill for missing runs.
+// 2.30-108     2026-10-19 CJP  Parse and voltage assembly kernels instantiated per sample rate and chosen once at startup.  -b rates.
+// 2.29-107     2026-10-19 CJP  Gather plan for the voltage copy (source packet and offset of every line), kept between runs and rebuilt when the layout changes.
+// 2.28-106     2026-10-19 CJP  Non-temporal AVX-512/AVX2/SSE2 voltage copy kernels, chosen at startup (-k).  -b copy.
+// 2.27-105     2026-10-19 CJP  Voltage blocks copied by a pool of -w threads with a completion barrier before the rename.  -b makesub checks it.
+// 2.26-104     2026-10-19 CJP  DELAY_TABLE built per slot by add_meta_fits (closed form, vectorised, split over threads).  makesub just copies it.
+// 2.25-103     2026-10-19 CJP  Coherent beam count from BEAMALTAZ at runtime (limited only by block 0 space).  Beam DELAY_TABLE2 entries prepared per slot.
+// 2.24-102     2026-10-19 CJP  Geometric delays from unit pointing vectors and a SIMD tile position x pointing product in double.  -b delays.
+// 2.23-101     2026-10-19 CJP  Compiled metafits sidecars (<obsid>_metafits.u2s), written on first read and preferred when newer.  -M to compile, -K to disable.
+// 2.22-100     2026-10-19 CJP  mmap based metafits reader (mfits), with cfitsio as fallback (-x to cross-check).  -b/-m benchmark mode.
 // 2.21-099     2025-12-11 CJP  reading BEAMALTAZ HDU from metafits and generating delays for specified beams.
 // 2.20-098     2025-11-26 CJP  New delay table format
 // 2.19-097     2025-02-24 CJP  quieter logging
@@ -235,6 +264,7 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <ifaddrs.h>
 #include <stdbool.h>
 #include <stdatomic.h>
 
@@ -251,13 +281,29 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <float.h>
+#include <endian.h>
+#include <strings.h>
+#include <errno.h>
 
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/shm.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sched.h>
 
 #include <fitsio.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <limits.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define deg2rad(x) ((x) * (M_PIl / 180L))
 #define rad2deg(x) ((x) * (180L / M_PIl))
@@ -280,14 +326,16 @@
 
 //---------------- and some new friends -------------------
 
-#define SUB_SLOTS 4
-#define MAX_INPUTS (544LL)
+#define MAX_SUB_SLOTS 32  // -n can ask for up to this many subobs slots
+#define DEFAULT_INPUTS 544  // Input capacity if mwax.cfg doesn't give tiles or xgpu_tiles.  See size_inputs()
+#define INPUTS_LIMIT 8192   // Sanity limit on the input capacity.  Rows are numbered in uint16_t
 #define UDP_PAYLOAD_SIZE (4096LL)
 
 #define LIGHTSPEED (299792458000.0L)
 
 #define SUBFILE_HEADER_SIZE (4096LL)
-#define SAMPLES_PER_SEC (conf.oversampling ? 1638400LL : 1280000LL)
+#define SAMPLES_PER_SEC_AT(oversampled) ((oversampled) ? 1638400LL : 1280000LL)  // The _AT() forms are for the rate specialised kernels.  See rate_kernels_t
+#define SAMPLES_PER_SEC SAMPLES_PER_SEC_AT(conf.oversampling)
 #define COARSECHAN_BANDWIDTH (1280000LL)
 #define ULTRAFINE_BW (200ll)
 #define BLOCKS_PER_SUB (160LL)
@@ -296,15 +344,19 @@
 #define POINTINGS_PER_SUB (BLOCKS_PER_SUB * FFT_PER_BLOCK)
 // NB: POINTINGS_PER_SUB gives 1600 so that every 5ms we write a new delay to the sub file.
 
-#define SUB_LINE_SIZE ((SAMPLES_PER_SEC * 8LL * 2LL) / BLOCKS_PER_SUB)
+#define SUB_LINE_SIZE_AT(oversampled) ((SAMPLES_PER_SEC_AT(oversampled) * 8LL * 2LL) / BLOCKS_PER_SUB)
+#define SUB_LINE_SIZE SUB_LINE_SIZE_AT(conf.oversampling)
 // They might be 6400 samples each for critically sampled data or 8192 for 32/25 oversampled data. Ether way, the 5ms is constant while Ultrafine_bw is 200Hz
 
 #define NTIMESAMPLES ((SAMPLES_PER_SEC * 8LL) / BLOCKS_PER_SUB)
 
 // samples per second * eight seconds * (one byte each for real and imaginary components)
-#define UDP_PER_RF_PER_SUB (((SAMPLES_PER_SEC * 8LL * 2LL) / UDP_PAYLOAD_SIZE) + 2)
-#define SUBSECSPERSEC ((SAMPLES_PER_SEC * 2LL) / UDP_PAYLOAD_SIZE)  // 625/800, for critically sampled/oversampled
-#define SUBSECSPERSUB (SUBSECSPERSEC * 8LL)
+#define UDP_PER_RF_PER_SUB_AT(oversampled) (((SAMPLES_PER_SEC_AT(oversampled) * 8LL * 2LL) / UDP_PAYLOAD_SIZE) + 2)
+#define UDP_PER_RF_PER_SUB UDP_PER_RF_PER_SUB_AT(conf.oversampling)
+#define SUBSECSPERSEC_AT(oversampled) ((SAMPLES_PER_SEC_AT(oversampled) * 2LL) / UDP_PAYLOAD_SIZE)  // 625/800, for critically sampled/oversampled
+#define SUBSECSPERSEC SUBSECSPERSEC_AT(conf.oversampling)
+#define SUBSECSPERSUB_AT(oversampled) (SUBSECSPERSEC_AT(oversampled) * 8LL)
+#define SUBSECSPERSUB SUBSECSPERSUB_AT(conf.oversampling)
 
 // #define RECVMMSG_MODE ( MSG_DONTWAIT )
 #define RECVMMSG_MODE (MSG_WAITFORONE)
@@ -337,8 +389,6 @@
 #define MWA_PACKET_TYPE_LEGACY 0x20        // 0x20 == Legacy Mode  2K samples of Voltage Data in complex 8 bit real + 8 bit imaginary format).
 #define MWA_PACKET_TYPE_OVERSAMPLING 0x30  // 0x30 == Oversampling Mode 2K samples of Voltage Data in complex 8 bit real + 8 bit imaginary format)
 
-#define COHERENT_BEAMS_MAX 30
-
 // In legacy mode, there are 625 packets per second and 2048 samples per packet. This results in 1.28M samples per second.
 // In oversampling mode, there are 800 packets per second and 2048 samples per packet. This results in 1.6384M samples per second.
 
@@ -375,6 +425,8 @@ typedef struct udp2sub_monitor {   // Health packet data
   uint64_t udp_count;              // Cumulative total UDP packets collected from the NIC
   uint64_t udp_dummy;              // Cumulative total dummy packets inserted to pad out subobservations
   uint32_t discarded_subobs;       // Cumulative total subobservations discarded for being too old
+  uint32_t free_files;             // .free files big enough for the last sub file written (kept up to date between writes)
+  uint32_t bad_free_files;         // and ones that are too small
 } udp2sub_monitor_t;
 
 // TODO:
@@ -411,20 +463,23 @@ typedef struct tile_meta {  // Structure format for the metadata associated with
   long double East;
   long double Height;
 
-  uint16_t rf_input;  // What's the tile & pol identifier we'll see in the udp packets for this input?
-
-  int16_t ws_delay;  // The whole sample delay IN SAMPLES (NOT BYTES). Can be -ve. Each extra delay will move the starting position later in the sample sequence
-  double initial_delay;
-  double delta_delay;
-  double delta_delta_delay;
-  double start_total_delay;
-  double middle_total_delay;
-  double end_total_delay;
   long double geometric_offset_mm[3];
-  float delay_offset_in_samples[3][COHERENT_BEAMS_MAX];
 
 } tile_meta_t;
 
+// The per-input fields makesub reads for every sub file, kept apart from tile_meta_t's strings and long doubles in dense arrays so the block 0
+// writers walk contiguous memory.  Indexed like rf_inp, in sub file order, and filled in by add_meta_fits.  See tile_hot_alloc().
+typedef struct tile_hot {
+  uint16_t *rf_input;  // What's the tile & pol identifier we'll see in the udp packets for this input?
+  int16_t *ws_delay;   // The whole sample delay IN SAMPLES (NOT BYTES). Can be -ve. Each extra delay will move the starting position later in the sample sequence
+  double *initial_delay;  // The residual delay polynomial, stepped along by DELAY_TABLE's frac_delay
+  double *delta_delay;
+  double *delta_delta_delay;
+  double *start_total_delay;  // and the residual delays at the start, middle and end of the subobs
+  double *middle_total_delay;
+  double *end_total_delay;
+} tile_hot_t;
+
 #pragma pack(push, 1)
 
 // structure for each signal path
@@ -495,20 +550,50 @@ typedef struct subobs_udp_meta {  // Structure format for the MWA subobservation
 
   uint16_t rf_seen;        // The number of different rf_input sources seen so far this sub observation
   uint16_t rf2ndx[65536];  // A mapping from the rf_input value to what row in the pointer array its pointers are stored
-  char ***udp_volts;       // array of arrays of pointers to every udp packet's payload that may be needed for this sub-observation.
+                           // NB: Everything above here is cleared by clear_slot(), but below here only what was used
+  uint16_t *ndx2rf;        // [1 + max_inputs] and back from row to rf_input, so clear_slot() can find the entries it needs to clear
+  uint32_t **udp_volts;    // array of arrays of references (see packet_payload()) to every udp packet that may be needed for this sub-observation.
                            // NB: THIS ARRAY IS IN THE ORDER INPUTS WERE SEEN STARTING AT 1!, NOT THE SUB FILE ORDER!
                            // entry 0 is a dummy row that is used whenever the metadata requests an rf_input but no packets arrived
                            // for it during this subobs (eg for a partial subobs at startup, or if there's been a misconfiguration)
+  const mwa_udp_packet_t *ring;  // The packet buffer udp_volts refers into (UDPbuf)
 
-  float **udp_arrivals;  // packet arrival times relative to start of subobservation.  Indexed the same way udp_volts is.
+  uint16_t **udp_arrivals;  // packet arrival times relative to start of subobservation (see arrival_encode()).  Indexed the same way udp_volts is.
 
-  tile_meta_t rf_inp[MAX_INPUTS];  // Metadata about each rf input in an array indexed by the order the input needs to be in the output sub file,
-                                   // NOT the order udp packets were seen in.
+  tile_meta_t *rf_inp;  // [max_inputs] Metadata about each rf input in an array indexed by the order the input needs to be in the output sub file,
+                        // NOT the order udp packets were seen in.
+  tile_hot_t hot;       // [max_inputs] and the fields of it makesub needs, indexed the same way
 
-  altaz_meta_t altaz[1 + COHERENT_BEAMS_MAX][3];  // The AltAz at the beginning, middle and end of the 8 second sub-observation
+  altaz_meta_t (*altaz)[3];           // [1 + ncoherant_beams][3] The AltAz at the beginning, middle and end of the 8 second sub-observation.  0 is the tile pointing.
+  delay_table_entry_t *delay_table;   // [max_inputs] DELAY_TABLE, built by add_meta_fits ready to copy into block 0
+  delay_table2_entry_t *beam_delays;  // [ncoherant_beams][NINPUTS] The coherent beams' part of DELAY_TABLE2, ready to copy into block 0
+  int beam_capacity;                  // How many coherent beams altaz and beam_delays have room for.  Grown by reserve_beams(), kept across clear_slot()
 
 } subobs_udp_meta_t;
 
+// udp_volts and udp_arrivals are written at random by UDP_parse for every packet and read by makesub, so they're kept small: a packet is referred to
+// by its index in the ring buffer plus one (so 0, what clear_slot() leaves, means it never arrived) and its arrival time, now - GPS_time, as
+// milliseconds biased by ARRIVAL_ZERO.  That holds -32.767 to +32.767 seconds.  UDP_parse accepts GPS_time from now-32 to now+9, so arrivals run
+// from about -9 to +33 seconds (more for the first packets, carried back into the previous subobs as its end margin), and anything past +32.767
+// seconds is saturated to UINT16_MAX.  The last packets of a subobs are carried into the next one as its start margin before it starts, so theirs
+// are negative (they used to be now - GPS_time in uint32_t, which wrapped to about 4.29e9).
+#define NO_PACKET 0
+#define ARRIVAL_ZERO 32768
+
+static inline char *packet_payload(const mwa_udp_packet_t *ring, uint32_t ref) { return ref == NO_PACKET ? NULL : (char *)ring[ref - 1].volts; }
+
+static inline uint16_t arrival_encode(int32_t msec) {
+  msec += ARRIVAL_ZERO;
+  return msec < 1 ? 1 : (msec > UINT16_MAX ? UINT16_MAX : msec);  // 0 is for no packet
+}
+
+// Back to seconds, as they go in the ARRIVAL_TIMES section.  0.0 still means no packet, so a packet arriving right on the subobs boundary is
+// FLT_MIN.
+static inline float arrival_decode(uint16_t arrival) {
+  if (arrival == 0) return 0.0f;
+  return arrival == ARRIVAL_ZERO ? FLT_MIN : (arrival - ARRIVAL_ZERO) / 1000.0f;
+}
+
 typedef struct MandC_meta {  // Structure format for the MWA subobservation metadata that tracks the sorted location of the udp packets.  Array with one entry per rf_input
 
   uint16_t rf_input;    // tile/antenna and polarisation (LSB is 0 for X, 1 for Y)
@@ -541,16 +626,49 @@ struct iovec *iovecs;
 mwa_udp_packet_t *UDPbuf;
 udp2sub_monitor_t monitor;
 
-atomic_int slot_state[4] = {0};  // 0: free, 1: collecting packets, 2: ready to write, 3: write in progress, 4/5: write succeeded/failed, 6: marked for abandonment
-atomic_int meta_state[4] = {0};  // 0: free, 1: metafits read requested, 2: metafits read in progress, 4/5: metafits read succeeded/failed
+int sub_slots = 4;  // -n: How many subobs can be open (collecting, waiting for metafits or waiting to be written) at once
+atomic_int slot_state[MAX_SUB_SLOTS] = {0};  // 0: free, 1: collecting packets, 2: ready to write, 3: write in progress, 4/5: write succeeded/failed, 6: marked for abandonment
+atomic_int meta_state[MAX_SUB_SLOTS] = {0};  // 0: free, 1: metafits read requested, 2: metafits read in progress, 4/5: metafits read succeeded/failed
+
+subobs_udp_meta_t *sub;  // Pointer to the sub_slots subobs metadata arrays
+int max_inputs = DEFAULT_INPUTS;  // Input capacity of every per-subobs table, set from mwax.cfg by size_inputs()
+
+// A stage that runs out of work waits on a stage_event_t rather than sleeping, and whoever hands it work signals the event, so it wakes when the
+// work appears instead of at the end of a nap.  seq is a futex word bumped by every signal.  The waiter reads it before looking for work and only
+// sleeps if it hasn't moved since, so a signal between looking and sleeping isn't lost.  Signalling only makes the syscall if someone is waiting.
+typedef struct stage_event {
+  atomic_uint seq;
+  atomic_int waiters;
+} stage_event_t;
+
+stage_event_t ring_data;   // UDP_recv has added packets to the ring, for UDP_parse
+stage_event_t ring_space;  // UDP_parse has freed slots in the ring, for UDP_recv when it's full
+stage_event_t meta_work;   // A slot wants its metafits read (meta_state 1) or abandoned (slot_state 6), for add_meta_fits
+stage_event_t write_work;  // A slot is ready to write (2.4), or for clearing (2.5, 6.x), for makesub
 
-subobs_udp_meta_t *sub;  // Pointer to the four subobs metadata arrays
-char *sub_header;        // Pointer to a buffer that's the size of a sub file header.
+static inline unsigned stage_seq(stage_event_t *event) { return atomic_load(&event->seq); }
 
-bool debug_mode         = false;  // Default to not being in debug mode
-bool force_cable_delays = false;  // Always apply cable delays, regardless of metafits
-bool force_geo_delays   = false;  // Always apply geometric delays, regardless of metafits
-int dummy_beams         = 0;      // synthesise this many dummy coherent beams for testing purposes
+void stage_signal(stage_event_t *event) {
+  atomic_fetch_add(&event->seq, 1);
+  if (atomic_load(&event->waiters) > 0) syscall(SYS_futex, &event->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// Wait until the event has been signalled since seen (from stage_seq() before we looked for work), or timeout_ms, which is kept as a backstop and
+// so every stage still notices terminate.
+void stage_wait(stage_event_t *event, unsigned seen, int timeout_ms) {
+  struct timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+  atomic_fetch_add(&event->waiters, 1);
+  syscall(SYS_futex, &event->seq, FUTEX_WAIT_PRIVATE, seen, &timeout, NULL, 0);
+  atomic_fetch_sub(&event->waiters, 1);
+}
+
+bool debug_mode           = false;  // Default to not being in debug mode
+bool force_cable_delays   = false;  // Always apply cable delays, regardless of metafits
+bool force_geo_delays     = false;  // Always apply geometric delays, regardless of metafits
+int dummy_beams           = 0;      // synthesise this many dummy coherent beams for testing purposes
+bool metafits_cross_check = false;  // Re-read every metafits with cfitsio and compare against the mmap reader
+bool use_sidecars         = true;   // Read/write compiled metafits sidecars (<obsid>_metafits.u2s) next to the metafits
+bool trace_queues         = false;  // Log every slot pushed onto or popped off a stage queue
 
 //---------------------------------------------------------------------------------------------------------------------------------------------------
 // read_config - use our hostname and a command line parameter to find ourselves in the list of possible configurations
@@ -560,6 +678,12 @@ int dummy_beams         = 0;      // synthesise this many dummy coherent beams f
 // #pragma pack(push,1)                          // We're writing this header into all our packets, so we want/need to force the compiler not to add it's own idea of structure
 // padding
 
+typedef struct thread_place {  // Where a thread runs, from one of the cpu columns of the config file.  See parse_thread_place()
+  cpu_set_t cpus;  // Allowed cpus.  None means leave the thread wherever the scheduler puts it
+  int node;        // Memory node for the thread's allocations, or -1 for the node of its cpus (if they're all on one)
+  int fifo;        // SCHED_FIFO priority, or 0 to keep the thread's scheduling policy
+} thread_place_t;
+
 typedef struct udp2sub_config {  // Structure for the configuration of each udp2sub instance.
 
   // fields for this instance read from a line in the mwax_u2s config file, usually found at /vulcan/mwax_config/mwax_u2s.cfg
@@ -569,10 +693,10 @@ typedef struct udp2sub_config {  // Structure for the configuration of each udp2
 
   int64_t UDP_num_slots;  // The number of UDP buffers to assign.  Must be ~>=3000000 for 128T array
 
-  unsigned int cpu_mask_parent;     // Allowed cpus for the parent thread which reads metafits file
-  unsigned int cpu_mask_UDP_recv;   // Allowed cpus for the thread that needs to pull data out of the NIC super fast
-  unsigned int cpu_mask_UDP_parse;  // Allowed cpus for the thread that checks udp packets to create backwards pointer lists
-  unsigned int cpu_mask_makesub;    // Allowed cpus for the thread that writes the sub files out to memory
+  thread_place_t place_parent;     // Placement of the parent thread which reads metafits file
+  thread_place_t place_UDP_recv;   // Placement of the thread that needs to pull data out of the NIC super fast
+  thread_place_t place_UDP_parse;  // Placement of the thread that checks udp packets to create backwards pointer lists
+  thread_place_t place_makesub;    // Placement of the thread that writes the sub files out to memory
 
   char shared_mem_dir[40];   // The name of the shared memory directory where we get .free files from and write out .sub files
   char temp_file_name[40];   // The name of the temporary file we use.  If multiple copies are running on each server, these may need to be different
@@ -620,8 +744,9 @@ void report_substatus(char *thread_name, char *status, ...) {
     struct timespec this_time;
     clock_gettime(CLOCK_REALTIME, &this_time);
     printf("now=%ld.%03d %-15s: ", (int64_t)(this_time.tv_sec - GPS_offset), (int)(this_time.tv_nsec / 1000000), thread_name);
-    printf("(slot.meta)_state = [%d.%d %d.%d %d.%d %d.%d] ", slot_state[0], meta_state[0], slot_state[1], meta_state[1], slot_state[2], meta_state[2], slot_state[3],
-           meta_state[3]);
+    printf("(slot.meta)_state = [");
+    for (int slot = 0; slot < sub_slots; slot++) printf(slot ? " %d.%d" : "%d.%d", slot_state[slot], meta_state[slot]);
+    printf("] ");
     va_list arguments;
     va_start(arguments, status);
     vprintf(status, arguments);
@@ -634,6 +759,125 @@ void report_substatus(char *thread_name, char *status, ...) {
   }
 }
 
+void *calloc_or_die(size_t nmemb, size_t size, char *name) {
+  void *res = calloc(nmemb, size);
+  if (!res) {
+    printf("%s calloc failed\n", name);
+    fflush(stdout);
+    exit(EXIT_FAILURE);
+  }
+  return res;
+}
+
+// Zeroed and starting on a cache line, so per-input arrays written by one thread don't share a line with anything else
+void *calloc_aligned_or_die(size_t nmemb, size_t size, char *name) {
+  size_t bytes = (nmemb * size + 63) & ~(size_t)63;
+  void *res    = NULL;
+  if (posix_memalign(&res, 64, bytes ? bytes : 64) != 0) {
+    printf("%s aligned calloc failed\n", name);
+    fflush(stdout);
+    exit(EXIT_FAILURE);
+  }
+  return memset(res, 0, bytes);
+}
+
+void *realloc_or_die(void *ptr, size_t size, char *name) {
+  void *res = realloc(ptr, size);
+  if (!res) {
+    printf("%s realloc failed\n", name);
+    fflush(stdout);
+    exit(EXIT_FAILURE);
+  }
+  return res;
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+// Stage queues - how slots are handed from one stage to the next (see design.md).  Each is a bounded lock-free FIFO of slot numbers (Vyukov's
+// MPMC ring: a cell's seq says whether it's ready to push into or pop from, and head and tail are claimed by compare-and-swap), so any number of
+// makesub writers can pop the same queue.  A slot is in a stage's queue at most once, so MAX_SUB_SLOTS cells can never fill.
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+
+typedef struct stage_queue {
+  char *name;
+  stage_event_t *event;  // Signalled on every push, to wake the stage that pops
+  atomic_size_t head;    // The next cell to pop
+  atomic_size_t tail;    // The next cell to push
+  struct {
+    atomic_size_t seq;  // == position: empty, ready to push.  == position + 1: holds slot, ready to pop
+    int slot;
+  } cells[MAX_SUB_SLOTS];
+} stage_queue_t;
+
+stage_queue_t meta_queue  = {.name = "metadata needed", .event = &meta_work};  // UDP_parse -> add_meta_fits, slots now collecting (1.1)
+stage_queue_t write_queue = {.name = "ready to write", .event = &write_work};   // -> makesub, slots done collecting with metadata (2.4)
+stage_queue_t clear_queue = {.name = "ready to clear", .event = &write_work};   // -> makesub, slots written (4, 5), failed (2.5) or abandoned (6)
+
+atomic_int slot_handoffs[MAX_SUB_SLOTS];  // How many of UDP_parse and add_meta_fits have finished with each slot.  See slot_handoff()
+
+void stage_queue_reset(stage_queue_t *queue) {
+  for (size_t cell = 0; cell < MAX_SUB_SLOTS; cell++) atomic_store(&queue->cells[cell].seq, cell);
+  atomic_store(&queue->head, 0);
+  atomic_store(&queue->tail, 0);
+}
+
+// Empty every stage queue, for a fresh set of slots
+void stage_queues_reset() {
+  stage_queue_reset(&meta_queue);
+  stage_queue_reset(&write_queue);
+  stage_queue_reset(&clear_queue);
+  for (int slot = 0; slot < MAX_SUB_SLOTS; slot++) atomic_store(&slot_handoffs[slot], 0);
+}
+
+void stage_queue_push(stage_queue_t *queue, int slot) {
+  size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  for (;;) {
+    size_t seq = atomic_load_explicit(&queue->cells[pos % MAX_SUB_SLOTS].seq, memory_order_acquire);
+    if (seq == pos) {
+      if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+    } else if (seq < pos) {  // Full, which would mean a slot got queued twice
+      printf("stage queue %s overflowed pushing slot %d\n", queue->name, slot);
+      fflush(stdout);
+      exit(EXIT_FAILURE);
+    } else {
+      pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    }
+  }
+  queue->cells[pos % MAX_SUB_SLOTS].slot = slot;
+  atomic_store_explicit(&queue->cells[pos % MAX_SUB_SLOTS].seq, pos + 1, memory_order_release);
+  if (trace_queues) report_substatus("stage queue", "%s: slot %d pushed (subobs %d)", queue->name, slot, sub[slot].subobs);
+  stage_signal(queue->event);
+}
+
+// The oldest slot in the queue, or -1 if it's empty
+int stage_queue_pop(stage_queue_t *queue) {
+  size_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  for (;;) {
+    size_t seq = atomic_load_explicit(&queue->cells[pos % MAX_SUB_SLOTS].seq, memory_order_acquire);
+    if (seq == pos + 1) {
+      if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+    } else if (seq < pos + 1) {
+      return -1;
+    } else {
+      pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    }
+  }
+  int slot = queue->cells[pos % MAX_SUB_SLOTS].slot;
+  atomic_store_explicit(&queue->cells[pos % MAX_SUB_SLOTS].seq, pos + MAX_SUB_SLOTS, memory_order_release);
+  if (trace_queues) report_substatus("stage queue", "%s: slot %d popped (subobs %d)", queue->name, slot, sub[slot].subobs);
+  return slot;
+}
+
+// A slot stops collecting (UDP_parse sets 2 or 6) and is done with by add_meta_fits (4, 5 or 6) in either order.  Each calls this once, after
+// its own transition, and whichever is second passes the slot on to makesub: to write if it's 2.4, otherwise just to be cleared.
+void slot_handoff(int slot) {
+  if (atomic_fetch_add(&slot_handoffs[slot], 1) != 1) return;
+  stage_queue_push((slot_state[slot] == 2 && meta_state[slot] == 4) ? &write_queue : &clear_queue, slot);
+}
+
+double elapsed_usec(const struct timespec *start, const struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1e6 + (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
 //---------------------------------------------------------------------------------------------------------------------------------------------------
 // load_channel_map - Load config from a CSV file.
 //---------------------------------------------------------------------------------------------------------------------------------------------------
@@ -663,6 +907,61 @@ int load_and_cr_terminate(const char *path, char **data) {
   return 0;
 }
 
+// Parse a cpu column of the config file: "<cpus>[@<node>][:<priority>]".  <cpus> is either a bare number, the old bit mask of cpus 0-63 (so "3"
+// is cpus 0 and 1), or a cpu list of cpus and ranges separated by ';' or spaces, since commas separate the columns ("2-5;34", or "5;" for just cpu
+// 5).  Empty or 0 leaves the thread unpinned.  @<node> puts the thread's memory on that node rather than its cpus' node, and :<priority> runs it
+// SCHED_FIFO at that priority (1-99).
+bool parse_thread_place(const char *spec, thread_place_t *place) {
+  char cpus[128];
+  char *end;
+  CPU_ZERO(&place->cpus);
+  place->node = -1;
+  place->fifo = 0;
+  if (strlen(spec) >= sizeof cpus) goto bad;
+  strcpy(cpus, spec);
+
+  char *opt = strchr(cpus, ':');
+  if (opt != NULL) {
+    *opt        = '\0';
+    place->fifo = strtol(opt + 1, &end, 10);
+    if (*end != '\0' || place->fifo < 1 || place->fifo > 99) goto bad;
+  }
+  opt = strchr(cpus, '@');
+  if (opt != NULL) {
+    *opt        = '\0';
+    place->node = strtol(opt + 1, &end, 10);
+    if (end == opt + 1 || *end != '\0' || place->node < 0) goto bad;
+  }
+
+  if (strspn(cpus, "0123456789") == strlen(cpus)) {  // The old bit mask
+    unsigned long long mask = strtoull(cpus, NULL, 10);
+    for (int cpu = 0; cpu < 64; cpu++)
+      if ((mask >> cpu) & 1) CPU_SET(cpu, &place->cpus);
+    return true;
+  }
+
+  char *list = cpus;
+  char *range;
+  while ((range = strsep(&list, "; ")) != NULL) {
+    if (*range == '\0') continue;
+    long first = strtol(range, &end, 10);
+    long last  = first;
+    if (end == range) goto bad;
+    if (*end == '-') {
+      char *from = end + 1;
+      last       = strtol(from, &end, 10);
+      if (end == from) goto bad;
+    }
+    if (*end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE) goto bad;
+    for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, &place->cpus);
+  }
+  return true;
+
+bad:
+  fprintf(stderr, "Error loading configuration. Bad cpu placement '%s'\n", spec);
+  return false;
+}
+
 int load_config_file(char *path, udp2sub_config_t **config_records) {
   fprintf(stderr, "Reading configuration from %s\n", path);
   // Read the whole input file into a buffer.
@@ -701,20 +1000,16 @@ int load_config_file(char *path, udp2sub_config_t **config_records) {
           if (end == NULL || *end != '\0') goto done;
           break;
         case 4:
-          records[row].cpu_mask_parent = strtol(tok, &end, 10);
-          if (end == NULL || *end != '\0') goto done;
+          if (!parse_thread_place(tok, &records[row].place_parent)) goto done;
           break;
         case 5:
-          records[row].cpu_mask_UDP_recv = strtol(tok, &end, 10);
-          if (end == NULL || *end != '\0') goto done;
+          if (!parse_thread_place(tok, &records[row].place_UDP_recv)) goto done;
           break;
         case 6:
-          records[row].cpu_mask_UDP_parse = strtol(tok, &end, 10);
-          if (end == NULL || *end != '\0') goto done;
+          if (!parse_thread_place(tok, &records[row].place_UDP_parse)) goto done;
           break;
         case 7:
-          records[row].cpu_mask_makesub = strtol(tok, &end, 10);
-          if (end == NULL || *end != '\0') goto done;
+          if (!parse_thread_place(tok, &records[row].place_makesub)) goto done;
           break;
         case 8:
           strcpy(records[row].shared_mem_dir, tok);
@@ -815,6 +1110,20 @@ int load_mwax_config(char *path, udp2sub_config_t *cfg) {
   return 0;
 }
 
+// Size the per-subobs tables for the array in mwax.cfg: two inputs per tile, using xgpu_tiles if it's padded beyond tiles.  Without either we keep
+// DEFAULT_INPUTS.  So a 512 tile array runs with 1024 and 128 tiles with 256.  If an observation has more inputs than this, the metafits readers keep
+// the first max_inputs in sub file order (see discard_inputs()), and UDP_parse drops packets from rf_inputs beyond the first max_inputs it sees.
+void size_inputs(const udp2sub_config_t *config) {
+  int tiles = (config->xgpu_tiles > config->tiles) ? config->xgpu_tiles : config->tiles;
+  max_inputs = (tiles > 0) ? 2 * tiles : DEFAULT_INPUTS;
+  if (max_inputs > INPUTS_LIMIT) {
+    printf("%d tiles in mwax.cfg is more than the %d inputs we can handle\n", tiles, INPUTS_LIMIT);
+    fflush(stdout);
+    exit(EXIT_FAILURE);
+  }
+  printf("input capacity %d (tiles=%d, xgpu_tiles=%d)\n", max_inputs, config->tiles, config->xgpu_tiles);
+}
+
 void read_config(char *file, char *shared_file, char *us, int inst, int coarse_chan, udp2sub_config_t *config) {
   int num_instances = 0;  // Number of instance records loaded
   int instance_ndx  = 0;  // Start out assuming we don't appear in the list
@@ -836,6 +1145,7 @@ void read_config(char *file, char *shared_file, char *us, int inst, int coarse_c
 
   *config = available_config[instance_ndx];  // Copy the relevant line into the structure we were passed a pointer to
   load_mwax_config(shared_file, config);
+  size_inputs(config);
 
   if (coarse_chan > 0) {  // If there is a coarse channel override on the command line
     printf("overriding multicast_ip and UDPport\n");
@@ -854,27 +1164,225 @@ void read_config(char *file, char *shared_file, char *us, int inst, int coarse_c
 
 //===================================================================================================================================================
 
-// ------------------------ Function to set CPU affinity so that we can control which socket & core we run on -------------------------
+// ------------------------ Functions to find memory nodes, so that threads and their buffers share a socket --------------------------
+
+// The memory node a cpu is on, or -1 if we can't tell
+int cpu_node(int cpu) {
+  char path[64];
+  snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR *dir = opendir(path);
+  if (dir == NULL) return -1;
+  int node = -1;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL)
+    if (sscanf(entry->d_name, "node%d", &node) == 1) break;
+  closedir(dir);
+  return node;
+}
+
+// The memory node for a thread placed here: the one asked for, or else the one all its cpus are on.  -1 if it has none, or they're on several.
+int place_node(const thread_place_t *place) {
+  if (place->node >= 0) return place->node;
+  int node = -1;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &place->cpus)) continue;
+    int this = cpu_node(cpu);
+    if (this < 0 || (node >= 0 && this != node)) return -1;
+    node = this;
+  }
+  return node;
+}
+
+// The memory node of the NIC with this IPv4 address, or -1 if we can't tell
+int nic_node(const char *address) {
+  struct ifaddrs *ifaddr;
+  int node = -1;
+  if (getifaddrs(&ifaddr) == -1) return -1;
+  for (struct ifaddrs *ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+    if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET) continue;
+    if (((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr != inet_addr(address)) continue;
+    char path[300];
+    snprintf(path, sizeof path, "/sys/class/net/%s/device/numa_node", ifa->ifa_name);
+    FILE *file = fopen(path, "r");
+    if (file != NULL) {
+      if (fscanf(file, "%d", &node) != 1) node = -1;
+      fclose(file);
+    }
+    break;
+  }
+  freeifaddrs(ifaddr);
+  return node;
+}
+
+// Prefer node for pages this thread allocates from now on, or go back to the default policy if node is -1
+int set_memory_node(int node) {
+  unsigned long nodemask[16] = {0};  // Room for 1024 nodes
+  if (node < 0) return syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+  if (node >= (int)(8 * sizeof nodemask)) return -1;
+  nodemask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+  return syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask, 8 * sizeof nodemask);
+}
+
+// Prefer node for the pages of len bytes at addr, moving any already there.  Only whole pages inside the range are bound, so this is for
+// allocations of many pages, and it quietly does nothing for node -1.
+void place_memory(void *addr, size_t len, int node, char *what) {
+  unsigned long nodemask[16] = {0};
+  size_t page                = sysconf(_SC_PAGESIZE);
+  uintptr_t start            = ((uintptr_t)addr + page - 1) & ~(page - 1);
+  uintptr_t end              = ((uintptr_t)addr + len) & ~(page - 1);
+  if (node < 0 || node >= (int)(8 * sizeof nodemask) || end <= start) return;
+  nodemask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+  if (syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, nodemask, 8 * sizeof nodemask, MPOL_MF_MOVE) != 0)
+    printf("Couldn't bind %s to memory node %d: %s\n", what, node, strerror(errno));
+  else
+    printf("%s bound to memory node %d\n", what, node);
+  fflush(stdout);
+}
 
-int set_cpu_affinity(unsigned int mask) {
-  cpu_set_t my_cpu_set;   // Make a CPU affinity set for this thread
-  CPU_ZERO(&my_cpu_set);  // Zero it out completely
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+// Pinned buffers - the packet ring and slot tables, on hugepages, placed by node, faulted in and locked before any packets arrive
+//---------------------------------------------------------------------------------------------------------------------------------------------------
 
-  for (int loop = 0; loop < 32; loop++) {  // Support up to 32 cores for now.  We need to step through them from LSB to MSB
+#define HUGE_2MB (2UL << 20)
+#define HUGE_1GB (1UL << 30)
+#define HUGE_1GB_WASTE 32  // Only use 1 GB pages if rounding up to them wastes no more than 1/32 of the buffer.  They come from a shared reserved pool
+#define MAX_PINNED (3 + 2 * MAX_SUB_SLOTS)  // The ring and its two vectors, and each slot's packet reference and arrival time arrays
 
-    if (((mask >> loop) & 0x01) == 0x01) {  // If that bit is set
-      CPU_SET(loop, &my_cpu_set);           // then add it to the allowed list
+int64_t minor_faults();
+
+struct {
+  struct {
+    void *addr;
+    size_t len;
+  } maps[MAX_PINNED];  // What we've mapped, so free_pinned() can unmap it
+  size_t bytes;        // Totals since startup, for report_pinned()
+  size_t huge_bytes;   // On hugetlbfs pages.  The rest asked for transparent hugepages
+  size_t rounded_bytes;  // What rounding up to whole pages added to bytes
+  size_t locked_bytes;
+  int64_t faults;
+  double usec;
+} pinned;
+
+// Map zeroed memory for nmemb elements of size bytes, preferably on node (-1 for the thread's policy), then fault it all in and lock it so
+// nothing on the packet path ever faults or gets swapped.  We use 1 GB hugetlbfs pages if any are reserved and rounding up to them wastes little
+// (see HUGE_1GB_WASTE), then 2 MB ones, and otherwise ordinary pages with a transparent hugepage hint.  If we're not allowed to lock it, we still
+// fault it in.
+void *alloc_pinned_or_die(size_t nmemb, size_t size, int node, char *name) {
+  struct timespec t0, t1;
+  int64_t faults0 = minor_faults();
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  size_t bytes = (nmemb * size > 0) ? nmemb * size : 1;
+  size_t len   = 0;
+  char *addr   = MAP_FAILED;
+  len = (bytes + HUGE_1GB - 1) & ~(HUGE_1GB - 1);
+  if (bytes >= HUGE_1GB && len - bytes <= bytes / HUGE_1GB_WASTE) {
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (30 << MAP_HUGE_SHIFT), -1, 0);
+    if (addr != MAP_FAILED) printf("%s on 1 GB pages, rounded up by %.1f MB\n", name, (len - bytes) / 1048576.0);
+  }
+  if (addr == MAP_FAILED) {
+    len  = (bytes + HUGE_2MB - 1) & ~(HUGE_2MB - 1);
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+  }
+  bool huge = (addr != MAP_FAILED);
+  if (!huge) {  // No hugetlbfs pages, so map 2 MB more than we need and trim it to a 2 MB boundary, where THP can use whole hugepages
+    char *base = mmap(NULL, len + HUGE_2MB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+      printf("%s mmap of %lu bytes failed\n", name, len);
+      fflush(stdout);
+      exit(EXIT_FAILURE);
     }
+    addr        = (char *)(((uintptr_t)base + HUGE_2MB - 1) & ~(HUGE_2MB - 1));
+    size_t head = addr - base;
+    if (head > 0) munmap(base, head);
+    munmap(addr + len, HUGE_2MB - head);
+    madvise(addr, len, MADV_HUGEPAGE);
+  }
+
+  place_memory(addr, len, node, name);    // Before anything touches it, so every page is allocated on the node
+  bool locked = (mlock(addr, len) == 0);  // which faults it all in
+  if (!locked) {
+    static bool warned = false;
+    if (!warned) printf("Couldn't lock %s in memory (%s), so just faulting it in.  Raise RLIMIT_MEMLOCK to lock it\n", name, strerror(errno));
+    warned = true;
+    for (size_t offset = 0; offset < len; offset += 4096) addr[offset] = 0;
   }
 
-  pthread_t my_thread;         // I need to look up my own TID / LWP
-  my_thread = pthread_self();  // So what's my TID / LWP?
+  int map = 0;
+  while (map < MAX_PINNED && pinned.maps[map].addr != NULL) map++;
+  if (map == MAX_PINNED) {
+    printf("%s: too many pinned buffers\n", name);
+    fflush(stdout);
+    exit(EXIT_FAILURE);
+  }
+  pinned.maps[map].addr = addr;
+  pinned.maps[map].len  = len;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  pinned.bytes += len;
+  pinned.huge_bytes += huge ? len : 0;
+  pinned.rounded_bytes += len - bytes;
+  pinned.locked_bytes += locked ? len : 0;
+  pinned.faults += minor_faults() - faults0;
+  pinned.usec += elapsed_usec(&t0, &t1);
+  return addr;
+}
 
-  if (conf.udp2sub_id > 26) {                                                    // Don't do any mwax servers for now
-    return (pthread_setaffinity_np(my_thread, sizeof(cpu_set_t), &my_cpu_set));  // Make the call and return the result back to the caller
-  } else {
-    return (-1);
+void free_pinned(void *addr) {
+  for (int map = 0; map < MAX_PINNED; map++) {
+    if (pinned.maps[map].addr != addr) continue;
+    munmap(addr, pinned.maps[map].len);  // Unlocks it too
+    pinned.maps[map].addr = NULL;
+    return;
+  }
+}
+
+// Let us lock as much as we're allowed to: no limit if we can (CAP_SYS_RESOURCE), otherwise up to the hard limit.  alloc_pinned_or_die() says
+// if that still isn't enough.
+void raise_memlock_limit() {
+  struct rlimit limit = {RLIM_INFINITY, RLIM_INFINITY};
+  if (setrlimit(RLIMIT_MEMLOCK, &limit) == 0) return;
+  int err = errno;
+  if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;  // Raising the soft limit as far as the hard one needs no privilege
+    if (setrlimit(RLIMIT_MEMLOCK, &limit) == 0) {
+      printf("Couldn't remove RLIMIT_MEMLOCK (%s), so raised it to its hard limit of %lu MB\n", strerror(err), (unsigned long)(limit.rlim_max >> 20));
+      fflush(stdout);
+      return;
+    }
+  }
+  printf("Couldn't raise RLIMIT_MEMLOCK: %s\n", strerror(errno));
+  fflush(stdout);
+}
+
+// Say how much we've pinned since startup, and what faulting it in cost
+void report_pinned() {
+  printf("Pinned %.2f GB (%.2f GB on hugetlbfs pages, %.2f GB locked, %.1f MB of it rounding up to whole pages) in %.1f ms, %ld page faults\n",
+         pinned.bytes / 1e9, pinned.huge_bytes / 1e9, pinned.locked_bytes / 1e9, pinned.rounded_bytes / 1048576.0, pinned.usec / 1000.0, pinned.faults);
+  fflush(stdout);
+}
+
+// ------------------------ Function to set CPU affinity so that we can control which socket & core we run on -------------------------
+
+// Name this thread (as "u2s<id>.<name>" so several instances on a host can be told apart in top), pin it to its configured cpus, prefer their
+// memory node, and run it SCHED_FIFO if that was asked for.  Returns the pthread_setaffinity_np() result, or 0 if the thread isn't pinned.
+int set_cpu_affinity(const thread_place_t *place, const char *name) {
+  char thread_name[16];  // The kernel's limit, including the terminator
+  snprintf(thread_name, sizeof thread_name, "u2s%02d.%s", conf.udp2sub_id, name);
+  pthread_setname_np(pthread_self(), thread_name);
+
+  int result = 0;
+  if (CPU_COUNT(&place->cpus) > 0) result = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &place->cpus);
+
+  int node = place_node(place);
+  if (node >= 0 && set_memory_node(node) != 0) printf("%s couldn't prefer memory node %d: %s\n", name, node, strerror(errno));
+
+  if (place->fifo > 0) {
+    struct sched_param param = {.sched_priority = place->fifo};
+    int err                  = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err != 0) printf("%s couldn't run SCHED_FIFO at priority %d: %s\n", name, place->fifo, strerror(err));
   }
+  return result;
 }
 
 //===================================================================================================================================================
@@ -891,7 +1399,7 @@ void *UDP_recv() {
 
   //--------------- Set CPU affinity ---------------
 
-  printf("Set process UDP_recv cpu affinity returned %d\n", set_cpu_affinity(conf.cpu_mask_UDP_recv));
+  printf("Set process UDP_recv cpu affinity returned %d\n", set_cpu_affinity(&conf.place_UDP_recv, "recv"));
   fflush(stdout);
 
   //---------------- Initialize and declare variables ------------------------
@@ -902,6 +1410,7 @@ void *UDP_recv() {
   int64_t UDP_slots_empty_min = UDP_num_slots + 1;  // what's the smallest number of empty slots we've seen this batch?  (Set an initial value that will always be beaten)
 
   int64_t Num_loops_when_full = 0;  // How many times (since program start) have we checked if there was room in the buffer and there wasn't any left  :-(
+  unsigned space_seen         = 0;  // ring_space when we last worked out UDP_slots_empty
 
   int retval;  // General return value variable.  Context dependant.
 
@@ -981,12 +1490,14 @@ void *UDP_recv() {
       if ((retval = recvmmsg(fd, UDP_first_empty_ptr, UDP_slots_empty, RECVMMSG_MODE, NULL)) == -1) continue;
 
       UDP_added_to_buff += retval;  // Add that to the number we've ever seen and placed in the buffer
+      stage_signal(&ring_data);     // and tell UDP_parse
 
     } else {
       Num_loops_when_full++;
-      usleep(1000);  // we should chill for a moment rather than take 100% CPU waiting on someone else to consume packets
+      stage_wait(&ring_space, space_seen, 100);  // we should chill until UDP_parse frees some rather than take 100% CPU waiting on someone else to consume packets
     }
 
+    space_seen      = stage_seq(&ring_space);  // Before we look, so we'll hear about anything UDP_parse frees after
     UDP_slots_empty = UDP_num_slots + UDP_removed_from_buff - UDP_added_to_buff;  // How many UDP slots are available for us to (ask to) read using the one recvmmsg() request?
 
     if (UDP_slots_empty < UDP_slots_empty_min)
@@ -1017,230 +1528,415 @@ void *UDP_recv() {
   pthread_exit(NULL);
 }
 
+// Each tile_hot_t array gets its own cache lines, all from one block owned by rf_input
+#define HOT_LINES(n, type) ((((size_t)(n) * sizeof(type)) + 63) & ~(size_t)63)
+
+void tile_hot_alloc(tile_hot_t *hot, int n) {
+  char *block             = calloc_aligned_or_die(2 * HOT_LINES(n, uint16_t) + 6 * HOT_LINES(n, double), 1, "hot tile metadata");
+  hot->rf_input           = (uint16_t *)block;
+  hot->ws_delay           = (int16_t *)(block += HOT_LINES(n, uint16_t));
+  hot->initial_delay      = (double *)(block += HOT_LINES(n, int16_t));
+  hot->delta_delay        = (double *)(block += HOT_LINES(n, double));
+  hot->delta_delta_delay  = (double *)(block += HOT_LINES(n, double));
+  hot->start_total_delay  = (double *)(block += HOT_LINES(n, double));
+  hot->middle_total_delay = (double *)(block += HOT_LINES(n, double));
+  hot->end_total_delay    = (double *)(block += HOT_LINES(n, double));
+}
+
+void tile_hot_clear(tile_hot_t *hot, int n) {
+  memset(hot->rf_input, 0, n * sizeof(uint16_t));
+  memset(hot->ws_delay, 0, n * sizeof(int16_t));
+  memset(hot->initial_delay, 0, n * sizeof(double));
+  memset(hot->delta_delay, 0, n * sizeof(double));
+  memset(hot->delta_delta_delay, 0, n * sizeof(double));
+  memset(hot->start_total_delay, 0, n * sizeof(double));
+  memset(hot->middle_total_delay, 0, n * sizeof(double));
+  memset(hot->end_total_delay, 0, n * sizeof(double));
+}
+
+// Get a slot ready for reuse.  Only what the last subobs could have written is cleared - the first rf_seen rows of the packet and arrival tables,
+// the rf2ndx entries those rows came from, NINPUTS rows of rf_inp and hot and the fields before rf2ndx - so it costs in proportion to the inputs actually
+// seen, not max_inputs, and doesn't drag megabytes of untouched zeros through the cache.  The table pointers and buffers are kept.
 void clear_slot(int slot) {
-  memset(sub[slot].udp_volts[1], 0, MAX_INPUTS * UDP_PER_RF_PER_SUB * sizeof(char *));
-  memset(sub[slot].udp_arrivals[1], 0, MAX_INPUTS * UDP_PER_RF_PER_SUB * sizeof(float));
+  subobs_udp_meta_t *subm = &sub[slot];
+  int rows                = (subm->rf_seen < max_inputs) ? subm->rf_seen : max_inputs;  // Rows 1 to rf_seen.  Row 0 is never written
 
-  char ***voltage_save  = sub[slot].udp_volts;
-  float **arrivals_save = sub[slot].udp_arrivals;
-  memset(&sub[slot], 0, sizeof(subobs_udp_meta_t));
-  sub[slot].udp_volts    = voltage_save;
-  sub[slot].udp_arrivals = arrivals_save;
+  memset(subm->udp_volts[1], 0, (size_t)rows * UDP_PER_RF_PER_SUB * sizeof(uint32_t));  // The rows are contiguous
+  memset(subm->udp_arrivals[1], 0, (size_t)rows * UDP_PER_RF_PER_SUB * sizeof(uint16_t));
+  if (subm->rf_seen > max_inputs) {  // Some inputs got an rf2ndx entry but no row, so we don't know which
+    memset(subm->rf2ndx, 0, sizeof(subm->rf2ndx));
+  } else {
+    for (int row = 1; row <= rows; row++) subm->rf2ndx[subm->ndx2rf[row]] = 0;
+  }
+  memset(subm->rf_inp, 0, (size_t)subm->NINPUTS * sizeof(tile_meta_t));  // add_meta_fits caps NINPUTS at max_inputs
+  tile_hot_clear(&subm->hot, subm->NINPUTS);
+  memset(subm, 0, offsetof(subobs_udp_meta_t, rf2ndx));                  // and last, as it clears rf_seen and NINPUTS
 }
 
-//------------------------------------------------------------------------------------------------------------------------------------------------------
-// UDP_parse - Check UDP packets as they arrive and update the array of pointers to them so we can later address them in sorted order
-//------------------------------------------------------------------------------------------------------------------------------------------------------
+// Allocate count subobs metadata structures, each with room for max_inputs inputs in rf_inp and hot.  Everything else a reader might fill in (the beam
+// tables) is grown as needed.  The slots in sub also get their packet tables from alloc_sub_slots().
+subobs_udp_meta_t *alloc_subobs(int count, char *name) {
+  subobs_udp_meta_t *subm = calloc_aligned_or_die(count, sizeof(subobs_udp_meta_t), name);
+  for (int loop = 0; loop < count; loop++) {
+    subm[loop].rf_inp = calloc_aligned_or_die(max_inputs, sizeof(tile_meta_t), "rf_inp");
+    tile_hot_alloc(&subm[loop].hot, max_inputs);
+  }
+  return subm;
+}
 
-void *UDP_parse() {
-  printf("UDP_parse started\n");
-  fflush(stdout);
+void free_subobs(subobs_udp_meta_t *subm, int count) {
+  for (int loop = 0; loop < count; loop++) {
+    free(subm[loop].rf_inp);
+    free(subm[loop].hot.rf_input);
+    free(subm[loop].altaz);
+    free(subm[loop].beam_delays);
+  }
+  free(subm);
+}
 
-  //--------------- Set CPU affinity ---------------
+// Allocate the sub_slots subobs metadata slots and their packet reference and arrival time arrays, with room for max_inputs inputs.  Their size
+// depends on the sample rate and mwax.cfg's tiles, so conf must have been read first, and the references are into UDPbuf, so that must have been
+// allocated.  Each table's rows are in one pinned block (see alloc_pinned_or_die()), and every row is UDP_PER_RF_PER_SUB entries after the last.
+void alloc_sub_slots() {
+  stage_queues_reset();
+  sub = alloc_subobs(sub_slots, "sub");  // Make slots to store the metadata against the maximum number of subobs that can be open at one time
+
+  for (int slot = 0; slot < sub_slots; slot++) {
+    sub[slot].ring      = UDPbuf;
+    sub[slot].ndx2rf    = calloc_aligned_or_die(max_inputs + 1, sizeof(uint16_t), "row to rf_input map");
+    sub[slot].udp_volts = calloc_or_die(max_inputs + 1, sizeof(uint32_t *), "packet reference pointer array");
+    uint32_t *cursor    = alloc_pinned_or_die(UDP_PER_RF_PER_SUB * (max_inputs + 1), sizeof(uint32_t), -1, "packet reference array");
+    // sub[slot].udp_volts[0] is only dereferenced for writing out dummy data
+    for (int input = 0; input < max_inputs + 1; input++) {
+      sub[slot].udp_volts[input] = cursor;
+      cursor += UDP_PER_RF_PER_SUB;
+    }
+  }
 
-  printf("Set process UDP_parse cpu affinity returned %d\n", set_cpu_affinity(conf.cpu_mask_UDP_parse));
-  fflush(stdout);
+  for (int slot = 0; slot < sub_slots; slot++) {
+    sub[slot].delay_table = calloc_aligned_or_die(max_inputs, sizeof(delay_table_entry_t), "delay table");
+  }
 
-  //---------------- Initialize and declare variables ------------------------
+  for (int slot = 0; slot < sub_slots; slot++) {
+    sub[slot].udp_arrivals = calloc_or_die(max_inputs + 1, sizeof(uint16_t *), "packet arrival time pointer array");
+    uint16_t *cursor       = alloc_pinned_or_die(UDP_PER_RF_PER_SUB * (max_inputs + 1), sizeof(uint16_t), -1, "packet arrival time array");
+    // sub[slot].udp_arrivals[0] is only dereferenced for wriring out dummy data
+    for (int input = 0; input < max_inputs + 1; input++) {
+      sub[slot].udp_arrivals[input] = cursor;
+      cursor += UDP_PER_RF_PER_SUB;
+    }
+  }
+}
+
+void free_sub_slots() {
+  for (int slot = 0; slot < sub_slots; slot++) {
+    free_pinned(sub[slot].udp_volts[0]);  // The rows all point into one block
+    free(sub[slot].udp_volts);
+    free_pinned(sub[slot].udp_arrivals[0]);
+    free(sub[slot].udp_arrivals);
+    free(sub[slot].ndx2rf);
+    free(sub[slot].delay_table);
+  }
+  free_subobs(sub, sub_slots);
+}
+
+// The slot collecting packets for a subobs, or -1 if none is
+static inline int slot_find(uint32_t subobs) {
+  for (int slot = 0; slot < sub_slots; slot++)
+    if (slot_state[slot] == 1 && sub[slot].subobs == subobs) return slot;
+  return -1;
+}
+
+// A free slot for a new subobs, or -1 if they're all in use (ie makesub or add_meta_fits have fallen sub_slots - 2 subobs behind).  Only UDP_parse
+// takes slots, so a free one stays free until we mark it.
+static inline int slot_claim() {
+  for (int slot = 0; slot < sub_slots; slot++)
+    if (slot_state[slot] == 0) return slot;
+  return -1;
+}
+
+//------------------------------------------------------------------------------------------------------------------------------------------------------
+// UDP_parse - Check UDP packets as they arrive and update the array of pointers to them so we can later address them in sorted order
+//------------------------------------------------------------------------------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------------------------------------------------------------------------------
+// Rate specialised kernels.  SAMPLES_PER_SEC and everything derived from it depend on conf.oversampling, so in the per packet and per line loops
+// every use is a load, a branch and (for the line and packet counts) a divide by something the compiler can't see.  The hot kernels - parsing packets
+// into their slot, and planning and copying the voltage blocks - are written once as always_inline functions taking the rate as a parameter, and
+// instantiated for 1.28 MS/s and 1.6384 MS/s with it constant.  select_rate_kernels() picks the set once the config has been read.  Until then (and
+// for "-b rates" to compare against) the generic set reads the rate at run time as before.
+//------------------------------------------------------------------------------------------------------------------------------------------------------
 
-  uint32_t last_good_packet_sub_time = 0;           // What sub obs was the last packet (for caching)
+typedef struct parse_state parse_state_t;
+typedef struct gather_line gather_line_t;
+typedef struct copy_job copy_job_t;
+
+typedef struct rate_kernels {
+  const char *name;
+  int64_t (*parse)(parse_state_t *ps);                                                                         // UDP_parse()'s packet loop
+  void (*plan)(gather_line_t *plan, const subobs_udp_meta_t *subm, const MandC_meta_t *MandC, int ninputs);  // build_gather_plan()
+  void (*write)(copy_job_t *job);                                                                              // write_volt_blocks()
+} rate_kernels_t;
+
+// Everything UDP_parse() needs to remember between batches of packets
+struct parse_state {
+  uint32_t last_good_packet_sub_time;  // What sub obs was the last packet (for caching)
+  uint32_t start_window;               // the oldest subobservation we're accepting packets for.
+  uint32_t end_window;                 // the newest subobservation page of current window
+  int slot_index;                      // index into which of the subobs metadata blocks we want
+  subobs_udp_meta_t *this_sub;         // Pointer to the relevant one of the subobs metadata arrays
+  mwa_udp_packet_t *last_translated;
+};
+
+// Process every packet waiting in the buffer.  Returns how many passes it made (0 if there was nothing to do).  Instantiated per sample rate by
+// rate_kernels_t, so 'oversampled' is a compile time constant.
+static inline __attribute__((always_inline)) int64_t parse_packets(parse_state_t *ps, const bool oversampled) {
+  uint32_t last_good_packet_sub_time = ps->last_good_packet_sub_time;
   uint32_t subobs_mask               = 0xFFFFFFF8;  // Mask to apply with '&' to get sub obs from GPS second
 
   // time is divided in to 8 second 'slots' (one per subobservation), referenced by their first second in GPS time
   // these variables track the range of slots we are currently accepting packets for
-  uint32_t start_window = 0;  // the oldest subobservation we're accepting packets for.
-  uint32_t end_window   = 0;  // the newest subobservation page of current window (equal to old "end_window"-7).  Recalc window when we receive a packet for a later page.
+  uint32_t start_window = ps->start_window;  // the oldest subobservation we're accepting packets for.
+  uint32_t end_window   = ps->end_window;    // the newest subobservation page of current window (equal to old "end_window"-7).
+                                             // Recalc window when we receive a packet for a later page.
+
+  int slot_index = ps->slot_index;  // index into which of the subobs metadata blocks we want
+  int rf_ndx;                       // index into the position in the meta array we are using for this rf input (for this sub).
+                                    // NB May be different for the same rf on a different sub.
+
+  subobs_udp_meta_t *this_sub = ps->this_sub;  // Pointer to the relevant one of the subobs metadata arrays
+
+  int expected_packet_type = oversampled ? MWA_PACKET_TYPE_OVERSAMPLING : MWA_PACKET_TYPE_LEGACY;
+
+  mwa_udp_packet_t *last_translated = ps->last_translated;
+  int64_t passes                    = 0;
+  while (!terminate && UDP_removed_from_buff < UDP_added_to_buff) {  // While there is at least one packet waiting to be processed
+    passes++;
+    mwa_udp_packet_t *my_udp;                                 // Make a local pointer to the UDP packet we're working on
+    my_udp = &UDPbuf[UDP_removed_from_buff % UDP_num_slots];  // and point to it.
+
+    //---------- At this point in the loop, we are about to process the next arrived UDP packet, and it is located at my_udp ----------
+
+    if (my_udp->packet_type == expected_packet_type) {     // If it's a real packet off the network with some fields in network order, they need to be converted to host order and
+                                                           // have a few tweaks made before we can use the packet
+      my_udp->subsec_time   = ntohs(my_udp->subsec_time);  // Convert subsec_time to a usable uint16_t which at this stage is still within a single second
+      my_udp->GPS_time      = ntohl(my_udp->GPS_time);     // Convert GPS_time (bottom 32 bits only) to a usable uint32_t
+      my_udp->rf_input      = ntohs(my_udp->rf_input);     // Convert rf_input to a usable uint16_t
+      my_udp->edt2udp_token = ntohs(my_udp->edt2udp_token);  // Convert edt2udp_token to a usable uint16_t
+      last_translated       = my_udp;
+      // the bottom three bits of the GPS_time is 'which second within the subobservation' this second is
+      // Change the subsec field to be the packet count within a whole subobs, not just this second. was 0 to 624.  now 1 to 5000 inclusive.
+      // (0x21 packets can be 0 to 5001!)
+      my_udp->subsec_time += ((my_udp->GPS_time & 0b111) * SUBSECSPERSEC_AT(oversampled)) + 1;
+
+      my_udp->GPS_time &= subobs_mask;
+      my_udp->packet_type = 0x21;  // Now change the packet type to a 0x21 to say it's similar to a 0x20 but in host byte order and with a subobs timestamp
+    }
 
-  int slot_index;  // index into which of the 4 subobs metadata blocks we want
-  int rf_ndx;      // index into the position in the meta array we are using for this rf input (for this sub).  NB May be different for the same rf on a different sub.
+    uint32_t now  = 0;
+    int now_msec  = 0;
+    {
+      struct timespec this_time;
+      clock_gettime(CLOCK_REALTIME, &this_time);
+      now     = (this_time.tv_sec - GPS_offset);
+      now_msec = this_time.tv_nsec / 1000000;
+    }
 
-  subobs_udp_meta_t *this_sub = NULL;  // Pointer to the relevant one of the four subobs metadata arrays
+    if ((my_udp->packet_type != 0x21) ||  // wrong packet type
+        (my_udp->GPS_time < now - 32) ||  // packet almost certainly has a bad timestamp
+        (my_udp->GPS_time > now + 9)      // Note that this validly be for the near future if we're writing a margin packet into next subobs
+    ) {                                   // This packet is not a valid packet for us.
 
-  int expected_packet_type = conf.oversampling ? MWA_PACKET_TYPE_OVERSAMPLING : MWA_PACKET_TYPE_LEGACY;
+      if (my_udp != last_translated) {                         // we haven't translated to network order. Do this before we log the contents.
+        my_udp->subsec_time   = ntohs(my_udp->subsec_time);    // Convert subsec_time to a usable uint16_t which at this stage is still within a single second
+        my_udp->GPS_time      = ntohl(my_udp->GPS_time);       // Convert GPS_time (bottom 32 bits only) to a usable uint32_t
+        my_udp->rf_input      = ntohs(my_udp->rf_input);       // Convert rf_input to a usable uint16_t
+        my_udp->edt2udp_token = ntohs(my_udp->edt2udp_token);  // Convert edt2udp_token to a usable uint16_t
+      }
 
-  //---------------- Main loop to process incoming udp packets -------------------
+      if (my_udp->packet_type == MWA_PACKET_TYPE_LEGACY && expected_packet_type == MWA_PACKET_TYPE_OVERSAMPLING) {
+        // don't log individual packets that were just the wrong sample rate,
+        // lest we flood the log with NI/RRI packets during oversample observations
+        int report_index = slot_find(my_udp->GPS_time & subobs_mask);  // pick a slot in which to increment the ignore count
+        if (report_index != -1) sub[report_index].ignored_packet_count++;
+      } else {
+        report_substatus("UDP_parse", "rejecting packet (packet_type=0x%02x, GPS_time=%d, (now=%d), rf_input=%d, edt2udp_token=0x%04x",  //
+                         my_udp->packet_type, my_udp->GPS_time, now, my_udp->rf_input, my_udp->edt2udp_token);
+      }
+      UDP_removed_from_buff++;  // Flag it as used and release the buffer slot.  We don't want to see it again.
+      continue;                 // start the loop again
+    }
 
-  mwa_udp_packet_t *last_translated = NULL;
-  while (!terminate) {
-    if (UDP_removed_from_buff < UDP_added_to_buff) {            // If there is at least one packet waiting to be processed
-      mwa_udp_packet_t *my_udp;                                 // Make a local pointer to the UDP packet we're working on
-      my_udp = &UDPbuf[UDP_removed_from_buff % UDP_num_slots];  // and point to it.
+    uint16_t relative_arrival_time = arrival_encode((int32_t)(now - my_udp->GPS_time) * 1000 + now_msec);
 
-      //---------- At this point in the loop, we are about to process the next arrived UDP packet, and it is located at my_udp ----------
+    //---------- If this packet is for the same sub obs as the previous packet, we can assume a bunch of things haven't changed or rolled over, otherwise we have things to check
+    if (my_udp->GPS_time != last_good_packet_sub_time) {  // If this is a different sub obs than the last packet we allowed through to be processed.
+      //---------- Arrived too late to be usable?
+      if (my_udp->GPS_time < start_window) {  // This packet has a time stamp before the earliest open sub-observation
+        UDP_removed_from_buff++;              // Throw it away.  ie flag it as used and release the buffer slot.  We don't want to see it again.
+        continue;                             // start the loop again
+      }
 
-      if (my_udp->packet_type == expected_packet_type) {     // If it's a real packet off the network with some fields in network order, they need to be converted to host order and
-                                                             // have a few tweaks made before we can use the packet
-        my_udp->subsec_time   = ntohs(my_udp->subsec_time);  // Convert subsec_time to a usable uint16_t which at this stage is still within a single second
-        my_udp->GPS_time      = ntohl(my_udp->GPS_time);     // Convert GPS_time (bottom 32 bits only) to a usable uint32_t
-        my_udp->rf_input      = ntohs(my_udp->rf_input);     // Convert rf_input to a usable uint16_t
-        my_udp->edt2udp_token = ntohs(my_udp->edt2udp_token);  // Convert edt2udp_token to a usable uint16_t
-        last_translated       = my_udp;
-        // the bottom three bits of the GPS_time is 'which second within the subobservation' this second is
-        my_udp->subsec_time += ((my_udp->GPS_time & 0b111) * SUBSECSPERSEC) + 1;  // Change the subsec field to be the packet count within a whole subobs, not just this second. was
-                                                                                  // 0 to 624.  now 1 to 5000 inclusive. (0x21 packets can be 0 to 5001!)
+      // TODO - continue updating window even if we don't get any packets for a few seconds.
+      //---------- Further ahead in time than we're ready for?
+      if (my_udp->GPS_time > end_window) {
+        // This packet has a time stamp after the end of the latest open sub-observation.  We need to do some preparatory work before we can process this packet.
+
+        // First we need to know if this is simply the next chronological subobs, or if we have skipped ahead.
+        // NB that a closedown packet will look like we skipped ahead to 2106.
+        // If we've skipped ahead, then all current subobs need to be closed.
+        uint32_t start_old = start_window;
+        uint32_t end_old   = end_window;
+        if (my_udp->GPS_time == end_window + 8) {  // just moving up one subobservation, keep this one and the previous one open.
+          start_window = end_window;
+          end_window   = my_udp->GPS_time;
+          report_substatus("UDP_parse", "window adjusted from %d-%d to %d-%d (moving end up by one subobs).", start_old, end_old, start_window, end_window);
+        } else {  // otherwise the packet stream is so far into the future that we need to close *all* open subobs.
+          start_window = end_window = my_udp->GPS_time;
+          report_substatus("UDP_parse", "window adjusted from %d-%d to %d-%d (single subobservation).", start_old, end_old, start_window, end_window);
+        }
 
-        my_udp->GPS_time &= subobs_mask;
-        my_udp->packet_type = 0x21;  // Now change the packet type to a 0x21 to say it's similar to a 0x20 but in host byte order and with a subobs timestamp
+        for (int loop = 0; loop < sub_slots; loop++) {  // check all subobs meta slots. If they're too old we'll rule them off. NB this may not be checked in time order of subobs
+          if ((sub[loop].subobs < start_window) && (slot_state[loop] == 1)) {
+            // If this sub obs slot is currently in use by us (ie state==1) and has now reached its timeout ( < start_window )
+            if (sub[loop].subobs == (start_window - 8)) {  // then if it's a very recent subobs (which is what we'd expect during normal operations)
+              slot_state[loop] = 2;                        // set the state flag to tell another thread it's their job to write out this subobs and pass the data on down the line
+              slot_handoff(loop);
+              report_substatus("UDP_parse", "subobs %d slot %d. Requesting write (setting state to 2).", sub[loop].subobs, loop);
+            } else {                       // or if it isn't recent then it's probably because the receivers (or medconv array) went away so we want to abandon it
+              slot_state[loop] = 6;        // set the state flag to indicate that this subobs should be abandoned as too old to be useful
+              slot_handoff(loop);
+              monitor.discarded_subobs++;  // note that this is just a request - the slot isn't really free until we've also finished reading the metafits
+              report_substatus("UDP_parse", "subobs %d slot %d. Abandoning (setting state to 6).", sub[loop].subobs, loop);
+            }
+          }
+        }
       }
 
-      uint32_t now  = 0;
-      float nowfrac = 0.0f;
-      {
-        struct timespec this_time;
-        clock_gettime(CLOCK_REALTIME, &this_time);
-        now     = (this_time.tv_sec - GPS_offset);
-        nowfrac = (float)this_time.tv_nsec / 1.0e9f;
+      // We now have a new subobs that we need to set up for.  Hopefully the slot we want to use is either empty or finished with and free for reuse.  If not we've overrun the
+      // sub writing threads
+      slot_index = slot_find(my_udp->GPS_time);  // Is a slot already collecting this subobs?
+      if (slot_index == -1 && (slot_index = slot_claim()) != -1) {
+        // If not, we've taken a free one for it
+        report_substatus("UDP_parse", "subobs %d slot %d. First new packet", my_udp->GPS_time, slot_index);
+
+        sub[slot_index].subobs    = my_udp->GPS_time;       // We've already cleared the low three bits.
+        sub[slot_index].first_udp = UDP_removed_from_buff;  // This was the first udp packet seen for this sub. (0 based)
+        slot_state[slot_index]    = 1;                      // Let's remember we're using this slot now and tell other threads.
+        meta_state[slot_index]    = 1;                      // request metafits read
+        // NB: The subobs field must be populated *before* these become 1
+        stage_queue_push(&meta_queue, slot_index);
       }
 
-      if ((my_udp->packet_type != 0x21) ||  // wrong packet type
-          (my_udp->GPS_time < now - 32) ||  // packet almost certainly has a bad timestamp
-          (my_udp->GPS_time > now + 9)      // Note that this validly be for the near future if we're writing a margin packet into next subobs
-      ) {                                   // This packet is not a valid packet for us.
+      //---------- This packet isn't similar enough to previous ones (ie from the same sub-obs) to assume things, so let's get new pointers
+      if (slot_index != -1) {
+        this_sub                  = &sub[slot_index];  // The slot gives us the pointer to the struct
+        last_good_packet_sub_time = my_udp->GPS_time;  // Remember this so next packet we probably don't need to do these checks and lookups again
 
-        if (my_udp != last_translated) {                         // we haven't translated to network order. Do this before we log the contents.
-          my_udp->subsec_time   = ntohs(my_udp->subsec_time);    // Convert subsec_time to a usable uint16_t which at this stage is still within a single second
-          my_udp->GPS_time      = ntohl(my_udp->GPS_time);       // Convert GPS_time (bottom 32 bits only) to a usable uint32_t
-          my_udp->rf_input      = ntohs(my_udp->rf_input);       // Convert rf_input to a usable uint16_t
-          my_udp->edt2udp_token = ntohs(my_udp->edt2udp_token);  // Convert edt2udp_token to a usable uint16_t
-        }
+      } else {
+        // TODO - report this condition in health packet.
+        // Note that it will already show up as increased packet loss though, so priority on additional reporting is not high.
+        report_substatus("UDP_parse", "subobs %d. Packet received but no slot available", my_udp->GPS_time);
+        this_sub = NULL;
+        // the subobs metadata array which we use to get the pointer to the struct
+        last_good_packet_sub_time = -1;
+      }
+    }
 
-        if (my_udp->packet_type == MWA_PACKET_TYPE_LEGACY && expected_packet_type == MWA_PACKET_TYPE_OVERSAMPLING) {
-          // don't log individual packets that were just the wrong sample rate,
-          // lest we flood the log with NI/RRI packets during oversample observations
-          int report_index = (my_udp->GPS_time >> 3) & 0b11;  // pick a slot in which to increment the ignore count
-          sub[report_index].ignored_packet_count++;
+    if (this_sub) {
+      //---------- We have a udp packet to add and a place for it to go.  Time to add its details to the sub obs metadata
+      rf_ndx = this_sub->rf2ndx[my_udp->rf_input];               // Look up the position in the meta array we are using for this rf input (for this sub).
+      if (rf_ndx == 0) {                                         // this is the first time we've seen one this sub from this rf input
+        this_sub->rf_seen++;                                     // Increase the number of different rf inputs seen so far.  START AT 1, NOT 0!
+        this_sub->rf2ndx[my_udp->rf_input] = this_sub->rf_seen;  // and assign that number for this rf input's metadata index
+        rf_ndx                             = this_sub->rf_seen;  // and get the correct index for this packet too because we'll need that
+        if (rf_ndx <= max_inputs) {
+          this_sub->ndx2rf[rf_ndx] = my_udp->rf_input;  // so clear_slot() knows which rf2ndx entries to clear
         } else {
-          report_substatus("UDP_parse", "rejecting packet (packet_type=0x%02x, GPS_time=%d, (now=%d), rf_input=%d, edt2udp_token=0x%04x",  //
-                           my_udp->packet_type, my_udp->GPS_time, now, my_udp->rf_input, my_udp->edt2udp_token);
+          report_substatus("UDP_parse", "subobs %d slot %d. More than %d unique inputs seen, discarding rf_input %4d (%dth seen)", my_udp->GPS_time, slot_index, max_inputs,
+                           my_udp->rf_input, rf_ndx);
         }
-        UDP_removed_from_buff++;  // Flag it as used and release the buffer slot.  We don't want to see it again.
-        continue;                 // start the loop again
       }
 
-      float relative_arrival_time = (float)(now - my_udp->GPS_time) + nowfrac;
-      if (relative_arrival_time == 0.0f) {
-        relative_arrival_time = FLT_MIN;
+      if (rf_ndx <= max_inputs) {
+        sub[slot_index].udp_volts[rf_ndx][my_udp->subsec_time] = (UDP_removed_from_buff % UDP_num_slots) + 1;  // This is an important line so lets unpack what it does and why.
+        // The 'this_sub' struct stores a 2D array of references (udp_volt) to all the udp packets that apply to that sub obs.
+        // The dimensions are rf_input (sorted by the order in which they were seen on the incoming packet stream) and the packet count (0 to 5001) inside the subobs.
+        // By this stage, seconds and subsecs have been merged into a single number so subsec time is already in the range 0 to 5001
+
+        sub[slot_index].udp_arrivals[rf_ndx][my_udp->subsec_time] = relative_arrival_time;
       }
 
-      //---------- If this packet is for the same sub obs as the previous packet, we can assume a bunch of things haven't changed or rolled over, otherwise we have things to check
-      if (my_udp->GPS_time != last_good_packet_sub_time) {  // If this is a different sub obs than the last packet we allowed through to be processed.
-        //---------- Arrived too late to be usable?
-        if (my_udp->GPS_time < start_window) {  // This packet has a time stamp before the earliest open sub-observation
-          UDP_removed_from_buff++;              // Throw it away.  ie flag it as used and release the buffer slot.  We don't want to see it again.
-          continue;                             // start the loop again
-        }
+      this_sub->last_udp = UDP_removed_from_buff;  // The last udp packet seen so far for this sub. (0 based) Eventually it won't be updated and the final value will remain
+      this_sub->udp_count++;                       // Add one to the number of udp packets seen this sub obs.
+                                                   // We rarely get all ninputs*5000 packets for a given sub obs, so even if
+                                                   // we didn't count duplicates we still couldn't use this to check if we've finished a sub.
+      monitor.udp_count++;
+    }
 
-        // TODO - continue updating window even if we don't get any packets for a few seconds.
-        //---------- Further ahead in time than we're ready for?
-        if (my_udp->GPS_time > end_window) {
-          // This packet has a time stamp after the end of the latest open sub-observation.  We need to do some preparatory work before we can process this packet.
-
-          // First we need to know if this is simply the next chronological subobs, or if we have skipped ahead.
-          // NB that a closedown packet will look like we skipped ahead to 2106.
-          // If we've skipped ahead, then all current subobs need to be closed.
-          uint32_t start_old = start_window;
-          uint32_t end_old   = end_window;
-          if (my_udp->GPS_time == end_window + 8) {  // just moving up one subobservation, keep this one and the previous one open.
-            start_window = end_window;
-            end_window   = my_udp->GPS_time;
-            report_substatus("UDP_parse", "window adjusted from %d-%d to %d-%d (moving end up by one subobs).", start_old, end_old, start_window, end_window);
-          } else {  // otherwise the packet stream is so far into the future that we need to close *all* open subobs.
-            start_window = end_window = my_udp->GPS_time;
-            report_substatus("UDP_parse", "window adjusted from %d-%d to %d-%d (single subobservation).", start_old, end_old, start_window, end_window);
-          }
+    //---------- We are done with this packet, EXCEPT if this was the very first for an rf_input for a subobs, or the very last, then we want to duplicate them in the adjacent
+    // subobs.
+    //---------- This is because one packet may contain data that goes in two subobs (or even separate obs!) due to delay tracking
+    if (my_udp->subsec_time == 1) {                     // If this was the first packet (for an rf input) for a subobs
+      my_udp->subsec_time = SUBSECSPERSUB_AT(oversampled) + 1;          // then say it's at the end of a subobs
+      my_udp->GPS_time -= 8;                            // and move it into the previous subobs
+    } else if (my_udp->subsec_time == SUBSECSPERSUB_AT(oversampled)) {  // If this was the last packet (for an rf input) for a subobs
+      my_udp->subsec_time = 0;                          // then say it's at the start of a subobs
+      my_udp->GPS_time += 8;                            // and move it into the next subobs
+    } else {
+      UDP_removed_from_buff++;  // We don't need to duplicate this packet, so incr the number of packets we've ever processed (which releases the packet from the buffer).
+    }
 
-          for (int loop = 0; loop < SUB_SLOTS; loop++) {  // check all subobs meta slots. If they're too old we'll rule them off. NB this may not be checked in time order of subobs
-            if ((sub[loop].subobs < start_window) && (slot_state[loop] == 1)) {
-              // If this sub obs slot is currently in use by us (ie state==1) and has now reached its timeout ( < start_window )
-              if (sub[loop].subobs == (start_window - 8)) {  // then if it's a very recent subobs (which is what we'd expect during normal operations)
-                slot_state[loop] = 2;                        // set the state flag to tell another thread it's their job to write out this subobs and pass the data on down the line
-                report_substatus("UDP_parse", "subobs %d slot %d. Requesting write (setting state to 2).", sub[loop].subobs, loop);
-              } else {                       // or if it isn't recent then it's probably because the receivers (or medconv array) went away so we want to abandon it
-                slot_state[loop] = 6;        // set the state flag to indicate that this subobs should be abandoned as too old to be useful
-                monitor.discarded_subobs++;  // note that this is just a request - the slot isn't really free until we've also finished reading the metafits
-                report_substatus("UDP_parse", "subobs %d slot %d. Abandoning (setting state to 6).", sub[loop].subobs, loop);
-              }
-            }
-          }
-        }
+    //---------- End of processing of this UDP packet ----------
 
-        // We now have a new subobs that we need to set up for.  Hopefully the slot we want to use is either empty or finished with and free for reuse.  If not we've overrun the
-        // sub writing threads
-        slot_index = (my_udp->GPS_time >> 3) & 0b11;  // The 3 LSB are 'what second in the subobs' we are.  We want the 2 bits immediately to the left of that.  They will give us
-        // our index into the subobs metadata array
-        if (slot_state[slot_index] == 0) {
-          // If the state is a 0, then it's free for reuse,
-          report_substatus("UDP_parse", "subobs %d slot %d. First new packet", my_udp->GPS_time, slot_index);
-
-          sub[slot_index].subobs    = my_udp->GPS_time;       // We've already cleared the low three bits.
-          sub[slot_index].first_udp = UDP_removed_from_buff;  // This was the first udp packet seen for this sub. (0 based)
-          slot_state[slot_index]    = 1;                      // Let's remember we're using this slot now and tell other threads.
-          meta_state[slot_index]    = 1;                      // request metafits read
-          // NB: The subobs field must be populated *before* these become 1
-        }
+  }
 
-        //---------- This packet isn't similar enough to previous ones (ie from the same sub-obs) to assume things, so let's get new pointers
-        if (slot_state[slot_index] == 1) {
-          this_sub = &sub[slot_index];  // The 3 LSB are 'what second in the subobs' we are.  We want the 2 bits left of that.  They will give us an index into
-          // the subobs metadata array which we use to get the pointer to the struct
-          last_good_packet_sub_time = my_udp->GPS_time;  // Remember this so next packet we probably don't need to do these checks and lookups again
+  ps->last_good_packet_sub_time = last_good_packet_sub_time;
+  ps->start_window              = start_window;
+  ps->end_window                = end_window;
+  ps->slot_index                = slot_index;
+  ps->this_sub                  = this_sub;
+  ps->last_translated           = last_translated;
+  return passes;
+}
 
-        } else {
-          // TODO - report this condition in health packet.
-          // Note that it will already show up as increased packet loss though, so priority on additional reporting is not high.
-          report_substatus("UDP_parse", "subobs %d slot %d. Packet received but slot not available", my_udp->GPS_time, slot_index);
-          this_sub = NULL;
-          // the subobs metadata array which we use to get the pointer to the struct
-          last_good_packet_sub_time = -1;
-        }
-      }
+int64_t parse_packets_legacy(parse_state_t *ps) { return parse_packets(ps, false); }
+int64_t parse_packets_oversampled(parse_state_t *ps) { return parse_packets(ps, true); }
+int64_t parse_packets_generic(parse_state_t *ps) { return parse_packets(ps, conf.oversampling); }
 
-      if (this_sub) {
-        //---------- We have a udp packet to add and a place for it to go.  Time to add its details to the sub obs metadata
-        rf_ndx = this_sub->rf2ndx[my_udp->rf_input];               // Look up the position in the meta array we are using for this rf input (for this sub).
-        if (rf_ndx == 0) {                                         // this is the first time we've seen one this sub from this rf input
-          this_sub->rf_seen++;                                     // Increase the number of different rf inputs seen so far.  START AT 1, NOT 0!
-          this_sub->rf2ndx[my_udp->rf_input] = this_sub->rf_seen;  // and assign that number for this rf input's metadata index
-          rf_ndx                             = this_sub->rf_seen;  // and get the correct index for this packet too because we'll need that
-          if (rf_ndx > MAX_INPUTS) {
-            report_substatus("UDP_parse", "subobs %d slot %d. More than %d unique inputs seen, discarding rf_input %4d (%dth seen)", my_udp->GPS_time, slot_index, MAX_INPUTS,
-                             my_udp->rf_input, rf_ndx);
-          }
-        }
+void build_gather_plan_legacy(gather_line_t *plan, const subobs_udp_meta_t *subm, const MandC_meta_t *MandC, int ninputs);
+void build_gather_plan_oversampled(gather_line_t *plan, const subobs_udp_meta_t *subm, const MandC_meta_t *MandC, int ninputs);
+void build_gather_plan_generic(gather_line_t *plan, const subobs_udp_meta_t *subm, const MandC_meta_t *MandC, int ninputs);
+void write_volt_blocks_legacy(copy_job_t *job);
+void write_volt_blocks_oversampled(copy_job_t *job);
+void write_volt_blocks_generic(copy_job_t *job);
 
-        if (rf_ndx <= MAX_INPUTS) {
-          sub[slot_index].udp_volts[rf_ndx][my_udp->subsec_time] = (char *)my_udp->volts;  // This is an important line so lets unpack what it does and why.
-          // The 'this_sub' struct stores a 2D array of pointers (udp_volt) to all the udp payloads that apply to that sub obs.
-          // The dimensions are rf_input (sorted by the order in which they were seen on the incoming packet stream) and the packet count (0 to 5001) inside the subobs.
-          // By this stage, seconds and subsecs have been merged into a single number so subsec time is already in the range 0 to 5001
+const rate_kernels_t legacy_kernels      = {"legacy (1.28 MS/s)", parse_packets_legacy, build_gather_plan_legacy, write_volt_blocks_legacy};
+const rate_kernels_t oversampled_kernels = {"oversampled (1.6384 MS/s)", parse_packets_oversampled, build_gather_plan_oversampled, write_volt_blocks_oversampled};
+const rate_kernels_t generic_kernels     = {"generic", parse_packets_generic, build_gather_plan_generic, write_volt_blocks_generic};
+const rate_kernels_t *rate_kernels       = &generic_kernels;
 
-          sub[slot_index].udp_arrivals[rf_ndx][my_udp->subsec_time] = relative_arrival_time;
-        }
+void select_rate_kernels() { rate_kernels = conf.oversampling ? &oversampled_kernels : &legacy_kernels; }
 
-        this_sub->last_udp = UDP_removed_from_buff;  // The last udp packet seen so far for this sub. (0 based) Eventually it won't be updated and the final value will remain
-        this_sub->udp_count++;                       // Add one to the number of udp packets seen this sub obs.
-                                                     // We rarely get all ninputs*5000 packets for a given sub obs, so even if
-                                                     // we didn't count duplicates we still couldn't use this to check if we've finished a sub.
-        monitor.udp_count++;
-      }
+void *UDP_parse() {
+  printf("UDP_parse started\n");
+  fflush(stdout);
 
-      //---------- We are done with this packet, EXCEPT if this was the very first for an rf_input for a subobs, or the very last, then we want to duplicate them in the adjacent
-      // subobs.
-      //---------- This is because one packet may contain data that goes in two subobs (or even separate obs!) due to delay tracking
-      if (my_udp->subsec_time == 1) {                     // If this was the first packet (for an rf input) for a subobs
-        my_udp->subsec_time = SUBSECSPERSUB + 1;          // then say it's at the end of a subobs
-        my_udp->GPS_time -= 8;                            // and move it into the previous subobs
-      } else if (my_udp->subsec_time == SUBSECSPERSUB) {  // If this was the last packet (for an rf input) for a subobs
-        my_udp->subsec_time = 0;                          // then say it's at the start of a subobs
-        my_udp->GPS_time += 8;                            // and move it into the next subobs
-      } else {
-        UDP_removed_from_buff++;  // We don't need to duplicate this packet, so incr the number of packets we've ever processed (which releases the packet from the buffer).
-      }
+  //--------------- Set CPU affinity ---------------
+
+  printf("Set process UDP_parse cpu affinity returned %d\n", set_cpu_affinity(&conf.place_UDP_parse, "parse"));
+  fflush(stdout);
+
+  parse_state_t state = {0};
 
-      //---------- End of processing of this UDP packet ----------
+  //---------------- Main loop to process incoming udp packets -------------------
 
-    } else {          //
-      usleep(10000);  // Chill for a bit
+  while (!terminate) {
+    unsigned seen = stage_seq(&ring_data);
+    if (rate_kernels->parse(&state) == 0) {
+      stage_wait(&ring_data, seen, 100);  // Nothing waiting, so chill until UDP_recv has some more
+    } else {
+      stage_signal(&ring_space);  // In case UDP_recv was waiting for room
     }
   }
 
@@ -1257,30 +1953,732 @@ long double get_path_difference(long double north, long double east, long double
   return -north * cosl(a) * cosl(b) - east * sinl(a) * cosl(b) - height * sinl(b);
 }
 
-int fits_read_key_verbose(fitsfile *fptr, int datatype, const char *keyname, char *verbose_keyname, void *value, char *comm, int *status) {
-  // TODO - ensure read_metafits() returns false if any of these fail.
-  int res = fits_read_key(fptr, datatype, keyname, value, comm, status);
-  if (*status) {
-    printf("Failed to read %s\n", keyname);
-    fflush(stdout);
-  }
-  return res;
-}
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+// Geometric delay engine.
+//
+// get_path_difference() is -(North, East, Height) . (cos(az)cos(alt), sin(az)cos(alt), sin(alt)).  Rather than redo that trig for every input,
+// each (beam, time step) pointing is turned into a unit vector once, and the path differences for every input and pointing are then a dense
+// [pointing][3] x [3][input] matrix product, done in double with SIMD.  "-b delays" measures the error against the long double path: for
+// positions out to 5km it's under 2e-9 mm, or about 1e-14 samples in a beam delay, far below the float precision DELAY_TABLE2 stores.
+//---------------------------------------------------------------------------------------------------------------------------------------------------
 
-bool read_metafits(const char *metafits_file, subobs_udp_meta_t *subm) {
-  // preconditions:
-  //     subm->subobs >= subm->GPSTIME (the latter as read from the metafits_file, theoretically should be same as the number in the filename)
-  //     conf.coarse_chan > 0
-  //     conf.coarse_chan <= 24
-  // returns:
-  //     false on failure
-  //     true on success
+typedef struct pointing_vec {  // Unit vector towards a pointing, negated so a dot product with a tile position gives the path difference directly
+  double north;
+  double east;
+  double up;
+} pointing_vec_t;
 
-  fitsfile *fptr;  // FITS file pointer, defined in fitsio.h
-  int status = 0;  // CFITSIO status value MUST be initialized to zero!
+typedef double v4d __attribute__((vector_size(32)));
+typedef double v4d_u __attribute__((vector_size(32), aligned(8)));  // For loads and stores that are only 8 byte aligned
 
-  fits_open_file(&fptr, metafits_file, READONLY, &status);
-  if (status) return false;
+pointing_vec_t pointing_vector(float alt, float az) {
+  double b = deg2rad((double)alt);
+  double a = deg2rad((double)az);
+  return (pointing_vec_t){.north = -cos(a) * cos(b), .east = -sin(a) * cos(b), .up = -sin(b)};
+}
+
+// out[pointing * ninputs + input] = path difference in mm of each tile position towards each pointing.
+__attribute__((target_clones("avx2", "default"))) void path_differences(int ninputs, const double *restrict north, const double *restrict east, const double *restrict height,
+                                                                          int npointings, const pointing_vec_t *restrict pointings, double *restrict out) {
+  for (int p = 0; p < npointings; p++) {
+    const double n = pointings[p].north;
+    const double e = pointings[p].east;
+    const double u = pointings[p].up;
+    double *row    = &out[(size_t)p * ninputs];
+    int loop       = 0;
+    for (; loop + 4 <= ninputs; loop += 4) {  // Four inputs at a time.  Two SSE2 or one AVX2 register wide.
+      v4d vn               = *(const v4d_u *)&north[loop];
+      v4d ve               = *(const v4d_u *)&east[loop];
+      v4d vh               = *(const v4d_u *)&height[loop];
+      *(v4d_u *)&row[loop] = vn * n + ve * e + vh * u;
+    }
+    for (; loop < ninputs; loop++) row[loop] = north[loop] * n + east[loop] * e + height[loop] * u;
+  }
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+// DELAY_TABLE - built by add_meta_fits into the slot, so makesub only has to copy it into block 0.
+//
+// Each frac_delay is the residual delay polynomial evaluated at the middle of a 5ms step.  Written in closed form (rather than the running sums
+// makesub used to do) there's no dependency from one step to the next, so we can do four at a time, and split the inputs between a few threads.
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+
+#define DELAY_TABLE_THREADS 4
+
+typedef float v4f_u __attribute__((vector_size(16), aligned(1)));  // frac_delay is in a packed struct
+
+void build_delay_table(subobs_udp_meta_t *subm, int first, int last) {
+  for (int loop = first; loop < last; loop++) {
+    const tile_hot_t *hot      = &subm->hot;
+    delay_table_entry_t *entry = &subm->delay_table[loop];
+
+    entry->rf_input           = hot->rf_input[loop];  // The tile's ID and polarization
+    entry->ws_delay_applied   = hot->ws_delay[loop];  // The tile's whole sample delay
+    entry->start_total_delay  = hot->start_total_delay[loop];
+    entry->middle_total_delay = hot->middle_total_delay[loop];
+    entry->end_total_delay    = hot->end_total_delay[loop];
+    entry->initial_delay      = hot->initial_delay[loop];
+    entry->delta_delay        = hot->delta_delay[loop];
+    entry->delta_delta_delay  = hot->delta_delta_delay[loop];
+    entry->num_pointings      = 1;  // Initially 1, but might grow to 10 or more if beamforming.  The first pointing is for delay tracking in the correlator.
+    entry->reserved           = 0;
+
+    // frac_delay[k] = initial + k * delta + k * (k - 1) / 2 * delta_delta, which is what stepping delta_delay along by delta_delta_delay sums to
+    const double c   = hot->initial_delay[loop];
+    const double d   = hot->delta_delay[loop];
+    const double hdd = hot->delta_delta_delay[loop] * 0.5;
+    char *frac_delay = (char *)entry + offsetof(delay_table_entry_t, frac_delay);
+    v4d k            = {0.0, 1.0, 2.0, 3.0};
+    for (int step = 0; step < POINTINGS_PER_SUB; step += 4) {
+      *(v4f_u *)(frac_delay + step * sizeof(float)) = __builtin_convertvector(c + k * (d + (k - 1.0) * hdd), v4f_u);
+      k += 4.0;
+    }
+  }
+}
+
+// The helpers are started by the first build_delay_tables() and then live as long as we do, waiting on 'go' for the next subobs
+struct {
+  pthread_mutex_t lock;
+  pthread_cond_t go;    // Signalled when there's a new subobs to build tables for
+  pthread_cond_t done;  // Signalled when the last helper finishes its share
+  subobs_udp_meta_t *subm;
+  uint64_t generation;
+  int running;  // Helpers still working on this generation
+  int started;  // Helpers we managed to start, 0 to DELAY_TABLE_THREADS-1
+  bool initialised;
+} delay_pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+void *delay_table_worker(void *arg) {
+  int index     = (int)(intptr_t)arg;  // Which share of the inputs is ours
+  uint64_t seen = 0;
+
+  set_cpu_affinity(&conf.place_parent, "delay");  // Same cpus as the metafits reader that hands us the work
+
+  pthread_mutex_lock(&delay_pool.lock);
+  while (true) {
+    while (delay_pool.generation == seen) pthread_cond_wait(&delay_pool.go, &delay_pool.lock);
+    seen                    = delay_pool.generation;
+    subobs_udp_meta_t *subm = delay_pool.subm;
+    pthread_mutex_unlock(&delay_pool.lock);
+
+    build_delay_table(subm, subm->NINPUTS * index / DELAY_TABLE_THREADS, subm->NINPUTS * (index + 1) / DELAY_TABLE_THREADS);
+
+    pthread_mutex_lock(&delay_pool.lock);
+    if (--delay_pool.running == 0) pthread_cond_signal(&delay_pool.done);
+  }
+  return NULL;
+}
+
+void build_delay_tables(subobs_udp_meta_t *subm) {
+  pthread_mutex_lock(&delay_pool.lock);
+  if (!delay_pool.initialised) {
+    delay_pool.initialised = true;
+    for (int loop = 1; loop < DELAY_TABLE_THREADS; loop++) {  // Share 0 is always done by our caller
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, delay_table_worker, (void *)(intptr_t)loop) != 0) break;
+      pthread_detach(thread);
+      delay_pool.started++;
+    }
+  }
+  delay_pool.subm    = subm;
+  delay_pool.running = delay_pool.started;
+  delay_pool.generation++;
+  pthread_cond_broadcast(&delay_pool.go);
+  int started = delay_pool.started;
+  pthread_mutex_unlock(&delay_pool.lock);
+
+  for (int loop = 0; loop < DELAY_TABLE_THREADS; loop++) {  // Our own share, and anyone else's we couldn't start a thread for
+    if (loop == 0 || loop > started) build_delay_table(subm, subm->NINPUTS * loop / DELAY_TABLE_THREADS, subm->NINPUTS * (loop + 1) / DELAY_TABLE_THREADS);
+  }
+
+  pthread_mutex_lock(&delay_pool.lock);  // Completion barrier.  The slot's DELAY_TABLE must be whole before it goes on to makesub.
+  while (delay_pool.running > 0) pthread_cond_wait(&delay_pool.done, &delay_pool.lock);
+  pthread_mutex_unlock(&delay_pool.lock);
+}
+
+int fits_read_key_verbose(fitsfile *fptr, int datatype, const char *keyname, char *verbose_keyname, void *value, char *comm, int *status) {
+  // TODO - ensure read_metafits() returns false if any of these fail.
+  int res = fits_read_key(fptr, datatype, keyname, value, comm, status);
+  if (*status) {
+    printf("Failed to read %s\n", keyname);
+    fflush(stdout);
+  }
+  return res;
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+// mfits - A minimal, read-only FITS reader that works directly on an mmap of the file.
+//
+// The metafits is small and has a fixed schema, so rather than going through CFITSIO's buffering layers for every keyword and column we map the
+// whole file once, index the HDUs, and decode header cards and table cells in place (FITS is big-endian on disk).  Only what read_metafits()
+// needs is supported: header keywords (including the CONTINUE long-string convention), BINTABLE columns of type A/B/I/J/K/E/D and
+// contiguous pixel ranges of IMAGE extensions.
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+
+#define FITS_BLOCK_SIZE 2880
+#define FITS_CARD_SIZE 80
+#define MFITS_MAX_HDUS 16
+#define MFITS_MAX_COLS 128
+#define MFITS_MAX_AXES 8
+
+typedef struct mfits_col {
+  char name[72];  // TTYPEn
+  char type;      // TFORMn data type code (A, B, I, J, K, E or D)
+  int repeat;     // TFORMn repeat count.  For 'A' columns this is the string width.
+  int width;      // Size in bytes of a single element
+  int offset;     // Byte offset of this column from the start of a row
+} mfits_col_t;
+
+typedef struct mfits_hdu {
+  const char *header;  // First card of the header
+  int ncards;          // Number of cards up to (but not including) END
+  const uint8_t *data;
+  size_t data_size;
+
+  char extname[72];
+  bool is_table;  // BINTABLE (true) or primary/IMAGE (false)
+  int bitpix;
+  int naxis;
+  int64_t naxes[MFITS_MAX_AXES];
+
+  int ncols;  // Only set for BINTABLE HDUs
+  mfits_col_t *cols;
+} mfits_hdu_t;
+
+typedef struct mfits {
+  const char *map;
+  size_t size;
+  int nhdus;
+  mfits_hdu_t hdu[MFITS_MAX_HDUS];
+} mfits_t;
+
+// Find the card for a keyword in an HDU header and return a pointer to its value field (column 11), or NULL if it isn't there.
+const char *mfits_card(const mfits_hdu_t *hdu, const char *key) {
+  size_t klen = strlen(key);
+  for (int card = 0; card < hdu->ncards; card++) {
+    const char *cp = hdu->header + card * FITS_CARD_SIZE;
+    if (memcmp(cp, key, klen) == 0 && (klen == 8 || cp[klen] == ' ') && cp[8] == '=' && cp[9] == ' ') return cp + 10;
+  }
+  return NULL;
+}
+
+// Copy the numeric value field of a card into a nul terminated buffer so strtoll/strtod can't run past the end of the card.
+bool mfits_card_number(const mfits_hdu_t *hdu, const char *key, char *buf) {
+  const char *vp = mfits_card(hdu, key);
+  if (vp == NULL) return false;
+  memcpy(buf, vp, FITS_CARD_SIZE - 10);
+  buf[FITS_CARD_SIZE - 10] = 0;
+  char *slash              = strchr(buf, '/');  // numbers never contain a '/', so anything after one is a comment
+  if (slash) *slash = 0;
+  return true;
+}
+
+bool mfits_key_int64(const mfits_hdu_t *hdu, const char *key, int64_t *value) {
+  char buf[FITS_CARD_SIZE];
+  char *end;
+  if (!mfits_card_number(hdu, key, buf)) return false;
+  double d = strtod(buf, &end);  // CFITSIO accepts a real valued keyword for an integer read, so we do too
+  if (end == buf) return false;
+  *value = (fabs(d) < 9007199254740992.0) ? (int64_t)d : strtoll(buf, NULL, 10);  // but keep full precision beyond 2^53
+  return true;
+}
+
+bool mfits_key_int(const mfits_hdu_t *hdu, const char *key, int *value) {
+  int64_t v;
+  if (!mfits_key_int64(hdu, key, &v)) return false;
+  *value = (int)v;
+  return true;
+}
+
+bool mfits_key_float(const mfits_hdu_t *hdu, const char *key, float *value) {
+  char buf[FITS_CARD_SIZE];
+  char *end;
+  if (!mfits_card_number(hdu, key, buf)) return false;
+  for (char *cp = buf; *cp; cp++)
+    if (*cp == 'D') *cp = 'E';  // FITS allows Fortran style 'D' exponents
+  *value = strtof(buf, &end);
+  return end != buf;
+}
+
+// Unquote the string starting at vp (the first character after the opening quote), appending at most outlen-1 characters to out.
+// Returns a pointer to the closing quote, or NULL if the card ends before we find one.
+const char *mfits_unquote(const char *vp, const char *card_end, char *out, size_t *used, size_t outlen) {
+  while (vp < card_end) {
+    if (*vp == '\'') {
+      if (vp + 1 < card_end && vp[1] == '\'') {  // a doubled quote is an escaped quote
+        vp++;
+      } else {
+        return vp;
+      }
+    }
+    if (*used + 1 < outlen) out[(*used)++] = *vp;
+    vp++;
+  }
+  return NULL;
+}
+
+// Read a string keyword the way CFITSIO's TSTRING read does:  quotes removed, trailing blanks trimmed, truncated to fit.
+bool mfits_key_str(const mfits_hdu_t *hdu, const char *key, char *value, size_t value_len) {
+  const char *vp = mfits_card(hdu, key);
+  if (vp == NULL) return false;
+  const char *card_end = vp + FITS_CARD_SIZE - 10;
+  while (vp < card_end && *vp == ' ') vp++;
+  if (vp == card_end || *vp != '\'') return false;
+  size_t used = 0;
+  if (mfits_unquote(vp + 1, card_end, value, &used, value_len) == NULL) return false;
+  while (used > 0 && value[used - 1] == ' ') used--;
+  value[used] = 0;
+  return true;
+}
+
+// Read a string keyword that may be continued over several cards with the OGIP '&' / CONTINUE convention.
+// The result is malloc'd (like fits_read_key_longstr) and must be freed by the caller.
+bool mfits_key_longstr(const mfits_hdu_t *hdu, const char *key, char **value) {
+  const char *vp = mfits_card(hdu, key);
+  if (vp == NULL) return false;
+
+  size_t cap = FITS_CARD_SIZE;
+  size_t len = 0;
+  char *out  = malloc(cap);
+  if (out == NULL) return false;
+
+  int card = (vp - 10 - hdu->header) / FITS_CARD_SIZE;
+  while (true) {
+    const char *card_end = hdu->header + (card + 1) * FITS_CARD_SIZE;
+    while (vp < card_end && *vp == ' ') vp++;
+    if (vp == card_end || *vp != '\'') break;
+
+    if (len + FITS_CARD_SIZE >= cap) {
+      cap *= 2;
+      char *grown = realloc(out, cap);
+      if (grown == NULL) {
+        free(out);
+        return false;
+      }
+      out = grown;
+    }
+    size_t seg_start = len;
+    if (mfits_unquote(vp + 1, card_end, out, &len, cap) == NULL) break;
+    while (len > seg_start && out[len - 1] == ' ') len--;
+
+    if (len == seg_start || out[len - 1] != '&') break;  // no continuation marker, so this was the last piece
+    len--;                                               // drop the '&'
+    card++;
+    if (card >= hdu->ncards || memcmp(hdu->header + card * FITS_CARD_SIZE, "CONTINUE  ", 10) != 0) break;
+    vp = hdu->header + card * FITS_CARD_SIZE + 10;
+  }
+  out[len] = 0;
+  *value   = out;
+  return true;
+}
+
+// Index the HDUs and BINTABLE columns of an mmap'd FITS file.  Returns false (and leaves nothing mapped) if the file isn't usable.
+bool mfits_open(const char *path, mfits_t *mf) {
+  memset(mf, 0, sizeof(mfits_t));
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return false;
+
+  struct stat filestats;
+  if (fstat(fd, &filestats) == -1 || filestats.st_size < FITS_BLOCK_SIZE) {
+    close(fd);
+    return false;
+  }
+  mf->size = filestats.st_size;
+  mf->map  = mmap(NULL, mf->size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);  // The mapping holds its own reference to the file
+  if (mf->map == MAP_FAILED) {
+    mf->map = NULL;
+    return false;
+  }
+
+  size_t pos = 0;
+  while (pos + FITS_BLOCK_SIZE <= mf->size && mf->nhdus < MFITS_MAX_HDUS) {
+    mfits_hdu_t *hdu = &mf->hdu[mf->nhdus];
+    hdu->header      = mf->map + pos;
+
+    // Find the END card.  Headers are a whole number of 2880 byte blocks.
+    size_t max_cards = (mf->size - pos) / FITS_CARD_SIZE;
+    hdu->ncards      = -1;
+    for (size_t card = 0; card < max_cards; card++) {
+      if (memcmp(hdu->header + card * FITS_CARD_SIZE, "END     ", 8) == 0) {
+        hdu->ncards = card;
+        break;
+      }
+    }
+    if (hdu->ncards < 0) break;  // truncated header
+    size_t header_size = (((size_t)(hdu->ncards + 1) * FITS_CARD_SIZE + FITS_BLOCK_SIZE - 1) / FITS_BLOCK_SIZE) * FITS_BLOCK_SIZE;
+
+    char xtension[72] = "";
+    mfits_key_str(hdu, "XTENSION", xtension, sizeof(xtension));
+    mfits_key_str(hdu, "EXTNAME", hdu->extname, sizeof(hdu->extname));
+    hdu->is_table = (strcmp(xtension, "BINTABLE") == 0);
+
+    if (!mfits_key_int(hdu, "BITPIX", &hdu->bitpix) || !mfits_key_int(hdu, "NAXIS", &hdu->naxis) || hdu->naxis < 0 || hdu->naxis > MFITS_MAX_AXES) break;
+
+    int64_t pixels = (hdu->naxis > 0);
+    for (int axis = 0; axis < hdu->naxis; axis++) {
+      char key[9];
+      snprintf(key, sizeof(key), "NAXIS%d", axis + 1);
+      if (!mfits_key_int64(hdu, key, &hdu->naxes[axis]) || hdu->naxes[axis] < 0) goto done;
+      pixels *= hdu->naxes[axis];
+    }
+    int64_t pcount = 0;
+    int64_t gcount = 1;
+    mfits_key_int64(hdu, "PCOUNT", &pcount);
+    mfits_key_int64(hdu, "GCOUNT", &gcount);
+    hdu->data_size = (size_t)(abs(hdu->bitpix) / 8) * gcount * (pcount + pixels);
+    hdu->data      = (const uint8_t *)mf->map + pos + header_size;
+    if (pos + header_size + hdu->data_size > mf->size) break;  // truncated data
+
+    if (hdu->is_table) {
+      int tfields = 0;
+      mfits_key_int(hdu, "TFIELDS", &tfields);
+      if (tfields < 0 || tfields > MFITS_MAX_COLS) break;
+      hdu->cols  = calloc(tfields ? tfields : 1, sizeof(mfits_col_t));
+      hdu->ncols = tfields;
+      int offset = 0;
+      for (int col = 0; col < tfields; col++) {
+        char key[9];
+        char tform[72] = "";
+        snprintf(key, sizeof(key), "TTYPE%d", col + 1);
+        mfits_key_str(hdu, key, hdu->cols[col].name, sizeof(hdu->cols[col].name));
+        snprintf(key, sizeof(key), "TFORM%d", col + 1);
+        if (!mfits_key_str(hdu, key, tform, sizeof(tform))) goto done;
+
+        char *type            = tform;
+        hdu->cols[col].repeat = strtol(tform, &type, 10);
+        if (type == tform) hdu->cols[col].repeat = 1;  // no repeat count means a repeat count of 1
+        hdu->cols[col].type   = *type;
+        hdu->cols[col].offset = offset;
+        switch (*type) {
+          case 'A':
+          case 'B':
+          case 'L':
+            hdu->cols[col].width = 1;
+            break;
+          case 'I':
+            hdu->cols[col].width = 2;
+            break;
+          case 'J':
+          case 'E':
+            hdu->cols[col].width = 4;
+            break;
+          case 'K':
+          case 'D':
+            hdu->cols[col].width = 8;
+            break;
+          default:
+            hdu->cols[col].width = 0;  // not something we'll ever read, and we can't work out where later columns are
+            goto done;
+        }
+        offset += hdu->cols[col].width * hdu->cols[col].repeat;
+      }
+      if (hdu->naxis != 2 || offset != hdu->naxes[0]) break;  // column widths don't add up to the row width
+    }
+
+    mf->nhdus++;
+    pos += header_size + ((hdu->data_size + FITS_BLOCK_SIZE - 1) / FITS_BLOCK_SIZE) * FITS_BLOCK_SIZE;
+  }
+done:
+  return mf->nhdus > 0;
+}
+
+void mfits_close(mfits_t *mf) {
+  for (int loop = 0; loop < MFITS_MAX_HDUS; loop++) free(mf->hdu[loop].cols);
+  if (mf->map) munmap((void *)mf->map, mf->size);
+  memset(mf, 0, sizeof(mfits_t));
+}
+
+const mfits_hdu_t *mfits_hdu(const mfits_t *mf, const char *extname) {
+  for (int loop = 1; loop < mf->nhdus; loop++) {
+    if (strcmp(mf->hdu[loop].extname, extname) == 0) return &mf->hdu[loop];
+  }
+  return NULL;
+}
+
+const mfits_col_t *mfits_col(const mfits_hdu_t *hdu, const char *name) {
+  for (int loop = 0; loop < hdu->ncols; loop++) {
+    if (strcasecmp(hdu->cols[loop].name, name) == 0) return &hdu->cols[loop];
+  }
+  return NULL;
+}
+
+int64_t mfits_nrows(const mfits_hdu_t *hdu) { return hdu->is_table ? hdu->naxes[1] : 0; }
+
+// Decode one numeric table cell (big-endian on disk) as a double.  row and elem are 0 based.
+static inline double mfits_cell(const mfits_hdu_t *hdu, const mfits_col_t *col, int64_t row, int elem) {
+  const uint8_t *cp = hdu->data + row * hdu->naxes[0] + col->offset + elem * col->width;
+  switch (col->type) {
+    case 'B':
+      return *cp;
+    case 'I': {
+      uint16_t v;
+      memcpy(&v, cp, sizeof(v));
+      return (int16_t)be16toh(v);
+    }
+    case 'J': {
+      uint32_t v;
+      memcpy(&v, cp, sizeof(v));
+      return (int32_t)be32toh(v);
+    }
+    case 'K': {
+      uint64_t v;
+      memcpy(&v, cp, sizeof(v));
+      return (int64_t)be64toh(v);
+    }
+    case 'E': {
+      uint32_t v;
+      float f;
+      memcpy(&v, cp, sizeof(v));
+      v = be32toh(v);
+      memcpy(&f, &v, sizeof(f));
+      return f;
+    }
+    case 'D': {
+      uint64_t v;
+      double d;
+      memcpy(&v, cp, sizeof(v));
+      v = be64toh(v);
+      memcpy(&d, &v, sizeof(d));
+      return d;
+    }
+  }
+  return 0.0;
+}
+
+bool mfits_col_ok(const mfits_hdu_t *hdu, const mfits_col_t *col, int64_t first_row, int64_t nrows, bool want_string) {
+  if (col == NULL || first_row < 0 || first_row + nrows > mfits_nrows(hdu)) return false;
+  return want_string == (col->type == 'A');
+}
+
+// The following read nrows cells of a column starting at (0 based) first_row, like fits_read_col does for each type.
+
+bool mfits_read_col_int(const mfits_hdu_t *hdu, const mfits_col_t *col, int64_t first_row, int64_t nrows, int *out) {
+  if (!mfits_col_ok(hdu, col, first_row, nrows, false) || col->type == 'K') return false;
+  for (int64_t row = 0; row < nrows; row++) out[row] = (int)mfits_cell(hdu, col, first_row + row, 0);
+  return true;
+}
+
+bool mfits_read_col_int64(const mfits_hdu_t *hdu, const mfits_col_t *col, int64_t first_row, int64_t nrows, int64_t *out) {
+  if (!mfits_col_ok(hdu, col, first_row, nrows, false)) return false;
+  for (int64_t row = 0; row < nrows; row++) {
+    if (col->type == 'K') {  // don't round trip 64 bit integers through a double
+      uint64_t v;
+      memcpy(&v, hdu->data + (first_row + row) * hdu->naxes[0] + col->offset, sizeof(v));
+      out[row] = (int64_t)be64toh(v);
+    } else {
+      out[row] = (int64_t)mfits_cell(hdu, col, first_row + row, 0);
+    }
+  }
+  return true;
+}
+
+bool mfits_read_col_float(const mfits_hdu_t *hdu, const mfits_col_t *col, int64_t first_row, int64_t nrows, float *out) {
+  if (!mfits_col_ok(hdu, col, first_row, nrows, false)) return false;
+  for (int64_t row = 0; row < nrows; row++) out[row] = (float)mfits_cell(hdu, col, first_row + row, 0);
+  return true;
+}
+
+// String cells are copied into out[row * out_stride] with trailing blanks (and nuls) trimmed, truncated to out_stride-1 characters.
+bool mfits_read_col_str(const mfits_hdu_t *hdu, const mfits_col_t *col, int64_t first_row, int64_t nrows, char *out, size_t out_stride) {
+  if (!mfits_col_ok(hdu, col, first_row, nrows, true)) return false;
+  for (int64_t row = 0; row < nrows; row++) {
+    const char *cp = (const char *)hdu->data + (first_row + row) * hdu->naxes[0] + col->offset;
+    size_t len     = strnlen(cp, col->repeat);
+    while (len > 0 && cp[len - 1] == ' ') len--;
+    if (len > out_stride - 1) len = out_stride - 1;
+    memcpy(&out[row * out_stride], cp, len);
+    out[row * out_stride + len] = 0;
+  }
+  return true;
+}
+
+// Read npixels consecutive pixels (in FITS storage order, 0 based) from an IMAGE HDU as doubles.
+bool mfits_read_pixels(const mfits_hdu_t *hdu, int64_t first_pixel, int64_t npixels, double *out) {
+  int width = abs(hdu->bitpix) / 8;
+  if (hdu->is_table || first_pixel < 0 || (size_t)(first_pixel + npixels) * width > hdu->data_size) return false;
+  const uint8_t *cp = hdu->data + first_pixel * width;
+  for (int64_t pix = 0; pix < npixels; pix++, cp += width) {
+    switch (hdu->bitpix) {
+      case -64: {
+        uint64_t v;
+        memcpy(&v, cp, sizeof(v));
+        v = be64toh(v);
+        memcpy(&out[pix], &v, sizeof(double));
+        break;
+      }
+      case -32: {
+        uint32_t v;
+        float f;
+        memcpy(&v, cp, sizeof(v));
+        v = be32toh(v);
+        memcpy(&f, &v, sizeof(f));
+        out[pix] = f;
+        break;
+      }
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+bool parse_channels(char *channels, int CHANNELS[24]) {
+  // channels is the comma separated CHANNELS long-string from the metafits.  It gets chopped up by strsep, so pass in a copy you don't care about.
+  int temp_CHANNELS[24];
+  char *token;
+
+  int ch_index = 0;         // Start at channel number zero (of 0 to 23)
+  char *ptr    = channels;  // Get a temp copy (but only of the pointer. NOT THE STRING!) that we can update as we step though the channels in the csv list
+
+  while ((token = strsep(&ptr, ",")) && (ch_index < 24)) {  // Get a pointer to the next number and assuming there *is* one and we still want more
+    temp_CHANNELS[ch_index++] = atoi(token);                // turn it into an int and remember it (although it isn't sorted yet)
+  }
+
+  if (ch_index != 24) {
+    printf("Did not find 24 channels in metafits file.\n");
+    fflush(stdout);
+    return false;
+  }
+
+  // From the RRI user manual:
+  // "1. The DR coarse PFB outputs the 256 channels in a fashion that the first 128 channels appear in sequence
+  // followed by the 129 channels and then 256 down to 130 appear. The setfreq is user specific command wherein
+  // the user has to enter the preferred 24 channesl in sequence to be transported using the 3 fibers. [ line 14 Appendix- E]"
+  // Clear as mud?  Yeah.  I thought so too.
+
+  // So we want to look through for where a channel number is greater than, or equal to 129.  We'll assume they are already sorted by M&C
+  int course_swap_index = 24;  // start by assuming there are no channels to swap
+
+  // find the index where the channels are swapped i.e. where 129 exists
+  for (int i = 0; i < 24; ++i) {
+    if (temp_CHANNELS[i] >= 129) {
+      course_swap_index = i;
+      break;
+    }
+  }
+
+  // Now reorder freq array based on the course channel boundary around 129
+  for (int i = 0; i < 24; ++i) {
+    if (i < course_swap_index) {
+      CHANNELS[i] = temp_CHANNELS[i];
+    } else {
+      CHANNELS[23 - i + (course_swap_index)] = temp_CHANNELS[i];  // I was confident this line was correct back when 'recombine' was written!
+    }
+  }
+  return true;
+}
+
+// How many coherent beams fit in block 0 alongside everything else we keep there.  Block 0 and everything in it scale with the number of inputs,
+// so this doesn't depend on how many inputs there are.
+int max_coherent_beams() {
+  long long per_input = sizeof(delay_table_entry_t) + sizeof(delay_table2_entry_t) + sizeof(float) * UDP_PER_RF_PER_SUB + (UDP_PER_RF_PER_SUB - 2 + 7) / 8 +
+                        4 * UDP_PAYLOAD_SIZE;  // DELAY_TABLE, the tile pointing in DELAY_TABLE2, ARRIVAL_TIMES, PACKET_MAP and MARGIN_DATA
+  return (SUB_LINE_SIZE - per_input) / sizeof(delay_table2_entry_t);
+}
+
+// Make sure a subobs has room for the tile pointing plus nbeams coherent beams.  Only ever grows, so memory follows the most beams we've been asked for.
+void reserve_beams(subobs_udp_meta_t *subm, int nbeams) {
+  if (subm->altaz != NULL && nbeams <= subm->beam_capacity) return;
+  if (nbeams < subm->beam_capacity) nbeams = subm->beam_capacity;
+
+  altaz_meta_t(*altaz)[3]           = realloc(subm->altaz, (1 + nbeams) * sizeof(*altaz));
+  delay_table2_entry_t *beam_delays = realloc(subm->beam_delays, (nbeams > 0 ? nbeams : 1) * max_inputs * sizeof(delay_table2_entry_t));
+  if (altaz == NULL || beam_delays == NULL) {
+    printf("coherent beams realloc failed\n");
+    fflush(stdout);
+    exit(EXIT_FAILURE);
+  }
+  subm->altaz         = altaz;
+  subm->beam_delays   = beam_delays;
+  subm->beam_capacity = nbeams;
+}
+
+void add_dummy_beams(subobs_udp_meta_t *subm) {
+  if (dummy_beams > 0 && subm->ncoherant_beams == 0) {  // only add dummy beams if we there was no BEALMALTAZ HDU
+    printf("adding %d dummy beams\n", dummy_beams);
+    reserve_beams(subm, dummy_beams);
+    subm->ncoherant_beams = dummy_beams;
+    float beam[3][3];
+    float p[3] = {1.0f, 0, 0};  // north
+    float u[3][3];              // basis for offsetting beam
+    float v[3][3];              // basis for offsetting beam
+
+    for (int time_step = 0; time_step < 3; time_step++) {
+      double alt         = deg2rad(subm->altaz[0][time_step].Alt);
+      double az          = deg2rad(subm->altaz[0][time_step].Az);
+      beam[time_step][0] = (float)(cosl(az) * cosl(alt));  // north
+      beam[time_step][1] = (float)(sinl(az) * cosl(alt));  // east
+      beam[time_step][2] = (float)sinl(alt);               // up
+
+      vcross(beam[time_step], p, u[time_step]);
+      vnormalise(u[time_step]);
+      vcross(u[time_step], beam[time_step], v[time_step]);
+    }
+    for (int beam_index = 1; beam_index <= dummy_beams; beam_index++) {
+      float spacing = 1.5f * M_PI / 180.0;             // degrees between beams
+      float t       = sqrtf((float)(beam_index - 1));  // beam 1 uses the correlation pointing center.
+      float th      = t * 4.0f;
+      float r       = t * spacing * 0.573;
+      float du      = sin(th) * r;
+      float dv      = cos(th) * r;
+      for (int time_step = 0; time_step < 3; time_step++) {
+        float pointing[3];
+        pointing[0] = beam[time_step][0] + du * u[time_step][0] + dv * v[time_step][0];
+        pointing[1] = beam[time_step][1] + du * u[time_step][1] + dv * v[time_step][1];
+        pointing[2] = beam[time_step][2] + du * u[time_step][2] + dv * v[time_step][2];
+        float w     = sqrtf(pointing[1] * pointing[1] + pointing[0] * pointing[0]);
+
+        subm->altaz[beam_index][time_step].Az      = rad2deg(atan2f(pointing[1], pointing[0]));
+        subm->altaz[beam_index][time_step].Alt     = rad2deg(atan2f(pointing[2], w));
+        subm->altaz[beam_index][time_step].Dist_km = 0.0f;
+        subm->altaz[beam_index][time_step].gpstime = subm->altaz[0][time_step].gpstime;
+      }
+    }
+  }
+}
+
+void print_pointings(const subobs_udp_meta_t *subm) {
+  printf("Pointings:\n");
+  for (int beam_index = 0; beam_index <= subm->ncoherant_beams; beam_index++) {
+    for (int time_step = 0; time_step < 3; time_step++) {
+      printf("| %10.7f %10.7f %6.4f %ld ", subm->altaz[beam_index][time_step].Alt, subm->altaz[beam_index][time_step].Az, subm->altaz[beam_index][time_step].Dist_km,
+             subm->altaz[beam_index][time_step].gpstime);
+    }
+    printf("|\n");
+  }
+  printf("\n");
+}
+
+// If this observation has more inputs than max_inputs (from mwax.cfg), keep only the first max_inputs in sub file order.  The readers drop the rest,
+// and makesub never looks up their rf_inputs.  Said once per observation, rather than for every subobs.
+void discard_inputs(subobs_udp_meta_t *subm) {
+  static int64_t warned_obs = -1;
+  if (subm->NINPUTS <= max_inputs) return;
+  if (subm->GPSTIME != warned_obs) {
+    printf("Observation %ld has %d inputs but mwax.cfg's tiles/xgpu_tiles only allow for %d.  Discarding inputs beyond the first %d\n", subm->GPSTIME,
+           subm->NINPUTS, max_inputs, max_inputs);
+    fflush(stdout);
+    warned_obs = subm->GPSTIME;
+  }
+  subm->NINPUTS = max_inputs;
+}
+
+bool read_metafits(const char *metafits_file, subobs_udp_meta_t *subm) {
+  // preconditions:
+  //     subm->subobs >= subm->GPSTIME (the latter as read from the metafits_file, theoretically should be same as the number in the filename)
+  //     conf.coarse_chan > 0
+  //     conf.coarse_chan <= 24
+  // returns:
+  //     false on failure
+  //     true on success
+
+  fitsfile *fptr;  // FITS file pointer, defined in fitsio.h
+  int status = 0;  // CFITSIO status value MUST be initialized to zero!
+
+  fits_open_file(&fptr, metafits_file, READONLY, &status);
+  if (status) return false;
 
   fits_read_key_verbose(fptr, TLONGLONG, "GPSTIME", NULL, &(subm->GPSTIME), NULL, &status);                    // Read the GPSTIME of the metafits observation
                                                                                                                // (should be same as bcsf_obsid but read anyway)
@@ -1305,8 +2703,6 @@ bool read_metafits(const char *metafits_file, subobs_udp_meta_t *subm) {
 
   //---------- Parsing the sky frequency (coarse) channel is a whole job in itself! ----------
   {
-    int temp_CHANNELS[24];
-    char *token;
     char *saveptr;
     fits_read_key_longstr(fptr, "CHANNELS", &saveptr, NULL, &status);
     if (status) {
@@ -1315,48 +2711,13 @@ bool read_metafits(const char *metafits_file, subobs_udp_meta_t *subm) {
       return false;
     }
 
-    int ch_index = 0;        // Start at channel number zero (of 0 to 23)
-    char *ptr    = saveptr;  // Get a temp copy (but only of the pointer. NOT THE STRING!) that we can update as we step though the channels in the csv list
-
-    while ((token = strsep(&ptr, ",")) && (ch_index < 24)) {  // Get a pointer to the next number and assuming there *is* one and we still want more
-      temp_CHANNELS[ch_index++] = atoi(token);                // turn it into an int and remember it (although it isn't sorted yet)
-    }
+    bool channels_ok = parse_channels(saveptr, subm->CHANNELS);
     free(saveptr);
-
-    if (ch_index != 24) {
-      printf("Did not find 24 channels in metafits file.\n");
-      fflush(stdout);
-      return false;
-    }
-
-    // From the RRI user manual:
-    // "1. The DR coarse PFB outputs the 256 channels in a fashion that the first 128 channels appear in sequence
-    // followed by the 129 channels and then 256 down to 130 appear. The setfreq is user specific command wherein
-    // the user has to enter the preferred 24 channesl in sequence to be transported using the 3 fibers. [ line 14 Appendix- E]"
-    // Clear as mud?  Yeah.  I thought so too.
-
-    // So we want to look through for where a channel number is greater than, or equal to 129.  We'll assume they are already sorted by M&C
-    int course_swap_index = 24;  // start by assuming there are no channels to swap
-
-    // find the index where the channels are swapped i.e. where 129 exists
-    for (int i = 0; i < 24; ++i) {
-      if (temp_CHANNELS[i] >= 129) {
-        course_swap_index = i;
-        break;
-      }
-    }
-
-    // Now reorder freq array based on the course channel boundary around 129
-    for (int i = 0; i < 24; ++i) {
-      if (i < course_swap_index) {
-        subm->CHANNELS[i] = temp_CHANNELS[i];
-      } else {
-        subm->CHANNELS[23 - i + (course_swap_index)] = temp_CHANNELS[i];  // I was confident this line was correct back when 'recombine' was written!
-      }
-    }
+    if (!channels_ok) return false;
   }
 
   subm->ncoherant_beams = 0;
+  reserve_beams(subm, 0);  // Room for the tile pointing at least
 
   subm->COARSE_CHAN = subm->CHANNELS[conf.coarse_chan - 1];  // conf.coarse_chan numbers are 1 to 24 inclusive, but the array index is 0 to 23 incl.
 
@@ -1371,7 +2732,6 @@ bool read_metafits(const char *metafits_file, subobs_udp_meta_t *subm) {
   subm->INTTIME_msec = (int)(subm->INTTIME * 1000.0);  // We'd prefer the integration time in msecs rather than seconds.
 
   fits_read_key_verbose(fptr, TINT, "NINPUTS", NULL, &(subm->NINPUTS), NULL, &status);
-  if (subm->NINPUTS > MAX_INPUTS) subm->NINPUTS = MAX_INPUTS;  // Don't allow more inputs than MAX_INPUTS (probably die reading the tile list anyway)
 
   if (subm->NINPUTS == 0) printf("subfile specifies no inputs!?\n");  // Check we found something plausible
 
@@ -1386,17 +2746,7 @@ bool read_metafits(const char *metafits_file, subobs_udp_meta_t *subm) {
 
   long frow, felem;
 
-  int cfitsio_ints[MAX_INPUTS];      // Temp storage for integers read from the metafits file (in metafits order) before copying to final structure (in sub file order)
-  int64_t cfitsio_J[3];              // Temp storage for long "J" type integers read from the metafits file (used in pointing HDU)
-  float cfitsio_floats[MAX_INPUTS];  // Temp storage for floats read from the metafits file (in metafits order) before copying to final structure (in sub file order)
-
-  char cfitsio_strings[MAX_INPUTS][15];  // Temp storage for strings read from the metafits file (in metafits order) before copying to final structure (in sub file order)
-  char *cfitsio_str_ptr[MAX_INPUTS];     // We also need an array of pointers to the stings
-  for (int loop = 0; loop < MAX_INPUTS; loop++) {
-    cfitsio_str_ptr[loop] = &cfitsio_strings[loop][0];  // That we need to fill with the addresses of the first character in each string in the list of inputs
-  }
-
-  int metafits2sub_order[MAX_INPUTS];  // index is the position in the metafits file starting at 0.  Value is the order in the sub file starting at 0.
+  int64_t cfitsio_J[3];  // Temp storage for long "J" type integers read from the metafits file (used in pointing HDU)
 
   fits_movnam_hdu(fptr, BINARY_TBL, "TILEDATA", 0, &status);
   FITS_CHECK("Moving to TILEDATA HDU");
@@ -1407,6 +2757,23 @@ bool read_metafits(const char *metafits_file, subobs_udp_meta_t *subm) {
     printf("NINPUTS (%d) doesn't match number of rows in tile data table (%ld)\n", subm->NINPUTS, nrows);
     return false;
   }
+  if (nrows > INPUTS_LIMIT) {  // The tables below are on the stack
+    printf("NINPUTS (%d) is more than the %d inputs we can handle\n", subm->NINPUTS, INPUTS_LIMIT);
+    return false;
+  }
+
+  int cfitsio_ints[nrows];      // Temp storage for integers read from the metafits file (in metafits order) before copying to final structure (in sub file order)
+  float cfitsio_floats[nrows];  // Temp storage for floats read from the metafits file (in metafits order) before copying to final structure (in sub file order)
+
+  char cfitsio_strings[nrows][15];  // Temp storage for strings read from the metafits file (in metafits order) before copying to final structure (in sub file order)
+  char *cfitsio_str_ptr[nrows];     // We also need an array of pointers to the stings
+  for (int loop = 0; loop < nrows; loop++) {
+    cfitsio_str_ptr[loop] = &cfitsio_strings[loop][0];  // That we need to fill with the addresses of the first character in each string in the list of inputs
+  }
+
+  int metafits2sub_order[nrows];  // index is the position in the metafits file starting at 0.  Value is the order in the sub file starting at 0.
+  tile_meta_t *row_of[nrows];     // and where each one goes: its row of rf_inp, or discarded if that's beyond max_inputs
+  tile_meta_t discarded;
 
   frow  = 1;
   felem = 1;
@@ -1423,17 +2790,21 @@ bool read_metafits(const char *metafits_file, subobs_udp_meta_t *subm) {
   for (int loop = 0; loop < nrows; loop++) {
     metafits2sub_order[loop] = (cfitsio_ints[loop] << 1) |                 // Take the "Antenna" number, multiply by 2 via lshift
                                ((*cfitsio_str_ptr[loop] == 'Y') ? 1 : 0);  // and iff the 'Pol' is Y, then add in a 1. That's how you know where in the sub file it goes.
+    if (metafits2sub_order[loop] < 0 || metafits2sub_order[loop] >= nrows) {
+      printf("Antenna %d (%s) out of range for %ld inputs\n", cfitsio_ints[loop], cfitsio_str_ptr[loop], nrows);
+      return false;
+    }
+    row_of[loop] = (metafits2sub_order[loop] < max_inputs) ? &subm->rf_inp[metafits2sub_order[loop]] : &discarded;  // rf_inp only has room for max_inputs
   }
+  discard_inputs(subm);
 
   // Now we know how to map the the order from the metafits file to the sub file (and internal structure), it's time to start reading in the fields one at a time
 
   //---------- write the 'Antenna' and 'Pol' fields -------- NB: These data are sitting in the temporary arrays already, so we don't need to reread them.
 
   for (int loop = 0; loop < nrows; loop++) {
-    subm->rf_inp[metafits2sub_order[loop]].Antenna =
-        cfitsio_ints[loop];  // Copy each integer from the array we got from the metafits (via cfitsio) into one element of the rf_inp array structure
-    strcpy(subm->rf_inp[metafits2sub_order[loop]].Pol,
-           cfitsio_str_ptr[loop]);  // Copy each string from the array we got from the metafits (via cfitsio) into one element of the rf_inp array structure
+    row_of[loop]->Antenna = cfitsio_ints[loop];      // Copy each integer from the array we got from the metafits (via cfitsio) into one element of the rf_inp array structure
+    strcpy(row_of[loop]->Pol, cfitsio_str_ptr[loop]);  // Copy each string from the array we got from the metafits (via cfitsio) into one element of the rf_inp array structure
   }
 
   //---------- Read and write the 'Input' field --------
@@ -1441,7 +2812,7 @@ bool read_metafits(const char *metafits_file, subobs_udp_meta_t *subm) {
   fits_get_colnum(fptr, CASEINSEN, "Input", &colnum, &status);
   fits_read_col(fptr, TINT, colnum, frow, felem, nrows, 0, cfitsio_ints, &anynulls, &status);
   FITS_CHECK("reading Input column");
-  for (int loop = 0; loop < nrows; loop++) subm->rf_inp[metafits2sub_order[loop]].Input = cfitsio_ints[loop];
+  for (int loop = 0; loop < nrows; loop++) row_of[loop]->Input = cfitsio_ints[loop];
   // Copy each integer from the array we got from the metafits (via cfitsio) into one element of the rf_inp array structure
 
   //---------- Read and write the 'Tile' field --------
@@ -1449,7 +2820,7 @@ bool read_metafits(const char *metafits_file, subobs_udp_meta_t *subm) {
   fits_get_colnum(fptr, CASEINSEN, "Tile", &colnum, &status);
   fits_read_col(fptr, TINT, colnum, frow, felem, nrows, 0, cfitsio_ints, &anynulls, &status);
   FITS_CHECK("reading Tile column");
-  for (int loop = 0; loop < nrows; loop++) subm->rf_inp[metafits2sub_order[loop]].Tile = cfitsio_ints[loop];
+  for (int loop = 0; loop < nrows; loop++) row_of[loop]->Tile = cfitsio_ints[loop];
   // Copy each integer from the array we got from the metafits (via cfitsio) into one element of the rf_inp array structure
 
   //---------- Read and write the 'TileName' field --------
@@ -1457,14 +2828,14 @@ bool read_metafits(const char *metafits_file, subobs_udp_meta_t *subm) {
   fits_get_colnum(fptr, CASEINSEN, "TileName", &colnum, &status);
   fits_read_col(fptr, TSTRING, colnum, frow, felem, nrows, 0, &cfitsio_str_ptr, &anynulls, &status);
   FITS_CHECK("reading TileName column");
-  for (int loop = 0; loop < nrows; loop++) strcpy(subm->rf_inp[metafits2sub_order[loop]].TileName, cfitsio_str_ptr[loop]);
+  for (int loop = 0; loop < nrows; loop++) strcpy(row_of[loop]->TileName, cfitsio_str_ptr[loop]);
 
   //---------- Read and write the 'Rx' field --------
 
   fits_get_colnum(fptr, CASEINSEN, "Rx", &colnum, &status);
   fits_read_col(fptr, TINT, colnum, frow, felem, nrows, 0, cfitsio_ints, &anynulls, &status);
   FITS_CHECK("reading Rx column");
-  for (int loop = 0; loop < nrows; loop++) subm->rf_inp[metafits2sub_order[loop]].Rx = cfitsio_ints[loop];
+  for (int loop = 0; loop < nrows; loop++) row_of[loop]->Rx = cfitsio_ints[loop];
   // Copy each integer from the array we got from the metafits (via cfitsio) into one element of the rf_inp array structure
 
   //---------- Read and write the 'Slot' field --------
@@ -1472,7 +2843,7 @@ bool read_metafits(const char *metafits_file, subobs_udp_meta_t *subm) {
   fits_get_colnum(fptr, CASEINSEN, "Slot", &colnum, &status);
   fits_read_col(fptr, TINT, colnum, frow, felem, nrows, 0, cfitsio_ints, &anynulls, &status);
   FITS_CHECK("reading Slot column");
-  for (int loop = 0; loop < nrows; loop++) subm->rf_inp[metafits2sub_order[loop]].Slot = cfitsio_ints[loop];
+  for (int loop = 0; loop < nrows; loop++) row_of[loop]->Slot = cfitsio_ints[loop];
   // Copy each integer from the array we got from the metafits (via cfitsio) into one element of the rf_inp array structure
 
   //---------- Read and write the 'Flag' field --------
@@ -1480,7 +2851,7 @@ bool read_metafits(const char *metafits_file, subobs_udp_meta_t *subm) {
   fits_get_colnum(fptr, CASEINSEN, "Flag", &colnum, &status);
   fits_read_col(fptr, TINT, colnum, frow, felem, nrows, 0, cfitsio_ints, &anynulls, &status);
   FITS_CHECK("reading Flag column");
-  for (int loop = 0; loop < nrows; loop++) subm->rf_inp[metafits2sub_order[loop]].Flag = cfitsio_ints[loop];
+  for (int loop = 0; loop < nrows; loop++) row_of[loop]->Flag = cfitsio_ints[loop];
   // Copy each integer from the array we got from the metafits (via cfitsio) into one element of the rf_inp array structure
 
   //---------- Read and write the 'Length' field --------
@@ -1488,8 +2859,8 @@ bool read_metafits(const char *metafits_file, subobs_udp_meta_t *subm) {
   fits_get_colnum(fptr, CASEINSEN, "Length", &colnum, &status);
   fits_read_col(fptr, TSTRING, colnum, frow, felem, nrows, 0, &cfitsio_str_ptr, &anynulls, &status);
   FITS_CHECK("reading Length column");
-  //      for (int loop = 0; loop < nrows; loop++) strcpy( subm->rf_inp[ metafits2sub_order[loop] ].Length, cfitsio_str_ptr[loop] );
-  for (int loop = 0; loop < nrows; loop++) subm->rf_inp[metafits2sub_order[loop]].Length_f = roundl(strtold(cfitsio_str_ptr[loop] + 3, NULL) * 1000.0);
+  //      for (int loop = 0; loop < nrows; loop++) strcpy( row_of[loop]->Length, cfitsio_str_ptr[loop] );
+  for (int loop = 0; loop < nrows; loop++) row_of[loop]->Length_f = roundl(strtold(cfitsio_str_ptr[loop] + 3, NULL) * 1000.0);
   // Not what it might first appear. Convert the weird ASCII 'EL_123' format 'Length' string into a usable float, The +3 is 'step in 3 characters'
 
   //---------- Read and write the 'North' field --------
@@ -1497,21 +2868,21 @@ bool read_metafits(const char *metafits_file, subobs_udp_meta_t *subm) {
   fits_get_colnum(fptr, CASEINSEN, "North", &colnum, &status);
   fits_read_col(fptr, TFLOAT, colnum, frow, felem, nrows, 0, cfitsio_floats, &anynulls, &status);
   FITS_CHECK("reading North column");
-  for (int loop = 0; loop < nrows; loop++) subm->rf_inp[metafits2sub_order[loop]].North = roundl(cfitsio_floats[loop] * 1000.0);  // Convert to long double in mm and round
+  for (int loop = 0; loop < nrows; loop++) row_of[loop]->North = roundl(cfitsio_floats[loop] * 1000.0);  // Convert to long double in mm and round
 
   //---------- Read and write the 'East' field --------
 
   fits_get_colnum(fptr, CASEINSEN, "East", &colnum, &status);
   fits_read_col(fptr, TFLOAT, colnum, frow, felem, nrows, 0, cfitsio_floats, &anynulls, &status);
   FITS_CHECK("reading East column");
-  for (int loop = 0; loop < nrows; loop++) subm->rf_inp[metafits2sub_order[loop]].East = roundl(cfitsio_floats[loop] * 1000.0);  // Convert to long double in mm and round
+  for (int loop = 0; loop < nrows; loop++) row_of[loop]->East = roundl(cfitsio_floats[loop] * 1000.0);  // Convert to long double in mm and round
 
   //---------- Read and write the 'Height' field --------
 
   fits_get_colnum(fptr, CASEINSEN, "Height", &colnum, &status);
   fits_read_col(fptr, TFLOAT, colnum, frow, felem, nrows, 0, cfitsio_floats, &anynulls, &status);
   FITS_CHECK("reading Height column");
-  for (int loop = 0; loop < nrows; loop++) subm->rf_inp[metafits2sub_order[loop]].Height = roundl(cfitsio_floats[loop] * 1000.0);  // Convert to long double in mm and round
+  for (int loop = 0; loop < nrows; loop++) row_of[loop]->Height = roundl(cfitsio_floats[loop] * 1000.0);  // Convert to long double in mm and round
 
   // Now we have read everything available from the TILEDATA HDU
   // but we want to do some conversions and calculations per tile.
@@ -1623,10 +2994,11 @@ bool read_metafits(const char *metafits_file, subobs_udp_meta_t *subm) {
       fits_read_subset(fptr, TDOUBLE, fpixel, lpixel, inc, NULL, subset_data, 0, &status);
       if (status) free(subset_data);  // don't leak memory if the read failed.
       FITS_CHECK("reading BEAMALTAZ subsection for current subobservation");
-      if (beam_count > COHERENT_BEAMS_MAX) {
-        printf("WARNING: Too many coherent beams (%d) in this subobservation, only using the first %d\n", beam_count, COHERENT_BEAMS_MAX);
-        beam_count = COHERENT_BEAMS_MAX;
+      if (beam_count > max_coherent_beams()) {
+        printf("WARNING: Too many coherent beams (%d) in this subobservation, only using the first %d\n", beam_count, max_coherent_beams());
+        beam_count = max_coherent_beams();
       }
+      reserve_beams(subm, beam_count);
       subm->ncoherant_beams = beam_count;
       for (int beam_index = 0; beam_index < beam_count; beam_index++) {
         for (int time_step = 0; time_step < 3; time_step++) {
@@ -1640,55 +3012,8 @@ bool read_metafits(const char *metafits_file, subobs_udp_meta_t *subm) {
       free(subset_data);
     }
 
-    if (dummy_beams > 0 && subm->ncoherant_beams == 0) {  // only add dummy beams if we there was no BEALMALTAZ HDU
-      printf("adding %d dummy beams\n", dummy_beams);
-      subm->ncoherant_beams = dummy_beams;
-      float beam[3][3];
-      float p[3] = {1.0f, 0, 0};  // north
-      float u[3][3];              // basis for offsetting beam
-      float v[3][3];              // basis for offsetting beam
-
-      for (int time_step = 0; time_step < 3; time_step++) {
-        double alt         = deg2rad(subm->altaz[0][time_step].Alt);
-        double az          = deg2rad(subm->altaz[0][time_step].Az);
-        beam[time_step][0] = (float)(cosl(az) * cosl(alt));  // north
-        beam[time_step][1] = (float)(sinl(az) * cosl(alt));  // east
-        beam[time_step][2] = (float)sinl(alt);               // up
-
-        vcross(beam[time_step], p, u[time_step]);
-        vnormalise(u[time_step]);
-        vcross(u[time_step], beam[time_step], v[time_step]);
-      }
-      for (int beam_index = 1; beam_index <= dummy_beams; beam_index++) {
-        float spacing = 1.5f * M_PI / 180.0;             // degrees between beams
-        float t       = sqrtf((float)(beam_index - 1));  // beam 1 uses the correlation pointing center.
-        float th      = t * 4.0f;
-        float r       = t * spacing * 0.573;
-        float du      = sin(th) * r;
-        float dv      = cos(th) * r;
-        for (int time_step = 0; time_step < 3; time_step++) {
-          float pointing[3];
-          pointing[0] = beam[time_step][0] + du * u[time_step][0] + dv * v[time_step][0];
-          pointing[1] = beam[time_step][1] + du * u[time_step][1] + dv * v[time_step][1];
-          pointing[2] = beam[time_step][2] + du * u[time_step][2] + dv * v[time_step][2];
-          float w     = sqrtf(pointing[1] * pointing[1] + pointing[0] * pointing[0]);
-
-          subm->altaz[beam_index][time_step].Az      = rad2deg(atan2f(pointing[1], pointing[0]));
-          subm->altaz[beam_index][time_step].Alt     = rad2deg(atan2f(pointing[2], w));
-          subm->altaz[beam_index][time_step].Dist_km = 0.0f;
-          subm->altaz[beam_index][time_step].gpstime = subm->altaz[0][time_step].gpstime;
-        }
-      }
-    }
-    printf("Pointings:\n");
-    for (int beam_index = 0; beam_index <= subm->ncoherant_beams; beam_index++) {
-      for (int time_step = 0; time_step < 3; time_step++) {
-        printf("| %10.7f %10.7f %6.4f %ld ", subm->altaz[beam_index][time_step].Alt, subm->altaz[beam_index][time_step].Az, subm->altaz[beam_index][time_step].Dist_km,
-               subm->altaz[beam_index][time_step].gpstime);
-      }
-      printf("|\n");
-    }
-    printf("\n");
+    add_dummy_beams(subm);
+    print_pointings(subm);
   }
   //---------- We now have everything we need from the fits file ----------
 
@@ -1701,22 +3026,571 @@ bool read_metafits(const char *metafits_file, subobs_udp_meta_t *subm) {
   return true;
 }
 
-void test_read_metafits(int tdi) {
-  subobs_udp_meta_t sub;
-  int instance           = 0;                                   // Assume we're the first (or only) instance on this server
-  int chan_override      = 0;                                   // Assume we are going to use the default coarse channel for this instance
-  char *conf_file        = "/vulcan/mwax_config/mwax_u2s.cfg";  // Default configuration path
-  char *shared_conf_file = "/vulcan/mwax_config/mwax.cfg";      // Default shared configuration path
-  char hostname[300];                                           // Long enough to fit a 255 host name.  Probably it will only be short, but -hey- it's just a few bytes
-  if (gethostname(hostname, sizeof hostname) == -1) strcpy(hostname, "unknown");  // Get the hostname or default to unknown if we fail
-  printf("Running udp2sub on %s.  ver " THISVER " Build %d\n", hostname, BUILD);
+// Compare everything read_metafits() and read_metafits_mmap() are responsible for.  Returns the number of mismatched fields.
+int compare_metafits(const subobs_udp_meta_t *a, const subobs_udp_meta_t *b) {
+  int mismatches = 0;
+#define CMP_FIELD(FIELD)                                  \
+  if (memcmp(&a->FIELD, &b->FIELD, sizeof(a->FIELD))) {   \
+    printf("metafits cross-check: %s differs\n", #FIELD); \
+    mismatches++;                                         \
+  }
+  CMP_FIELD(GPSTIME);
+  CMP_FIELD(EXPOSURE);
+  CMP_FIELD(CABLEDEL);
+  CMP_FIELD(GEODEL);
+  CMP_FIELD(CALIBDEL);
+  CMP_FIELD(DERIPPLE);
+  CMP_FIELD(CHANNELS);
+  CMP_FIELD(FINECHAN);
+  CMP_FIELD(INTTIME);
+  CMP_FIELD(NINPUTS);
+  CMP_FIELD(UNIXTIME);
+  CMP_FIELD(COARSE_CHAN);
+  CMP_FIELD(ncoherant_beams);
+#undef CMP_FIELD
+  if (strcmp(a->FILENAME, b->FILENAME) || strcmp(a->PROJECT, b->PROJECT) || strcmp(a->MODE, b->MODE)) {
+    printf("metafits cross-check: FILENAME/PROJECT/MODE differ\n");
+    mismatches++;
+  }
+  for (int loop = 0; loop < a->NINPUTS && loop < max_inputs; loop++) {
+    const tile_meta_t *ta = &a->rf_inp[loop];
+    const tile_meta_t *tb = &b->rf_inp[loop];
+    if (ta->Input != tb->Input || ta->Antenna != tb->Antenna || ta->Tile != tb->Tile || ta->Rx != tb->Rx || ta->Slot != tb->Slot || ta->Flag != tb->Flag ||
+        strcmp(ta->TileName, tb->TileName) || strcmp(ta->Pol, tb->Pol) || ta->Length_f != tb->Length_f || ta->North != tb->North || ta->East != tb->East ||
+        ta->Height != tb->Height) {
+      if (mismatches < 10) printf("metafits cross-check: rf_inp[%d] differs\n", loop);  // one bad column would otherwise print every row
+      mismatches++;
+    }
+  }
+  if (a->altaz == NULL || b->altaz == NULL) {  // One of them never got as far as the pointings
+    if (a->altaz != b->altaz) {
+      printf("metafits cross-check: altaz missing\n");
+      mismatches++;
+    }
+    return mismatches;
+  }
+  for (int beam_index = 0; beam_index <= a->ncoherant_beams && beam_index <= b->ncoherant_beams; beam_index++) {
+    for (int time_step = 0; time_step < 3; time_step++) {
+      const altaz_meta_t *pa = &a->altaz[beam_index][time_step];
+      const altaz_meta_t *pb = &b->altaz[beam_index][time_step];
+      if (pa->gpstime != pb->gpstime || pa->Alt != pb->Alt || pa->Az != pb->Az || pa->Dist_km != pb->Dist_km) {
+        printf("metafits cross-check: altaz[%d][%d] differs\n", beam_index, time_step);
+        mismatches++;
+      }
+    }
+  }
+  return mismatches;
+}
 
-  read_config(conf_file, shared_conf_file, hostname, instance, chan_override, &conf);
-  printf("conf.coarse_chan = %d\n", conf.coarse_chan);
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+// Metafits sidecars.
+//
+// Everything we take from a metafits that doesn't depend on which subobs we're in is "compiled" into a flat, versioned, checksummed image:
+// the primary keywords, TILEDATA already in sub file order with lengths and positions converted to rounded millimetres, and the whole ALTAZ
+// and BEAMALTAZ tables.  The same image is used in memory by read_metafits_mmap() and written next to the metafits as <obsid>_metafits.u2s
+// so the other instances (and our own later subobs) can mmap it instead of parsing FITS.  apply_sidecar() does the per-subobs part.
+//---------------------------------------------------------------------------------------------------------------------------------------------------
 
-  struct {
-    char *fnam;
-    uint32_t subobs;
+#define SIDECAR_MAGIC "U2SMETA"
+#define SIDECAR_VERSION 1
+#define SIDECAR_SUFFIX ".u2s"
+
+typedef struct sidecar_tile {  // One TILEDATA row, in sub file order.  All fields are fixed size so the layout is the same everywhere.
+  int32_t Input;
+  int32_t Antenna;
+  int32_t Tile;
+  int32_t Rx;
+  int32_t Slot;
+  int32_t Flag;
+  char TileName[16];
+  char Pol[8];
+  double Length_mm;  // Already rounded to whole millimetres
+  double North_mm;
+  double East_mm;
+  double Height_mm;
+} sidecar_tile_t;
+
+typedef struct sidecar_altaz {  // One ALTAZ row
+  int64_t gpstime;
+  float Alt;
+  float Az;
+  float Dist_km;
+  float spare;
+} sidecar_altaz_t;
+
+typedef struct sidecar_header {
+  char magic[8];           // SIDECAR_MAGIC
+  uint32_t version;        // SIDECAR_VERSION
+  uint32_t header_size;    // sizeof(sidecar_header_t) when written
+  uint64_t file_size;      // Total size of the image including this header
+  uint64_t checksum;       // sidecar_checksum() of the whole image with this field zeroed
+  int64_t source_mtime_ns; // mtime of the metafits this was compiled from.  A mismatch means the metafits has been updated since.
+  int64_t source_size;
+
+  int64_t GPSTIME;  // Primary header keywords, as they appear in the metafits (no overrides applied)
+  int64_t UNIXTIME;
+  int32_t EXPOSURE;
+  int32_t CABLEDEL;
+  int32_t GEODEL;
+  int32_t CALIBDEL;
+  int32_t DERIPPLE;
+  int32_t NINPUTS;
+  float FINECHAN;
+  float INTTIME;
+  int32_t CHANNELS[24];  // Already reordered around channel 129
+  char FILENAME[304];  // 300 in subobs_udp_meta_t, rounded up to keep the layout 8 byte aligned
+  char PROJECT[32];
+  char MODE[32];
+
+  int32_t ntimes;        // Rows in ALTAZ
+  int32_t nbeams;        // Beams in BEAMALTAZ, or 0 if it isn't there
+  int32_t nbeam_times;   // Time steps in BEAMALTAZ
+  int32_t spare;
+  uint64_t tiles_offset;      // sidecar_tile_t[NINPUTS]
+  uint64_t altaz_offset;      // sidecar_altaz_t[ntimes]
+  uint64_t beamaltaz_offset;  // double[nbeam_times][nbeams][3] (alt, az, dist)
+} sidecar_header_t;
+
+#define SIDECAR_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+uint64_t sidecar_checksum(const sidecar_header_t *h) {  // Word at a time multiply/xor hash.  file_size is always a multiple of 8.
+  sidecar_header_t zeroed = *h;
+  zeroed.checksum         = 0;
+  uint64_t sum            = 0x9E3779B97F4A7C15ULL;
+  const uint64_t *wp      = (const uint64_t *)&zeroed;
+  for (size_t loop = 0; loop < sizeof(zeroed) / 8; loop++) sum = ((sum ^ wp[loop]) * 0x100000001B3ULL) ^ (sum >> 29);
+  wp = (const uint64_t *)((const char *)h + sizeof(zeroed));
+  for (size_t loop = 0; loop < (h->file_size - sizeof(zeroed)) / 8; loop++) sum = ((sum ^ wp[loop]) * 0x100000001B3ULL) ^ (sum >> 29);
+  return sum;
+}
+
+bool sidecar_valid(const sidecar_header_t *h, size_t size) {
+  if (size < sizeof(sidecar_header_t) || memcmp(h->magic, SIDECAR_MAGIC, 8) != 0 || h->version != SIDECAR_VERSION || h->header_size != sizeof(sidecar_header_t) ||
+      h->file_size != size || (size & 7) != 0)
+    return false;
+  if (h->NINPUTS < 0 || h->ntimes < 0 || h->nbeams < 0 || h->nbeam_times < 0) return false;
+  if (h->tiles_offset + h->NINPUTS * sizeof(sidecar_tile_t) > size || h->altaz_offset + h->ntimes * sizeof(sidecar_altaz_t) > size ||
+      h->beamaltaz_offset + (uint64_t)h->nbeam_times * h->nbeams * 3 * sizeof(double) > size)
+    return false;
+  return sidecar_checksum(h) == h->checksum;
+}
+
+void sidecar_name(const char *metafits_file, char *sidecar_file, size_t len) {  // 1234_metafits.fits -> 1234_metafits.u2s
+  size_t base = strlen(metafits_file);
+  if (base >= 5 && strcmp(&metafits_file[base - 5], ".fits") == 0) base -= 5;
+  snprintf(sidecar_file, len, "%.*s" SIDECAR_SUFFIX, (int)base, metafits_file);
+}
+
+// Parse a metafits with the mfits reader into a malloc'd sidecar image.  Returns NULL on failure (having said why).
+sidecar_header_t *compile_metafits(const char *metafits_file) {
+  struct stat filestats;
+  if (stat(metafits_file, &filestats) == -1) return NULL;  // Before we read, so an update while we're reading makes the sidecar look stale
+
+  mfits_t mf;
+  if (!mfits_open(metafits_file, &mf)) return NULL;
+
+  sidecar_header_t hdr = {0};
+  sidecar_header_t *h  = NULL;
+  char *channels       = NULL;
+  int *ants            = NULL;
+  char(*pols)[8]       = NULL;
+  const mfits_hdu_t *hdu = &mf.hdu[0];
+  const mfits_col_t *col = NULL;
+  const char *missing_key = NULL;
+
+#define MFITS_KEY(OK, KEY) \
+  if (missing_key == NULL && !(OK)) missing_key = KEY;
+
+  MFITS_KEY(mfits_key_int64(hdu, "GPSTIME", &hdr.GPSTIME), "GPSTIME");
+  MFITS_KEY(mfits_key_int(hdu, "EXPOSURE", &hdr.EXPOSURE), "EXPOSURE");
+  MFITS_KEY(mfits_key_str(hdu, "FILENAME", hdr.FILENAME, sizeof(hdr.FILENAME)), "FILENAME");
+  MFITS_KEY(mfits_key_int(hdu, "CABLEDEL", &hdr.CABLEDEL), "CABLEDEL");
+  MFITS_KEY(mfits_key_int(hdu, "GEODEL", &hdr.GEODEL), "GEODEL");
+  MFITS_KEY(mfits_key_int(hdu, "CALIBDEL", &hdr.CALIBDEL), "CALIBDEL");
+  MFITS_KEY(mfits_key_int(hdu, "DERIPPLE", &hdr.DERIPPLE), "DERIPPLE");
+  MFITS_KEY(mfits_key_str(hdu, "PROJECT", hdr.PROJECT, sizeof(hdr.PROJECT)), "PROJECT");
+  MFITS_KEY(mfits_key_str(hdu, "MODE", hdr.MODE, sizeof(hdr.MODE)), "MODE");
+  MFITS_KEY(mfits_key_float(hdu, "FINECHAN", &hdr.FINECHAN), "FINECHAN");
+  MFITS_KEY(mfits_key_float(hdu, "INTTIME", &hdr.INTTIME), "INTTIME");
+  MFITS_KEY(mfits_key_int(hdu, "NINPUTS", &hdr.NINPUTS), "NINPUTS");
+  MFITS_KEY(mfits_key_int64(hdu, "UNIXTIME", &hdr.UNIXTIME), "UNIXTIME");
+#undef MFITS_KEY
+
+  if (missing_key) {
+    printf("Failed to read %s\n", missing_key);
+    fflush(stdout);
+    goto cleanup;
+  }
+
+  if (!mfits_key_longstr(hdu, "CHANNELS", &channels)) {
+    printf("Failed to read Channels\n");
+    fflush(stdout);
+    goto cleanup;
+  }
+  if (!parse_channels(channels, hdr.CHANNELS)) goto cleanup;
+
+  const mfits_hdu_t *tiledata  = mfits_hdu(&mf, "TILEDATA");
+  const mfits_hdu_t *altaz     = mfits_hdu(&mf, "ALTAZ");
+  const mfits_hdu_t *beamaltaz = mfits_hdu(&mf, "BEAMALTAZ");
+  if (tiledata == NULL || !tiledata->is_table) {
+    printf("Error in metafits access (Moving to TILEDATA HDU)\n");
+    goto cleanup;
+  }
+  if (altaz == NULL || !altaz->is_table) {
+    printf("Error in metafits access (Moving to ALTAZ HDU)\n");
+    goto cleanup;
+  }
+  if (mfits_nrows(tiledata) != hdr.NINPUTS) {
+    printf("NINPUTS (%d) doesn't match number of rows in tile data table (%ld)\n", hdr.NINPUTS, mfits_nrows(tiledata));
+    goto cleanup;
+  }
+  if (beamaltaz != NULL) {
+    if (beamaltaz->is_table || beamaltaz->naxis != 3 || beamaltaz->bitpix != -64 || beamaltaz->naxes[1] <= 0 || beamaltaz->naxes[0] != 3) {
+      printf("BEAMALTAZ has unexpected shape or type\n");
+      goto cleanup;
+    }
+    hdr.nbeams      = beamaltaz->naxes[1];
+    hdr.nbeam_times = beamaltaz->naxes[2];
+  }
+
+  int nrows            = hdr.NINPUTS;
+  hdr.ntimes           = mfits_nrows(altaz);
+  hdr.tiles_offset     = SIDECAR_ALIGN(sizeof(sidecar_header_t));
+  hdr.altaz_offset     = SIDECAR_ALIGN(hdr.tiles_offset + nrows * sizeof(sidecar_tile_t));
+  hdr.beamaltaz_offset = SIDECAR_ALIGN(hdr.altaz_offset + hdr.ntimes * sizeof(sidecar_altaz_t));
+  hdr.file_size        = SIDECAR_ALIGN(hdr.beamaltaz_offset + (uint64_t)hdr.nbeam_times * hdr.nbeams * 3 * sizeof(double));
+
+  h    = calloc_or_die(1, hdr.file_size, "sidecar image");
+  *h   = hdr;
+  ants = malloc(nrows * sizeof(int));
+  pols = malloc(nrows * sizeof(*pols));
+  if (!ants || !pols) {
+    printf("Memory allocation failed.\n");
+    goto fail;
+  }
+
+  //---------- TILEDATA, decoded straight into sub file order ----------
+
+  hdu                    = tiledata;
+  sidecar_tile_t *tiles  = (sidecar_tile_t *)((char *)h + h->tiles_offset);
+  int *ints              = malloc(nrows * sizeof(int));
+  float *floats          = malloc(nrows * sizeof(float));
+  char(*strings)[15]     = malloc(nrows * sizeof(*strings));
+  int *order             = malloc(nrows * sizeof(int));
+  bool columns_ok        = ints && floats && strings && order;
+
+#define MFITS_COL(NAME, READ)                                               \
+  if (columns_ok && ((col = mfits_col(hdu, NAME)) == NULL || !(READ))) {    \
+    printf("Error in metafits access (reading %s column)\n", NAME);         \
+    columns_ok = false;                                                     \
+  }
+
+  MFITS_COL("Antenna", mfits_read_col_int(hdu, col, 0, nrows, ants));
+  MFITS_COL("Pol", mfits_read_col_str(hdu, col, 0, nrows, pols[0], sizeof(*pols)));
+  for (int loop = 0; columns_ok && loop < nrows; loop++) {
+    order[loop] = (ants[loop] << 1) | ((pols[loop][0] == 'Y') ? 1 : 0);  // "Antenna" times 2, plus 1 for Y.  That's where it goes in the sub file.
+    if (order[loop] < 0 || order[loop] >= nrows) {
+      printf("Antenna %d (%s) out of range for %d inputs\n", ants[loop], pols[loop], nrows);
+      columns_ok = false;
+      break;
+    }
+    tiles[order[loop]].Antenna = ants[loop];
+    memcpy(tiles[order[loop]].Pol, pols[loop], sizeof(tiles[0].Pol));
+  }
+
+  MFITS_COL("Input", mfits_read_col_int(hdu, col, 0, nrows, ints));
+  for (int loop = 0; columns_ok && loop < nrows; loop++) tiles[order[loop]].Input = ints[loop];
+  MFITS_COL("Tile", mfits_read_col_int(hdu, col, 0, nrows, ints));
+  for (int loop = 0; columns_ok && loop < nrows; loop++) tiles[order[loop]].Tile = ints[loop];
+  MFITS_COL("TileName", mfits_read_col_str(hdu, col, 0, nrows, strings[0], sizeof(*strings)));
+  for (int loop = 0; columns_ok && loop < nrows; loop++) snprintf(tiles[order[loop]].TileName, sizeof(tiles[0].TileName), "%.8s", strings[loop]);
+  MFITS_COL("Rx", mfits_read_col_int(hdu, col, 0, nrows, ints));
+  for (int loop = 0; columns_ok && loop < nrows; loop++) tiles[order[loop]].Rx = ints[loop];
+  MFITS_COL("Slot", mfits_read_col_int(hdu, col, 0, nrows, ints));
+  for (int loop = 0; columns_ok && loop < nrows; loop++) tiles[order[loop]].Slot = ints[loop];
+  MFITS_COL("Flag", mfits_read_col_int(hdu, col, 0, nrows, ints));
+  for (int loop = 0; columns_ok && loop < nrows; loop++) tiles[order[loop]].Flag = ints[loop];
+  MFITS_COL("Length", mfits_read_col_str(hdu, col, 0, nrows, strings[0], sizeof(*strings)));
+  for (int loop = 0; columns_ok && loop < nrows; loop++) tiles[order[loop]].Length_mm = roundl(strtold(strings[loop] + 3, NULL) * 1000.0);  // skip the 'EL_'
+  MFITS_COL("North", mfits_read_col_float(hdu, col, 0, nrows, floats));
+  for (int loop = 0; columns_ok && loop < nrows; loop++) tiles[order[loop]].North_mm = roundl(floats[loop] * 1000.0);
+  MFITS_COL("East", mfits_read_col_float(hdu, col, 0, nrows, floats));
+  for (int loop = 0; columns_ok && loop < nrows; loop++) tiles[order[loop]].East_mm = roundl(floats[loop] * 1000.0);
+  MFITS_COL("Height", mfits_read_col_float(hdu, col, 0, nrows, floats));
+  for (int loop = 0; columns_ok && loop < nrows; loop++) tiles[order[loop]].Height_mm = roundl(floats[loop] * 1000.0);
+
+  free(ints);
+  free(floats);
+  free(strings);
+  free(order);
+  if (!columns_ok) goto fail;
+
+  //---------- The whole ALTAZ table ----------
+
+  hdu                    = altaz;
+  sidecar_altaz_t *rows  = (sidecar_altaz_t *)((char *)h + h->altaz_offset);
+  int64_t *gpstimes      = malloc((h->ntimes + 1) * sizeof(int64_t));
+  float *values          = malloc((h->ntimes + 1) * sizeof(float));
+  columns_ok             = gpstimes && values;
+  MFITS_COL("gpstime", mfits_read_col_int64(hdu, col, 0, h->ntimes, gpstimes));
+  for (int loop = 0; columns_ok && loop < h->ntimes; loop++) rows[loop].gpstime = gpstimes[loop];
+  MFITS_COL("Alt", mfits_read_col_float(hdu, col, 0, h->ntimes, values));
+  for (int loop = 0; columns_ok && loop < h->ntimes; loop++) rows[loop].Alt = values[loop];
+  MFITS_COL("Az", mfits_read_col_float(hdu, col, 0, h->ntimes, values));
+  for (int loop = 0; columns_ok && loop < h->ntimes; loop++) rows[loop].Az = values[loop];
+  MFITS_COL("Dist_km", mfits_read_col_float(hdu, col, 0, h->ntimes, values));
+  for (int loop = 0; columns_ok && loop < h->ntimes; loop++) rows[loop].Dist_km = values[loop];
+  free(gpstimes);
+  free(values);
+  if (!columns_ok) goto fail;
+#undef MFITS_COL
+
+  //---------- The whole BEAMALTAZ image (it's already in [time][beam][alt,az,dist] order) ----------
+
+  if (h->nbeams > 0 && !mfits_read_pixels(beamaltaz, 0, (int64_t)h->nbeam_times * h->nbeams * 3, (double *)((char *)h + h->beamaltaz_offset))) {
+    printf("Error in metafits access (reading BEAMALTAZ)\n");
+    goto fail;
+  }
+
+  memcpy(h->magic, SIDECAR_MAGIC, 8);
+  h->version         = SIDECAR_VERSION;
+  h->header_size     = sizeof(sidecar_header_t);
+  h->source_mtime_ns = filestats.st_mtim.tv_sec * 1000000000LL + filestats.st_mtim.tv_nsec;
+  h->source_size     = filestats.st_size;
+  h->checksum        = sidecar_checksum(h);
+  goto cleanup;
+
+fail:
+  free(h);
+  h = NULL;
+cleanup:
+  free(channels);
+  free(ants);
+  free(pols);
+  mfits_close(&mf);
+  return h;
+}
+
+// Fill in subm for its subobs from a (validated) sidecar image.  Same contract as read_metafits().
+bool apply_sidecar(const sidecar_header_t *h, subobs_udp_meta_t *subm) {
+  const sidecar_tile_t *tiles  = (const sidecar_tile_t *)((const char *)h + h->tiles_offset);
+  const sidecar_altaz_t *rows  = (const sidecar_altaz_t *)((const char *)h + h->altaz_offset);
+  const double *beams          = (const double *)((const char *)h + h->beamaltaz_offset);
+
+  subm->GPSTIME  = h->GPSTIME;
+  subm->EXPOSURE = h->EXPOSURE;
+  subm->CABLEDEL = h->CABLEDEL;
+  subm->GEODEL   = h->GEODEL;
+  subm->CALIBDEL = h->CALIBDEL;
+  subm->DERIPPLE = h->DERIPPLE;
+  snprintf(subm->FILENAME, sizeof(subm->FILENAME), "%.*s", (int)sizeof(subm->FILENAME) - 1, h->FILENAME);
+  snprintf(subm->PROJECT, sizeof(subm->PROJECT), "%s", h->PROJECT);
+  snprintf(subm->MODE, sizeof(subm->MODE), "%s", h->MODE);
+  if (debug_mode || force_cable_delays) subm->CABLEDEL = 1;
+  if (debug_mode || force_geo_delays) subm->GEODEL = 3;
+
+  if ((subm->GPSTIME + (int64_t)subm->EXPOSURE - 1) < (int64_t)subm->subobs) {  // If the last observation has expired. (-1 because inclusive)
+    strcpy(subm->MODE, "NO_CAPTURE");                                           // then change the mode to NO_CAPTURE
+  }
+
+  reserve_beams(subm, 0);  // Room for the tile pointing at least
+  memcpy(subm->CHANNELS, h->CHANNELS, sizeof(subm->CHANNELS));
+  subm->ncoherant_beams = 0;
+  subm->COARSE_CHAN     = subm->CHANNELS[conf.coarse_chan - 1];  // conf.coarse_chan numbers are 1 to 24 inclusive, but the array index is 0 to 23 incl.
+  if (subm->COARSE_CHAN == 0) printf("Failed to parse valid coarse channel\n");
+
+  subm->FINECHAN     = h->FINECHAN;
+  subm->FINECHAN_hz  = (int)(subm->FINECHAN * 1000.0);
+  subm->INTTIME      = h->INTTIME;
+  subm->INTTIME_msec = (int)(subm->INTTIME * 1000.0);
+  subm->UNIXTIME     = h->UNIXTIME;
+
+  subm->NINPUTS = h->NINPUTS;
+  if (subm->NINPUTS == 0) printf("subfile specifies no inputs!?\n");
+  discard_inputs(subm);  // The tiles are already in sub file order, so this keeps the first max_inputs of them
+
+  for (int loop = 0; loop < subm->NINPUTS; loop++) {
+    tile_meta_t *rfm = &subm->rf_inp[loop];
+    rfm->Input       = tiles[loop].Input;
+    rfm->Antenna     = tiles[loop].Antenna;
+    rfm->Tile        = tiles[loop].Tile;
+    rfm->Rx          = tiles[loop].Rx;
+    rfm->Slot        = tiles[loop].Slot;
+    rfm->Flag        = tiles[loop].Flag;
+    snprintf(rfm->TileName, sizeof(rfm->TileName), "%.8s", tiles[loop].TileName);
+    snprintf(rfm->Pol, sizeof(rfm->Pol), "%.1s", tiles[loop].Pol);
+    rfm->Length_f = tiles[loop].Length_mm;
+    rfm->North    = tiles[loop].North_mm;
+    rfm->East     = tiles[loop].East_mm;
+    rfm->Height   = tiles[loop].Height_mm;
+  }
+
+  if ((subm->GEODEL == 1) || ((((subm->subobs - subm->GPSTIME) >> 2) + 3) > h->ntimes)) {  // zenith requested, or we're past the end of the pointing table
+    for (int loop = 0; loop < 3; loop++) {
+      subm->altaz[0][loop].gpstime = (subm->subobs + loop * 4);
+      subm->altaz[0][loop].Alt     = 90.0;
+      subm->altaz[0][loop].Az      = 0.0;
+      subm->altaz[0][loop].Dist_km = 0.0;
+    }
+    printf("Using zenith pointing\n");
+
+  } else {
+    int64_t frow = (subm->subobs - subm->GPSTIME) >> 2;  // 0 based row of the pointing at the start of this subobs
+    for (int loop = 0; loop < 3; loop++) {
+      subm->altaz[0][loop].gpstime = rows[frow + loop].gpstime;
+      subm->altaz[0][loop].Alt     = rows[frow + loop].Alt;
+      subm->altaz[0][loop].Az      = rows[frow + loop].Az;
+      subm->altaz[0][loop].Dist_km = rows[frow + loop].Dist_km;
+    }
+
+    if (h->nbeams == 0) {
+      printf("No BEAMALTAZ HDU present\n");
+      fflush(stdout);
+    } else {
+      if (frow + 3 > h->nbeam_times) {
+        printf("Error in metafits access (reading BEAMALTAZ subsection for current subobservation)\n");
+        return false;
+      }
+      int beam_count = h->nbeams;
+      if (beam_count > max_coherent_beams()) {
+        printf("WARNING: Too many coherent beams (%d) in this subobservation, only using the first %d\n", beam_count, max_coherent_beams());
+        beam_count = max_coherent_beams();
+      }
+      reserve_beams(subm, beam_count);
+      subm->ncoherant_beams = beam_count;
+      for (int beam_index = 0; beam_index < beam_count; beam_index++) {
+        for (int time_step = 0; time_step < 3; time_step++) {
+          const double *bp                               = &beams[((frow + time_step) * h->nbeams + beam_index) * 3];
+          subm->altaz[beam_index + 1][time_step].Alt     = (float)bp[0];
+          subm->altaz[beam_index + 1][time_step].Az      = (float)bp[1];
+          subm->altaz[beam_index + 1][time_step].Dist_km = (float)bp[2];
+          subm->altaz[beam_index + 1][time_step].gpstime = subm->altaz[0][time_step].gpstime;
+        }
+      }
+    }
+
+    add_dummy_beams(subm);
+    print_pointings(subm);
+  }
+  return true;
+}
+
+// Write a sidecar image to disk atomically (temp file then rename), so a concurrent reader on another host never sees half of one.
+bool write_sidecar(const sidecar_header_t *h, const char *sidecar_file) {
+  char temp_file[340];
+  char host[64] = "unknown";
+  gethostname(host, sizeof(host));
+  snprintf(temp_file, sizeof(temp_file), "%s.%s.%d", sidecar_file, host, getpid());
+
+  int fd = open(temp_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) return false;
+  bool ok = (write(fd, h, h->file_size) == (ssize_t)h->file_size);
+  ok      = (close(fd) == 0) && ok;
+  if (ok) ok = (rename(temp_file, sidecar_file) == 0);
+  if (!ok) unlink(temp_file);
+  return ok;
+}
+
+// Use the sidecar for a metafits, if there's one that's valid and at least as new as the metafits.
+// The last sidecar mapped is kept mapped, so every subobs after the first in an observation only costs a couple of stats.
+bool read_metafits_sidecar(const char *metafits_file, subobs_udp_meta_t *subm) {
+  static char mapped_file[340] = "";
+  static struct stat mapped_stats;
+  static const sidecar_header_t *mapped = NULL;
+
+  char sidecar_file[340];
+  struct stat fits_stats, sidecar_stats;
+  sidecar_name(metafits_file, sidecar_file, sizeof(sidecar_file));
+  if (stat(metafits_file, &fits_stats) == -1 || stat(sidecar_file, &sidecar_stats) == -1) return false;
+
+  int64_t fits_mtime_ns    = fits_stats.st_mtim.tv_sec * 1000000000LL + fits_stats.st_mtim.tv_nsec;
+  int64_t sidecar_mtime_ns = sidecar_stats.st_mtim.tv_sec * 1000000000LL + sidecar_stats.st_mtim.tv_nsec;
+  if (sidecar_mtime_ns < fits_mtime_ns) return false;  // metafits has been updated since the sidecar was written
+
+  if (mapped == NULL || strcmp(mapped_file, sidecar_file) != 0 || mapped_stats.st_ino != sidecar_stats.st_ino || mapped_stats.st_dev != sidecar_stats.st_dev ||
+      mapped_stats.st_mtim.tv_sec != sidecar_stats.st_mtim.tv_sec || mapped_stats.st_mtim.tv_nsec != sidecar_stats.st_mtim.tv_nsec) {
+    if (mapped) munmap((void *)mapped, mapped->file_size);
+    mapped = NULL;
+
+    int fd = open(sidecar_file, O_RDONLY);
+    if (fd == -1) return false;
+    const sidecar_header_t *h = mmap(NULL, sidecar_stats.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) return false;
+    if (!sidecar_valid(h, sidecar_stats.st_size)) {
+      munmap((void *)h, sidecar_stats.st_size);
+      printf("Ignoring invalid sidecar %s\n", sidecar_file);
+      fflush(stdout);
+      return false;
+    }
+    mapped       = h;
+    mapped_stats = sidecar_stats;
+    snprintf(mapped_file, sizeof(mapped_file), "%s", sidecar_file);
+  }
+
+  if (mapped->source_mtime_ns != fits_mtime_ns || mapped->source_size != fits_stats.st_size) return false;  // compiled from a different version of the metafits
+  return apply_sidecar(mapped, subm);
+}
+
+// Same contract as read_metafits(), but using the mfits mmap reader instead of CFITSIO.
+bool read_metafits_mmap(const char *metafits_file, subobs_udp_meta_t *subm) {
+  sidecar_header_t *h = compile_metafits(metafits_file);
+  if (h == NULL) return false;
+  bool ok = apply_sidecar(h, subm);
+  free(h);
+  return ok;
+}
+
+// Read the metafits for a subobs the fastest way available:  sidecar, then our own mmap reader (writing a sidecar for next time), then cfitsio.
+bool load_metafits(const char *metafits_file, subobs_udp_meta_t *subm) {
+  bool ok = use_sidecars && read_metafits_sidecar(metafits_file, subm);
+
+  if (!ok) {
+    sidecar_header_t *h = compile_metafits(metafits_file);
+    if (h != NULL) {
+      ok = apply_sidecar(h, subm);
+      if (ok && use_sidecars) {
+        char sidecar_file[340];
+        sidecar_name(metafits_file, sidecar_file, sizeof(sidecar_file));
+        if (!write_sidecar(h, sidecar_file)) report_substatus("add_meta_fits", "couldn't write sidecar %s.", sidecar_file);
+      }
+      free(h);
+    }
+  }
+
+  if (!ok) {
+    report_substatus("add_meta_fits", "mmap read of %s failed, falling back to cfitsio.", metafits_file);
+    ok = read_metafits(metafits_file, subm);
+  } else if (metafits_cross_check) {  // Read it again with cfitsio and make sure we agree
+    subobs_udp_meta_t *check = alloc_subobs(1, "metafits cross-check");
+    check->subobs            = subm->subobs;
+    if (!read_metafits(metafits_file, check)) {
+      report_substatus("add_meta_fits", "cross-check: cfitsio failed to read %s.", metafits_file);
+    } else if (compare_metafits(subm, check) != 0) {
+      report_substatus("add_meta_fits", "cross-check: mmap and cfitsio readers disagree on %s.", metafits_file);
+    }
+    free_subobs(check, 1);
+  }
+  return ok;
+}
+
+void test_read_metafits(int tdi) {
+  subobs_udp_meta_t sub  = {0};
+  int instance           = 0;                                   // Assume we're the first (or only) instance on this server
+  int chan_override      = 0;                                   // Assume we are going to use the default coarse channel for this instance
+  char *conf_file        = "/vulcan/mwax_config/mwax_u2s.cfg";  // Default configuration path
+  char *shared_conf_file = "/vulcan/mwax_config/mwax.cfg";      // Default shared configuration path
+  char hostname[300];                                           // Long enough to fit a 255 host name.  Probably it will only be short, but -hey- it's just a few bytes
+  if (gethostname(hostname, sizeof hostname) == -1) strcpy(hostname, "unknown");  // Get the hostname or default to unknown if we fail
+  printf("Running udp2sub on %s.  ver " THISVER " Build %d\n", hostname, BUILD);
+
+  read_config(conf_file, shared_conf_file, hostname, instance, chan_override, &conf);
+  printf("conf.coarse_chan = %d\n", conf.coarse_chan);
+  sub.rf_inp = calloc_aligned_or_die(max_inputs, sizeof(tile_meta_t), "rf_inp");  // Sized by read_config()
+
+  struct {
+    char *fnam;
+    uint32_t subobs;
   } test_data[] = {
       {"/voltdata/test_data/1448844664_vbtest.fits", 1448844664},  {"/voltdata/test_data/1448844664_vbtest.fits", 1448844664 + 16},
       {"/home/mwa/incident/1408332144_metafits.fits", 1408332145}, {"/home/mwa/incident/1408313944_metafits.fits", 1408313945},
@@ -1730,6 +3604,7 @@ void test_read_metafits(int tdi) {
   sub.subobs = test_data[tdi].subobs;
   bool ok    = read_metafits(test_data[tdi].fnam, &sub);
   printf("read_metafits(\"%s\", &sub) returned %s\n\n", test_data[tdi].fnam, ok ? "true" : "false");
+  free(sub.rf_inp);
 }
 
 //---------------------------------------------------------------------------------------------------------------------------------------------------
@@ -1765,6 +3640,13 @@ void add_meta_fits() {
 
   long double a, b, c;  // coefficients of the delay fitting parabola
 
+  double *tile_north        = calloc_or_die(max_inputs, sizeof(double), "tile_north");  // Tile positions (mm) as separate arrays for the delay engine
+  double *tile_east         = calloc_or_die(max_inputs, sizeof(double), "tile_east");
+  double *tile_height       = calloc_or_die(max_inputs, sizeof(double), "tile_height");
+  pointing_vec_t *pointings = NULL;  // [pointing] and
+  double *path_mm           = NULL;  // [pointing][input] for the delay engine.  Grown as needed for the number of beams.
+  int path_capacity         = 0;     // Pointings they have room for
+
   int ticks_waited = 0;
 
   //---------------- Main loop to live in until shutdown -------------------
@@ -1779,25 +3661,19 @@ void add_meta_fits() {
 
     //---------- look for a sub which needs metafits info ----------
 
-    slot_index = -1;  // Start by assuming there's nothing to do
+    unsigned seen = stage_seq(&meta_work);        // Note where meta_work was, so a request after we've looked still wakes us
+    slot_index    = stage_queue_pop(&meta_queue);  // The oldest sub waiting for metadata, or -1 if there isn't one
 
-    for (int loop = 0; loop < SUB_SLOTS; loop++) {  // Look through all four subobs meta arrays
-
-      if ((slot_state[loop] == 6) && (meta_state[loop] < 2)) {   // If we are in the process of abandoning this slot, but haven't started reading metadata yet
-        meta_state[loop] = 6;                                    // metadata read cancelled, the clearing thread doesn't need to wait for metadata read completion.
-      } else if (meta_state[loop] == 1) {                        // If this sub is ready to have M&C metadata added
-        if (slot_index == -1) {                                  // check if we've already found a different one to do and if we haven't
-          slot_index = loop;                                     // then mark this one as the best so far
-        } else if (sub[slot_index].subobs > sub[loop].subobs) {  // if that other one was for a later sub than this one
-          slot_index = loop;                                     // then mark this one as the most urgent
-        }
-      }
-    }  // We left this loop with an index to the best sub to do or a -1 if none available.
+    if (slot_index != -1 && slot_state[slot_index] == 6) {  // If we are in the process of abandoning this slot, we needn't read its metadata
+      meta_state[slot_index] = 6;                           // metadata read cancelled, the clearing thread doesn't need to wait for metadata read completion.
+      slot_handoff(slot_index);
+      continue;
+    }
 
     //---------- if we don't have one ----------
 
-    if (slot_index == -1) {  // if there is nothing to do
-      usleep(100000);        // Chill for a longish time.  NO point in checking more often than a couple of times a second.
+    if (slot_index == -1) {                 // if there is nothing to do
+      stage_wait(&meta_work, seen, 100);  // Chill until UDP_parse asks for something, or a longish time
       ticks_waited += 1;
       if (ticks_waited % (10 * 6) == 0) {  // every few seconds
         report_substatus("add_meta_fits", "waiting");
@@ -1861,17 +3737,36 @@ void add_meta_fits() {
 
       if (go4meta) {                                                                    // If everything is okay so far, enter the next block of code
         sprintf(metafits_file, "%s/%ld_metafits.fits", conf.metafits_dir, bcsf_obsid);  // Construct the full file name including path
-        go4meta = read_metafits(metafits_file, subm);
+        go4meta = load_metafits(metafits_file, subm);
         report_substatus("add_meta_fits", "attempt to read %s %s.", metafits_file, go4meta ? "succeeded" : "failed");
       }  // End of 'go for meta' metafile reading
 
+      if (go4meta && subm->GEODEL >= 1) {  // Path differences for every input towards the tile pointing and every beam, at the start, middle and end
+        int npointings = (1 + subm->ncoherant_beams) * 3;
+        if (npointings > path_capacity) {
+          free(pointings);
+          free(path_mm);
+          pointings     = calloc_or_die(npointings, sizeof(pointing_vec_t), "pointings");
+          path_mm       = calloc_or_die((size_t)npointings * max_inputs, sizeof(double), "path_mm");
+          path_capacity = npointings;
+        }
+        for (int loop = 0; loop < subm->NINPUTS; loop++) {
+          tile_north[loop]  = subm->rf_inp[loop].North;
+          tile_east[loop]   = subm->rf_inp[loop].East;
+          tile_height[loop] = subm->rf_inp[loop].Height;
+        }
+        for (int loop = 0; loop < npointings; loop++) pointings[loop] = pointing_vector(subm->altaz[loop / 3][loop % 3].Alt, subm->altaz[loop / 3][loop % 3].Az);
+        path_differences(subm->NINPUTS, tile_north, tile_east, tile_height, npointings, pointings, path_mm);
+      }
+
       if (go4meta) {
         //---------- Let's take all that metafits info, do some maths and other processing and get it ready to use, for when we need to actually write out the sub file
 
         for (int loop = 0; loop < subm->NINPUTS; loop++) {
-          tile_meta_t *rfm = &subm->rf_inp[loop];                           // Make a temporary pointer to this rf input, if only for readability of the source
-          rfm->rf_input = (rfm->Tile << 1) | ((*rfm->Pol == 'Y') ? 1 : 0);  // Take the "Tile" number, multiply by 2 via lshift and iff the 'Pol' is Y, then add in a 1. That gives
-          // the content of the 'rf_input' field in the udp packets for this row
+          tile_meta_t *rfm = &subm->rf_inp[loop];  // Make a temporary pointer to this rf input, if only for readability of the source
+          tile_hot_t *hot  = &subm->hot;
+          hot->rf_input[loop] = (rfm->Tile << 1) | ((*rfm->Pol == 'Y') ? 1 : 0);  // Take the "Tile" number, multiply by 2 via lshift and iff the 'Pol' is Y, then add in a 1.
+          // That gives the content of the 'rf_input' field in the udp packets for this row
 
           long double delay_so_far_start_mm  = 0;  // accumulator for delay to apply IN MILLIMETRES calculated so far at start of 8 sec subobservation
           long double delay_so_far_middle_mm = 0;  // accumulator for delay to apply IN MILLIMETRES calculated so far at middle of 8 sec subobservation
@@ -1889,21 +3784,27 @@ void add_meta_fits() {
 
           if (subm->GEODEL >= 1) {
             // GEODEL field. (0=nothing, 1=zenith, 2=tile-pointing, 3=az/el table tracking)
-            rfm->geometric_offset_mm[0] = get_path_difference(rfm->North, rfm->East, rfm->Height, subm->altaz[0][0].Alt, subm->altaz[0][0].Az);
-            rfm->geometric_offset_mm[1] = get_path_difference(rfm->North, rfm->East, rfm->Height, subm->altaz[0][1].Alt, subm->altaz[0][1].Az);
-            rfm->geometric_offset_mm[2] = get_path_difference(rfm->North, rfm->East, rfm->Height, subm->altaz[0][2].Alt, subm->altaz[0][2].Az);
+            rfm->geometric_offset_mm[0] = path_mm[0 * subm->NINPUTS + loop];  // Pointings 0,1,2 are the tile pointing at the start, middle and end
+            rfm->geometric_offset_mm[1] = path_mm[1 * subm->NINPUTS + loop];
+            rfm->geometric_offset_mm[2] = path_mm[2 * subm->NINPUTS + loop];
             delay_so_far_start_mm += rfm->geometric_offset_mm[0];
             delay_so_far_middle_mm += rfm->geometric_offset_mm[1];
             delay_so_far_end_mm += rfm->geometric_offset_mm[2];
 
-            assert(subm->ncoherant_beams <= COHERENT_BEAMS_MAX);
+            assert(subm->ncoherant_beams <= subm->beam_capacity);
 
-            for (int i = 0; i < subm->ncoherant_beams; i++) {
-              for (int time_step = 0; time_step < 3; time_step++) {
-                long double delta = get_path_difference(rfm->North, rfm->East, rfm->Height, subm->altaz[i + 1][time_step].Alt, subm->altaz[i + 1][time_step].Az) -
-                                    rfm->geometric_offset_mm[time_step];
-                rfm->delay_offset_in_samples[time_step][i] = (float)(delta * mm2s_conv_factor);
-              }
+            for (int i = 0; i < subm->ncoherant_beams; i++) {  // Each beam's delays relative to the tile pointing, as they'll appear in DELAY_TABLE2
+              delay_table2_entry_t *entry = &subm->beam_delays[i * subm->NINPUTS + loop];
+              const double *beam_mm       = &path_mm[(size_t)(i + 1) * 3 * subm->NINPUTS + loop];
+              entry->rf_input             = hot->rf_input[loop];
+              entry->ws_delay             = 0;
+              entry->start_total_delay    = (float)((beam_mm[0 * subm->NINPUTS] - rfm->geometric_offset_mm[0]) * mm2s_conv_factor);
+              entry->middle_total_delay   = (float)((beam_mm[1 * subm->NINPUTS] - rfm->geometric_offset_mm[1]) * mm2s_conv_factor);
+              entry->end_total_delay      = (float)((beam_mm[2 * subm->NINPUTS] - rfm->geometric_offset_mm[2]) * mm2s_conv_factor);
+            }
+          } else {
+            for (int i = 0; i < subm->ncoherant_beams; i++) {  // No geometric delays, so the beams get none either
+              subm->beam_delays[i * subm->NINPUTS + loop] = (delay_table2_entry_t){.rf_input = hot->rf_input[loop]};
             }
           }
 
@@ -1939,25 +3840,28 @@ void add_meta_fits() {
           //---------- We'll be calulating each value in turn so we're better off passing back in a form only needing 2 additions per data point.
           //   The phase-wrap delay correction phase wants the delay at time points of x=.5, x=1.5, x=2.5, x=3.5 etc, so
           //   we'll set an initial value of a×0.5^2 + b×0.5 + c to get the first point and our first step in will be:
-          rfm->initial_delay      = a * 0.25L + b * 0.5L + c;     // ie a×0.5^2 + b×0.5 + c for our initial value of delay(0.5)
-          rfm->delta_delay        = a + a + b;                    // That's our first step.  ie delay(1.5) - delay(0.5) or if you like, (a*1.5^2+b*1.5+c) - (a*0.5^2+b*0.5+c)
-          rfm->delta_delta_delay  = a + a;                        // ie 2a because it's the 2nd derivative
-          rfm->ws_delay           = (int16_t)whole_sample_delay;  // whole_sample_delay has already been roundl(ed) somewhere above here
-          rfm->start_total_delay  = start_sub_s;
-          rfm->middle_total_delay = middle_sub_s;
-          rfm->end_total_delay    = end_sub_s;
-          DEBUG_LOG("ws: %d, initial: %d, delta: %d, delta_delta: %d\n", rfm->ws_delay, rfm->initial_delay, rfm->delta_delay, rfm->delta_delta_delay);
+          hot->initial_delay[loop]      = a * 0.25L + b * 0.5L + c;     // ie a×0.5^2 + b×0.5 + c for our initial value of delay(0.5)
+          hot->delta_delay[loop]        = a + a + b;                    // That's our first step.  ie delay(1.5) - delay(0.5) or if you like, (a*1.5^2+b*1.5+c) - (a*0.5^2+b*0.5+c)
+          hot->delta_delta_delay[loop]  = a + a;                        // ie 2a because it's the 2nd derivative
+          hot->ws_delay[loop]           = (int16_t)whole_sample_delay;  // whole_sample_delay has already been roundl(ed) somewhere above here
+          hot->start_total_delay[loop]  = start_sub_s;
+          hot->middle_total_delay[loop] = middle_sub_s;
+          hot->end_total_delay[loop]    = end_sub_s;
+          DEBUG_LOG("ws: %d, initial: %d, delta: %d, delta_delta: %d\n", hot->ws_delay[loop], hot->initial_delay[loop], hot->delta_delay[loop], hot->delta_delta_delay[loop]);
 
           //---------- Print out a bunch of debug info ----------
 
           if (debug_mode) {  // Debug logging to screen
-            printf("%d,%d,%d,%d,%d,%d,%s,%s,%d,%d,%d,%Lf,%Lf,%Lf,%Lf,%d,%f,%f,%f,%Lf,%Lf,%Lf:", subm->subobs, loop, rfm->rf_input, rfm->Input, rfm->Antenna, rfm->Tile,
+            printf("%d,%d,%d,%d,%d,%d,%s,%s,%d,%d,%d,%Lf,%Lf,%Lf,%Lf,%d,%f,%f,%f,%Lf,%Lf,%Lf:", subm->subobs, loop, hot->rf_input[loop], rfm->Input, rfm->Antenna, rfm->Tile,
                    rfm->TileName, rfm->Pol, rfm->Rx, rfm->Slot, rfm->Flag, rfm->Length_f, (delay_so_far_start_mm * mm2s_conv_factor), (delay_so_far_middle_mm * mm2s_conv_factor),
-                   (delay_so_far_end_mm * mm2s_conv_factor), rfm->ws_delay, rfm->initial_delay, rfm->delta_delay, rfm->delta_delta_delay, rfm->North, rfm->East, rfm->Height);
+                   (delay_so_far_end_mm * mm2s_conv_factor), hot->ws_delay[loop], hot->initial_delay[loop], hot->delta_delay[loop], hot->delta_delta_delay[loop], rfm->North,
+                   rfm->East, rfm->Height);
 
             printf("\n");
           }  // Only see this if we're in debug mode
         }
+
+        build_delay_tables(subm);  // Now every input's delays are known, fill in the DELAY_TABLE for makesub
       }
 
       //---------- And we're basically done reading the metafits and preping for the sub file write which is only a few second away (done by another thread)
@@ -1968,6 +3872,7 @@ void add_meta_fits() {
                              ((ended_meta_write_time.tv_nsec - started_meta_write_time.tv_nsec) / 1000000);  // msec since this sub started
 
       meta_state[slot_index] = go4meta ? 4 : 5;  // Record that we've finished working on this one even if we gave up.  Will be a 4 or a 5 depending on whether it worked or not.
+      slot_handoff(slot_index);
 
       if (go4meta) {
         report_substatus("add_meta_fits", "subobs %d slot %d. Read metafits successfully.", subm->subobs, slot_index);
@@ -1976,6 +3881,12 @@ void add_meta_fits() {
       }
     }  // End of 'if there is a metafits to read' (actually an 'else' off 'is there nothing to do')
   }  // End of huge 'while !terminate' loop
+
+  free(tile_north);
+  free(tile_east);
+  free(tile_height);
+  free(pointings);
+  free(path_mm);
 }  // End of function
 
 void *add_meta_fits_thread() {
@@ -1987,25 +3898,1127 @@ void *add_meta_fits_thread() {
 // makesub - Every time an 8 second block of udp packets is available, try to generate a sub files for the correlator
 //---------------------------------------------------------------------------------------------------------------------------------------------------
 
-void build_subfile_header(const subobs_udp_meta_t *subm, size_t transfer_size, int ninputs_xgpu, const data_section *data_sections, int n_data_sections);
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+// Copy kernels for the voltage data.  Nothing reads the sub file back until it's been handed on, so the streaming kernels write it with
+// non-temporal stores, rather than pulling 5GB of destination through the cache and evicting everything UDP_parse is using.
+// Picked at startup with -k (default "auto", the widest the cpu supports).  All of them return dest + n like mempcpy.  Each has a matching zero
+// fill for runs of missing packets.
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+
+typedef void *(*copy_kernel_t)(void *dest, const void *src, size_t n);
+typedef void *(*zero_kernel_t)(void *dest, size_t n);
+
+#define STREAM_MIN_BYTES 256  // Anything shorter isn't worth lining up for streaming stores
+
+void *copy_mempcpy(void *dest, const void *src, size_t n) { return mempcpy(dest, src, n); }
+void *zero_memset(void *dest, size_t n) { return (char *)memset(dest, 0, n) + n; }
+
+#if defined(__x86_64__)
+
+void *copy_stream_sse2(void *dest, const void *src, size_t n) {
+  char *d       = dest;
+  const char *s = src;
+  if (n < STREAM_MIN_BYTES) return mempcpy(d, s, n);
+  size_t head = (-(uintptr_t)d) & 15;  // Ordinary stores up to a 16 byte boundary
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  n -= head;
+  for (; n >= 64; n -= 64, d += 64, s += 64) {
+    __m128i r0 = _mm_loadu_si128((const __m128i *)s);
+    __m128i r1 = _mm_loadu_si128((const __m128i *)(s + 16));
+    __m128i r2 = _mm_loadu_si128((const __m128i *)(s + 32));
+    __m128i r3 = _mm_loadu_si128((const __m128i *)(s + 48));
+    _mm_stream_si128((__m128i *)d, r0);
+    _mm_stream_si128((__m128i *)(d + 16), r1);
+    _mm_stream_si128((__m128i *)(d + 32), r2);
+    _mm_stream_si128((__m128i *)(d + 48), r3);
+  }
+  return mempcpy(d, s, n);
+}
+
+void *zero_stream_sse2(void *dest, size_t n) {
+  char *d = dest;
+  if (n < STREAM_MIN_BYTES) return zero_memset(d, n);
+  size_t head = (-(uintptr_t)d) & 15;
+  d           = zero_memset(d, head);
+  n -= head;
+  for (; n >= 16; n -= 16, d += 16) _mm_stream_si128((__m128i *)d, _mm_setzero_si128());
+  return zero_memset(d, n);
+}
+
+__attribute__((target("avx2"))) void *copy_stream_avx2(void *dest, const void *src, size_t n) {
+  char *d       = dest;
+  const char *s = src;
+  if (n < STREAM_MIN_BYTES) return mempcpy(d, s, n);
+  size_t head = (-(uintptr_t)d) & 31;  // Ordinary stores up to a 32 byte boundary
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  n -= head;
+  for (; n >= 128; n -= 128, d += 128, s += 128) {
+    __m256i r0 = _mm256_loadu_si256((const __m256i *)s);
+    __m256i r1 = _mm256_loadu_si256((const __m256i *)(s + 32));
+    __m256i r2 = _mm256_loadu_si256((const __m256i *)(s + 64));
+    __m256i r3 = _mm256_loadu_si256((const __m256i *)(s + 96));
+    _mm256_stream_si256((__m256i *)d, r0);
+    _mm256_stream_si256((__m256i *)(d + 32), r1);
+    _mm256_stream_si256((__m256i *)(d + 64), r2);
+    _mm256_stream_si256((__m256i *)(d + 96), r3);
+  }
+  for (; n >= 32; n -= 32, d += 32, s += 32) _mm256_stream_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+  return mempcpy(d, s, n);
+}
+
+__attribute__((target("avx2"))) void *zero_stream_avx2(void *dest, size_t n) {
+  char *d = dest;
+  if (n < STREAM_MIN_BYTES) return zero_memset(d, n);
+  size_t head = (-(uintptr_t)d) & 31;
+  d           = zero_memset(d, head);
+  n -= head;
+  for (; n >= 32; n -= 32, d += 32) _mm256_stream_si256((__m256i *)d, _mm256_setzero_si256());
+  return zero_memset(d, n);
+}
+
+__attribute__((target("avx512f"))) void *copy_stream_avx512(void *dest, const void *src, size_t n) {
+  char *d       = dest;
+  const char *s = src;
+  if (n < STREAM_MIN_BYTES) return mempcpy(d, s, n);
+  size_t head = (-(uintptr_t)d) & 63;  // Ordinary stores up to a cache line boundary
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  n -= head;
+  for (; n >= 256; n -= 256, d += 256, s += 256) {
+    __m512i r0 = _mm512_loadu_si512(s);
+    __m512i r1 = _mm512_loadu_si512(s + 64);
+    __m512i r2 = _mm512_loadu_si512(s + 128);
+    __m512i r3 = _mm512_loadu_si512(s + 192);
+    _mm512_stream_si512((void *)d, r0);
+    _mm512_stream_si512((void *)(d + 64), r1);
+    _mm512_stream_si512((void *)(d + 128), r2);
+    _mm512_stream_si512((void *)(d + 192), r3);
+  }
+  for (; n >= 64; n -= 64, d += 64, s += 64) _mm512_stream_si512((void *)d, _mm512_loadu_si512(s));
+  return mempcpy(d, s, n);
+}
+
+__attribute__((target("avx512f"))) void *zero_stream_avx512(void *dest, size_t n) {
+  char *d = dest;
+  if (n < STREAM_MIN_BYTES) return zero_memset(d, n);
+  size_t head = (-(uintptr_t)d) & 63;
+  d           = zero_memset(d, head);
+  n -= head;
+  for (; n >= 64; n -= 64, d += 64) _mm512_stream_si512((void *)d, _mm512_setzero_si512());
+  return zero_memset(d, n);
+}
+
+#define copy_fence() _mm_sfence()  // Streaming stores are weakly ordered.  Fence before anyone else may look at what we wrote.
+
+#else
+
+#define copy_fence() atomic_thread_fence(memory_order_seq_cst)
+
+#endif
+
+typedef struct copy_kernel_info {
+  char *name;
+  copy_kernel_t kernel;
+  zero_kernel_t zero;
+  bool (*supported)(void);
+} copy_kernel_info_t;
+
+bool cpu_any() { return true; }
+#if defined(__x86_64__)
+bool cpu_avx2() { return __builtin_cpu_supports("avx2"); }
+bool cpu_avx512() { return __builtin_cpu_supports("avx512f"); }
+#endif
+
+copy_kernel_info_t copy_kernels[] = {  // Widest first, so "auto" is the first supported one
+#if defined(__x86_64__)
+    {"avx512", copy_stream_avx512, zero_stream_avx512, cpu_avx512},
+    {"avx2", copy_stream_avx2, zero_stream_avx2, cpu_avx2},
+    {"sse2", copy_stream_sse2, zero_stream_sse2, cpu_any},
+#endif
+    {"memcpy", copy_mempcpy, zero_memset, cpu_any},
+};
+#define NUM_COPY_KERNELS ((int)(sizeof(copy_kernels) / sizeof(copy_kernels[0])))
+
+copy_kernel_t copy_kernel    = copy_mempcpy;  // What write_volt_blocks() uses.  Set by select_copy_kernel().
+zero_kernel_t zero_kernel    = zero_memset;
+char *copy_kernel_name       = "memcpy";
+
+// Select a copy kernel by name, or "auto" for the best this cpu supports.  Returns false if it's unknown or the cpu can't do it.
+bool select_copy_kernel(const char *name) {
+  for (int loop = 0; loop < NUM_COPY_KERNELS; loop++) {
+    if ((strcmp(name, "auto") == 0 || strcmp(name, copy_kernels[loop].name) == 0) && copy_kernels[loop].supported()) {
+      copy_kernel      = copy_kernels[loop].kernel;
+      zero_kernel      = copy_kernels[loop].zero;
+      copy_kernel_name = copy_kernels[loop].name;
+      return true;
+    }
+  }
+  return false;
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+// Voltage block assembly - the copy of blocks 1 to BLOCKS_PER_SUB from the udp payloads into the sub file.
+//
+// The blocks are split into contiguous ranges, one per thread in a small pool (-w <threads>).  makesub does the first range itself and waits
+// for the others before it unmaps and renames the file.  Each range starts from where the single threaded loop would have been by then, so the
+// bytes written are identical however many threads there are ("-b makesub" checks that).
+//
+// Because each input's whole sample delay is fixed for the subobs, so is where every line of the sub file comes from.  copy_pool_run() works
+// that out as a gather plan - the source packet and offset of the start of every line, in the order the lines are written - and the threads
+// just run it.  A line is then a head (the rest of its first packet), whole packets, and a tail, with no divides or per chunk bookkeeping.  The
+// plan is kept, and only rebuilt when the slot, an input's row or start byte, or the sample rate differs from the last subobs it was built for.
+//
+// When a line starts on a packet boundary and is a whole number of packets long (an oversampled input with no whole sample delay, which is every
+// input when CABLEDEL and GEODEL are both 0) it's copied packet by packet with no split chunks.
+//
+// Missing data is never copied.  Inputs we never saw have no packets in the plan and their lines are zero filled whole, and each run of missing
+// packets is one zero fill.  With -z (downstream hands back .free files already zeroed) they aren't written at all.  Dummy packets are counted by
+// makesub from the PACKET_MAP bitmap, not here.
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+
+struct gather_line {        // Where one line of the sub file comes from
+  const uint32_t *packets;  // The input's row of udp_volts, or NULL if we never saw it
+  int packet;               // The packet holding the first byte of the line
+  int offset;               // and how far into it that byte is
+};
+
+struct copy_job {
+  const gather_line_t *plan;     // [BLOCKS_PER_SUB][ninputs] for the whole sub file
+  const mwa_udp_packet_t *ring;  // What the plan's packet references refer to
+  int ninputs;
+  char *block1_add;  // Block 1 of the sub file
+  int first_block;   // Blocks first_block to last_block-1 (1 based)
+  int last_block;
+  bool skip_zeroes;  // The file is already zeroed, so missing data needn't be written
+};
+
+typedef struct copy_pool copy_pool_t;
+
+typedef struct copy_helper {
+  copy_pool_t *pool;
+  int index;  // Which job is ours
+} copy_helper_t;
+
+struct copy_pool {
+  int nthreads;  // Including the caller of copy_pool_run()
+  pthread_t *threads;
+  copy_helper_t *helpers;
+  copy_job_t *jobs;
+  gather_line_t *plan;  // [BLOCKS_PER_SUB][max_inputs] built by copy_pool_run() when the layout changes
+  int plan_ninputs;     // What the plan was built for.  0 if it hasn't been
+  bool plan_oversampled;
+  pthread_mutex_t lock;
+  pthread_cond_t go;    // Signalled when there's a new generation of jobs to do
+  pthread_cond_t done;  // Signalled when the last helper finishes its job
+  uint64_t generation;
+  int running;      // Helpers still working on this generation
+  int64_t faults;   // Page faults the helpers took doing it
+  bool shutdown;
+};
+
+int makesub_threads = 1;  // Threads (including makesub itself) to copy the voltage blocks with
+bool free_files_zeroed = false;  // -z: .free files come back from downstream zero filled
+
+// Work out where every line of blocks 1 to BLOCKS_PER_SUB comes from.  Lines are in sub file order, so block major.
+static inline __attribute__((always_inline)) void build_gather_plan(gather_line_t *plan, const subobs_udp_meta_t *subm, const MandC_meta_t *MandC, int ninputs,
+                                                                    const bool oversampled) {
+  for (int MandC_rf = 0; MandC_rf < ninputs; MandC_rf++) {
+    const uint32_t *packets = MandC[MandC_rf].seen_order ? subm->udp_volts[MandC[MandC_rf].seen_order] : NULL;
+    int start_byte          = MandC[MandC_rf].start_byte;
+    for (int block = 0; block < BLOCKS_PER_SUB; block++, start_byte += SUB_LINE_SIZE_AT(oversampled))
+      plan[block * ninputs + MandC_rf] = (gather_line_t){packets, start_byte / UDP_PAYLOAD_SIZE, start_byte % UDP_PAYLOAD_SIZE};
+  }
+}
+
+// Zero fill (or with skip_zeroes just step over) 'n' bytes of missing data.
+static inline char *gather_zeroes(char *dest, size_t n, bool skip_zeroes) { return skip_zeroes ? dest + n : zero_kernel(dest, n); }
+
+// Copy 'npackets' whole packets, with each run of missing ones as a single zero fill.
+static inline __attribute__((always_inline)) char *gather_whole_packets(char *dest, const mwa_udp_packet_t *ring, const uint32_t *packets, int npackets,
+                                                                       bool skip_zeroes) {
+  for (int loop = 0; loop < npackets;) {
+    if (packets[loop] == NO_PACKET) {
+      int run = loop + 1;
+      while (run < npackets && packets[run] == NO_PACKET) run++;
+      dest = gather_zeroes(dest, (size_t)(run - loop) * UDP_PAYLOAD_SIZE, skip_zeroes);
+      loop = run;
+    } else {
+      dest = copy_kernel(dest, packet_payload(ring, packets[loop++]), UDP_PAYLOAD_SIZE);
+    }
+  }
+  return dest;
+}
+
+// Copy one line of the sub file as the plan says.
+static inline __attribute__((always_inline)) char *gather_line(char *dest, const gather_line_t *line, const mwa_udp_packet_t *ring, bool skip_zeroes,
+                                                               const bool oversampled) {
+  const uint32_t *packets = line->packets;
+  if (packets == NULL) return gather_zeroes(dest, SUB_LINE_SIZE_AT(oversampled), skip_zeroes);  // An input we never saw
+
+  if (SUB_LINE_SIZE_AT(oversampled) % UDP_PAYLOAD_SIZE == 0 && line->offset == 0)  // Whole packets only.  Never true at the legacy rate
+    return gather_whole_packets(dest, ring, packets + line->packet, SUB_LINE_SIZE_AT(oversampled) / UDP_PAYLOAD_SIZE, skip_zeroes);
+
+  int packet         = line->packet;
+  int offset         = line->offset;  // Only the head starts part way into a packet
+  int left_this_line = SUB_LINE_SIZE_AT(oversampled);
+
+  while (left_this_line > 0) {
+    int bytes2copy = (UDP_PAYLOAD_SIZE - offset < left_this_line) ? UDP_PAYLOAD_SIZE - offset : left_this_line;
+    if (packets[packet] == NO_PACKET) {  // Never arrived.  Take in the whole run of missing packets (as much of it as this line needs) in one go
+      while (bytes2copy < left_this_line && packets[packet + 1] == NO_PACKET) {
+        packet++;
+        bytes2copy = (bytes2copy + UDP_PAYLOAD_SIZE < left_this_line) ? bytes2copy + UDP_PAYLOAD_SIZE : left_this_line;
+      }
+      dest = gather_zeroes(dest, bytes2copy, skip_zeroes);
+    } else {
+      dest = copy_kernel(dest, packet_payload(ring, packets[packet]) + offset, bytes2copy);
+    }
+    left_this_line -= bytes2copy;
+    packet++;
+    offset = 0;
+  }
+  return dest;
+}
+
+static inline __attribute__((always_inline)) void write_volt_blocks(copy_job_t *job, const bool oversampled) {
+  const gather_line_t *line = job->plan + (size_t)(job->first_block - 1) * job->ninputs;
+  const gather_line_t *end  = job->plan + (size_t)(job->last_block - 1) * job->ninputs;
+  char *dest                = job->block1_add + (size_t)(job->first_block - 1) * job->ninputs * SUB_LINE_SIZE_AT(oversampled);
 
-void *makesub() {
-  printf("Makesub started\n");
+  for (; line < end; line++) dest = gather_line(dest, line, job->ring, job->skip_zeroes, oversampled);
+  copy_fence();
+}
+
+void build_gather_plan_legacy(gather_line_t *plan, const subobs_udp_meta_t *subm, const MandC_meta_t *MandC, int ninputs) {
+  build_gather_plan(plan, subm, MandC, ninputs, false);
+}
+void build_gather_plan_oversampled(gather_line_t *plan, const subobs_udp_meta_t *subm, const MandC_meta_t *MandC, int ninputs) {
+  build_gather_plan(plan, subm, MandC, ninputs, true);
+}
+void build_gather_plan_generic(gather_line_t *plan, const subobs_udp_meta_t *subm, const MandC_meta_t *MandC, int ninputs) {
+  build_gather_plan(plan, subm, MandC, ninputs, conf.oversampling);
+}
+void write_volt_blocks_legacy(copy_job_t *job) { write_volt_blocks(job, false); }
+void write_volt_blocks_oversampled(copy_job_t *job) { write_volt_blocks(job, true); }
+void write_volt_blocks_generic(copy_job_t *job) { write_volt_blocks(job, conf.oversampling); }
+
+void *copy_pool_helper(void *arg) {
+  copy_pool_t *pool = ((copy_helper_t *)arg)->pool;
+  int index         = ((copy_helper_t *)arg)->index;
+  uint64_t seen     = 0;
+
+  set_cpu_affinity(&conf.place_makesub, "copy");  // Same cpus as makesub, so the same memory node as the sub files it's writing
+
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    while (!pool->shutdown && pool->generation == seen) pthread_cond_wait(&pool->go, &pool->lock);
+    if (pool->shutdown) break;
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    int64_t faults = minor_faults();
+    rate_kernels->write(&pool->jobs[index]);
+    faults = minor_faults() - faults;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->faults += faults;
+    if (--pool->running == 0) pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+void copy_pool_init(copy_pool_t *pool, int nthreads) {
+  pool->nthreads   = nthreads;
+  pool->threads    = calloc_or_die(nthreads, sizeof(pthread_t), "copy pool threads");
+  pool->helpers    = calloc_or_die(nthreads, sizeof(copy_helper_t), "copy pool helpers");
+  pool->jobs       = calloc_or_die(nthreads, sizeof(copy_job_t), "copy pool jobs");
+  pool->plan       = calloc_or_die((size_t)BLOCKS_PER_SUB * max_inputs, sizeof(gather_line_t), "copy pool gather plan");
+  pool->plan_ninputs = 0;
+  pool->generation = 0;
+  pool->running    = 0;
+  pool->shutdown   = false;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->go, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  for (int loop = 1; loop < nthreads; loop++) {  // Thread 0 is whoever calls copy_pool_run()
+    pool->helpers[loop] = (copy_helper_t){pool, loop};
+    if (pthread_create(&pool->threads[loop], NULL, copy_pool_helper, &pool->helpers[loop]) != 0) {
+      printf("Failed to start makesub copy thread %d\n", loop);
+      fflush(stdout);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+void copy_pool_destroy(copy_pool_t *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = true;
+  pthread_cond_broadcast(&pool->go);
+  pthread_mutex_unlock(&pool->lock);
+  for (int loop = 1; loop < pool->nthreads; loop++) pthread_join(pool->threads[loop], NULL);
+  free(pool->threads);
+  free(pool->helpers);
+  free(pool->jobs);
+  free(pool->plan);
+}
+
+// Is the pool's gather plan already the one for this subobs?  Block 1's line for each input says which row of udp_volts it came from and its start
+// byte, and with the sample rate that's everything the rest of the plan follows from.
+bool gather_plan_current(const copy_pool_t *pool, const subobs_udp_meta_t *subm, const MandC_meta_t *MandC, int ninputs) {
+  if (pool->plan_ninputs != ninputs || pool->plan_oversampled != conf.oversampling) return false;
+  for (int MandC_rf = 0; MandC_rf < ninputs; MandC_rf++) {
+    const gather_line_t *line = &pool->plan[MandC_rf];
+    if (line->packets != (MandC[MandC_rf].seen_order ? subm->udp_volts[MandC[MandC_rf].seen_order] : NULL) ||
+        line->packet * UDP_PAYLOAD_SIZE + line->offset != MandC[MandC_rf].start_byte)
+      return false;
+  }
+  return true;
+}
+
+// Write blocks 1 to BLOCKS_PER_SUB using every thread in the pool.  Returns once all the threads are finished, with the page faults they took.
+int64_t copy_pool_run(copy_pool_t *pool, const subobs_udp_meta_t *subm, const MandC_meta_t *MandC, int ninputs, char *block1_add) {
+  if (!gather_plan_current(pool, subm, MandC, ninputs)) {
+    rate_kernels->plan(pool->plan, subm, MandC, ninputs);
+    pool->plan_ninputs     = ninputs;
+    pool->plan_oversampled = conf.oversampling;
+  }
+  for (int loop = 0; loop < pool->nthreads; loop++) {
+    pool->jobs[loop] = (copy_job_t){.plan        = pool->plan,
+                                    .ring        = subm->ring,
+                                    .ninputs     = ninputs,
+                                    .block1_add  = block1_add,
+                                    .first_block = 1 + (int)(BLOCKS_PER_SUB * loop / pool->nthreads),
+                                    .last_block  = 1 + (int)(BLOCKS_PER_SUB * (loop + 1) / pool->nthreads),
+                                    .skip_zeroes = free_files_zeroed};
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->running = pool->nthreads - 1;
+  pool->faults  = 0;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->go);
+  pthread_mutex_unlock(&pool->lock);
+
+  int64_t faults = minor_faults();
+  rate_kernels->write(&pool->jobs[0]);  // Our share
+  faults = minor_faults() - faults;
+
+  pthread_mutex_lock(&pool->lock);  // Completion barrier.  Nothing may touch the sub file after this returns.
+  while (pool->running > 0) pthread_cond_wait(&pool->done, &pool->lock);
+  faults += pool->faults;
+  pthread_mutex_unlock(&pool->lock);
+  return faults;
+}
+
+// How many dummy packets a sub file needed, from its PACKET_MAP (a 1 bit per packet that arrived)
+int64_t packet_map_dummies(const uint8_t *packet_map, int ninputs, uint32_t stride) {
+  int64_t arrived = 0;
+  for (size_t loop = 0; loop < (size_t)ninputs * stride; loop++) arrived += __builtin_popcount(packet_map[loop]);
+  return (int64_t)ninputs * (UDP_PER_RF_PER_SUB - 2) - arrived;
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+// Free file allocator - which .free files are in shared_mem_dir, kept up to date by inotify instead of a readdir and stat of everything per sub.
+//
+// Files are bucketed by size, and each bucket is a min-heap on ctime, so the oldest file big enough for a sub is at the top of one of a handful of
+// heaps.  Entries are also chained by name in a small hash table, for the inotify events.  We are told about files arriving (created, finished
+// being written, renamed to .free by downstream) and leaving (renamed or deleted), and rescan the directory if inotify's queue overflows.  If
+// inotify isn't available we rescan before every pick, which is what we always used to do.  The free and bad counts go into the monitor packet
+// every time makesub polls, not just when a sub is written.
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+
+typedef struct free_entry {
+  char name[256];                   // Name in shared_mem_dir
+  struct stat st;                   // As of when we were last told about it
+  int bucket;                       // Which size bucket's heap it's in
+  int heap_index;                   // and where in it
+  struct free_entry *next_by_name;  // Next in its free_alloc.by_name chain
+} free_entry_t;
+
+#define FREE_NAME_CHAINS 1024  // For free_alloc.by_name.  There are a few hundred .free files at most
+
+typedef struct free_bucket {
+  off_t size;
+  int count;
+  int capacity;
+  free_entry_t **heap;  // Min-heap on st_ctim
+} free_bucket_t;
+
+struct {
+  int inotify_fd;  // -1 if we're not watching
+  int nbuckets;
+  free_bucket_t *buckets;
+  size_t wanted;                            // Size of the last sub file we asked for, for counting good and bad files
+  free_entry_t *by_name[FREE_NAME_CHAINS];  // Every entry, chained by the hash of its name
+} free_alloc = {.inotify_fd = -1};
+
+free_entry_t **free_name_chain(const char *name) {
+  uint32_t hash = 2166136261u;  // FNV-1a
+  while (*name) hash = (hash ^ (uint8_t)*name++) * 16777619u;
+  return &free_alloc.by_name[hash % FREE_NAME_CHAINS];
+}
+
+bool is_free_file_name(const char *name) {
+  size_t len = strlen(name);
+  return name[0] != '.' && len >= 5 && strcmp(&name[len - 5], ".free") == 0;
+}
+
+bool ctime_before(const free_entry_t *a, const free_entry_t *b) {
+  return a->st.st_ctim.tv_sec < b->st.st_ctim.tv_sec || (a->st.st_ctim.tv_sec == b->st.st_ctim.tv_sec && a->st.st_ctim.tv_nsec < b->st.st_ctim.tv_nsec);
+}
+
+void free_heap_set(free_bucket_t *b, int index, free_entry_t *e) {
+  b->heap[index] = e;
+  e->heap_index  = index;
+}
+
+void free_heap_sift(free_bucket_t *b, int index) {
+  free_entry_t *e = b->heap[index];
+  while (index > 0 && ctime_before(e, b->heap[(index - 1) / 2])) {  // Up
+    free_heap_set(b, index, b->heap[(index - 1) / 2]);
+    index = (index - 1) / 2;
+  }
+  while (true) {  // Down
+    int child = 2 * index + 1;
+    if (child >= b->count) break;
+    if (child + 1 < b->count && ctime_before(b->heap[child + 1], b->heap[child])) child++;
+    if (!ctime_before(b->heap[child], e)) break;
+    free_heap_set(b, index, b->heap[child]);
+    index = child;
+  }
+  free_heap_set(b, index, e);
+}
+
+// Take an entry out of its heap and name chain.  The caller owns it afterwards.
+free_entry_t *free_alloc_unlink(free_entry_t *e) {
+  free_bucket_t *b = &free_alloc.buckets[e->bucket];
+  int index        = e->heap_index;
+  if (--b->count > index) {
+    free_heap_set(b, index, b->heap[b->count]);
+    free_heap_sift(b, index);
+  }
+  free_entry_t **link = free_name_chain(e->name);
+  while (*link != e) link = &(*link)->next_by_name;
+  *link = e->next_by_name;
+  return e;
+}
+
+free_entry_t *free_alloc_lookup(const char *name) {
+  for (free_entry_t *e = *free_name_chain(name); e != NULL; e = e->next_by_name)
+    if (strcmp(e->name, name) == 0) return e;
+  return NULL;
+}
+
+void free_alloc_remove(const char *name) {
+  free_entry_t *e = free_alloc_lookup(name);
+  if (e != NULL) free(free_alloc_unlink(e));
+}
+
+// Add (or refresh) the .free file 'name', if it's still there
+void free_alloc_update(const char *name) {
+  char path[300];
+  struct stat st;
+  free_alloc_remove(name);
+  snprintf(path, sizeof(path), "%s/%s", conf.shared_mem_dir, name);
+  if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) return;
+
+  int bucket = 0;
+  while (bucket < free_alloc.nbuckets && free_alloc.buckets[bucket].size != st.st_size) bucket++;
+  if (bucket == free_alloc.nbuckets) {
+    free_alloc.buckets                        = realloc_or_die(free_alloc.buckets, (free_alloc.nbuckets + 1) * sizeof(free_bucket_t), "free file buckets");
+    free_alloc.buckets[free_alloc.nbuckets++] = (free_bucket_t){.size = st.st_size};
+  }
+  free_bucket_t *b = &free_alloc.buckets[bucket];
+  if (b->count == b->capacity) {
+    b->capacity = b->capacity ? 2 * b->capacity : 16;
+    b->heap     = realloc_or_die(b->heap, b->capacity * sizeof(free_entry_t *), "free file heap");
+  }
+
+  free_entry_t *e = calloc_or_die(1, sizeof(free_entry_t), "free file entry");
+  snprintf(e->name, sizeof(e->name), "%s", name);
+  e->st     = st;
+  e->bucket = bucket;
+  free_heap_set(b, b->count++, e);
+  free_heap_sift(b, e->heap_index);
+  free_entry_t **chain = free_name_chain(name);
+  e->next_by_name      = *chain;
+  *chain               = e;
+}
+
+void free_alloc_clear() {
+  for (int bucket = 0; bucket < free_alloc.nbuckets; bucket++) {
+    while (free_alloc.buckets[bucket].count > 0) free(free_alloc_unlink(free_alloc.buckets[bucket].heap[0]));
+  }
+}
+
+// Forget everything and read the directory again.  Returns false if it's not there.
+bool free_alloc_rescan() {
+  DIR *dir = opendir(conf.shared_mem_dir);
+  if (dir == NULL) return false;
+  free_alloc_clear();
+  struct dirent *dp;
+  while ((dp = readdir(dir)) != NULL)
+    if (dp->d_type == DT_REG && is_free_file_name(dp->d_name)) free_alloc_update(dp->d_name);
+  closedir(dir);
+  return true;
+}
+
+// Count the files big enough for 'wanted' bytes, and the ones that aren't
+void free_alloc_count(size_t wanted, int *good, int *bad) {
+  *good = *bad = 0;
+  for (int bucket = 0; bucket < free_alloc.nbuckets; bucket++) *((size_t)free_alloc.buckets[bucket].size >= wanted ? good : bad) += free_alloc.buckets[bucket].count;
+}
+
+// Catch up with whatever's happened in the directory since last time, and update the monitor's counts
+void free_alloc_poll() {
+  if (free_alloc.inotify_fd == -1) {
+    free_alloc_rescan();
+  } else {
+    char events[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(free_alloc.inotify_fd, events, sizeof(events))) > 0) {
+      for (char *ptr = events; ptr < events + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event *)ptr)->len) {
+        const struct inotify_event *event = (const struct inotify_event *)ptr;
+        if (event->mask & IN_Q_OVERFLOW) {
+          report_substatus("makesub", "free files: inotify queue overflowed, rescanning %s", conf.shared_mem_dir);
+          free_alloc_rescan();
+        } else if (event->len > 0 && is_free_file_name(event->name)) {
+          if (event->mask & (IN_MOVED_FROM | IN_DELETE)) {
+            free_alloc_remove(event->name);
+          } else {
+            free_alloc_update(event->name);
+          }
+        }
+      }
+    }
+  }
+
+  int good, bad;
+  free_alloc_count(free_alloc.wanted, &good, &bad);
+  monitor.free_files     = good;
+  monitor.bad_free_files = bad;
+}
+
+// Start watching shared_mem_dir.  Returns false if it doesn't exist.
+bool free_alloc_init() {
+  free_alloc.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (free_alloc.inotify_fd != -1 &&
+      inotify_add_watch(free_alloc.inotify_fd, conf.shared_mem_dir, IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) == -1) {
+    close(free_alloc.inotify_fd);
+    free_alloc.inotify_fd = -1;
+  }
+  if (free_alloc.inotify_fd == -1) report_substatus("makesub", "free files: can't watch %s, will rescan it for every sub", conf.shared_mem_dir);
+  return free_alloc_rescan();
+}
+
+// Take the oldest (by ctime) .free file that's at least 'wanted' bytes.  Its full name goes in 'path' and its stats in 'st'.  Returns false if there
+// isn't one.
+bool free_alloc_take(size_t wanted, char *path, size_t path_size, struct stat *st) {
+  free_alloc.wanted = wanted;
+  free_alloc_poll();
+  while (true) {
+    free_entry_t *best = NULL;
+    for (int bucket = 0; bucket < free_alloc.nbuckets; bucket++) {
+      free_bucket_t *b = &free_alloc.buckets[bucket];
+      if ((size_t)b->size >= wanted && b->count > 0 && (best == NULL || ctime_before(b->heap[0], best))) best = b->heap[0];
+    }
+    if (best == NULL) return false;
+
+    free_alloc_unlink(best);
+    snprintf(path, path_size, "%s/%s", conf.shared_mem_dir, best->name);
+    bool there = (stat(path, st) == 0 && (size_t)st->st_size >= wanted);  // It might have gone since we heard about it.  If so, try the next one.
+    free(best);
+    if (there) return true;
+  }
+}
+
+// Give back a file free_alloc_take() gave us that we couldn't use after all (say renaming it failed), if it's still there
+void free_alloc_return(const char *path) {
+  const char *name = strrchr(path, '/');
+  free_alloc_update(name ? name + 1 : path);
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+// Free file pool - .free files kept mapped between uses (-p <files>), so the copy into a sub file doesn't start with a page fault for every 4K.
+//
+// A mapping belongs to the file's inode, not its name, so it survives us renaming the file to a .sub and downstream renaming it back to a .free
+// when it's done.  When makesub picks a .free file it takes the pool's mapping for it if there is one.  While makesub is idle, free_pool_fill()
+// maps (and populates, asking for transparent huge pages first) one more of the allocator's .free files at a time, up to the pool size.  Each of those keeps its fd,
+// so a file that's been deleted (st_nlink 0) or resized is noticed and let go.  0 (the default) maps and unmaps every sub file as before.
+// Everything here is under free_lock, except that populating lets go of it: a new entry is reserved first (pending, with no addr) so nobody else
+// maps the same file, and filled in afterwards, and one being populated is marked busy so it isn't unmapped.  On a pool miss, makesub maps the
+// file into the pool without populating it, as that's on the sub's critical path.  free_pool_fill() populates it later.
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+
+typedef struct free_map {
+  dev_t dev;  // Which file this is a mapping of
+  ino_t ino;
+  int fd;       // Held open so we can tell if it's been deleted.  -1 while free_pool_add() is still mapping it
+  char *addr;      // The whole file, mapped shared.  NULL while free_pool_add() is still mapping it
+  size_t size;     // st_size when we mapped it
+  bool populated;  // Faulted in.  A mapping made on a pool miss isn't, until free_pool_fill() gets to it
+  bool busy;       // Being populated without free_lock, so it mustn't be unmapped
+} free_map_t;
+
+int free_pool_files = 0;  // -p: How many .free files to keep mapped
+int free_pool_count = 0;
+free_map_t *free_pool;
+pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;  // For free_alloc and free_pool
+
+void free_pool_unmap(int index) {
+  munmap(free_pool[index].addr, free_pool[index].size);
+  close(free_pool[index].fd);
+  free_pool[index] = free_pool[--free_pool_count];
+}
+
+// Let go of any mapping whose file has been deleted or changed size since we mapped it
+void free_pool_prune() {
+  struct stat st;
+  for (int loop = free_pool_count - 1; loop >= 0; loop--) {
+    if (free_pool[loop].addr == NULL || free_pool[loop].busy) continue;  // Still being mapped or populated
+    if (fstat(free_pool[loop].fd, &st) != 0 || st.st_nlink == 0 || (size_t)st.st_size != free_pool[loop].size) {
+      report_substatus("makesub", "free pool: letting go of inode %lu", (unsigned long)free_pool[loop].ino);
+      free_pool_unmap(loop);
+    }
+  }
+}
+
+// The pool's entry for this file, including one that's still being mapped (addr NULL), or NULL if there isn't one
+free_map_t *free_pool_find(const struct stat *st) {
+  for (int loop = 0; loop < free_pool_count; loop++)
+    if (free_pool[loop].dev == st->st_dev && free_pool[loop].ino == st->st_ino) return &free_pool[loop];
+  return NULL;
+}
+
+// The pool's mapping of this file, if it has one ready to use
+free_map_t *free_pool_mapped(const struct stat *st) {
+  free_map_t *entry = free_pool_find(st);
+  return (entry != NULL && entry->addr != NULL) ? entry : NULL;
+}
+
+// Fault in a pool mapping, asking for transparent huge pages first
+bool free_pool_populate(char *addr, size_t size) {
+  bool huge = (madvise(addr, size, MADV_HUGEPAGE) == 0);  // Only takes effect if shmem_enabled allows it.  On hugetlbfs they're huge anyway.
+#ifdef MADV_POPULATE_WRITE
+  madvise(addr, size, MADV_POPULATE_WRITE);  // After MADV_HUGEPAGE, so it can populate with huge pages.  On older kernels it just faults later.
+#endif
+  return huge;
+}
+
+// Map the file at 'path' (whose stat is 'st') into the pool, and fault it all in if 'populate'.  Returns NULL if the pool is full or it can't be
+// mapped.  Called with free_lock held, which is released while the file is mapped and populated (seconds, for a big one) so other writers can get
+// .free files.  Without 'populate' it's just an mmap, so the lock is kept.
+free_map_t *free_pool_add(const char *path, const struct stat *st, bool populate) {
+  if (free_pool_count >= free_pool_files || free_pool_find(st) != NULL) return NULL;
+
+  int fd = open(path, O_RDWR);
+  if (fd == -1) return NULL;
+  free_pool[free_pool_count++] = (free_map_t){st->st_dev, st->st_ino, -1, NULL, st->st_size, false, false};  // Reserved, so nobody else maps it meanwhile
+  if (populate) pthread_mutex_unlock(&free_lock);
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  int flags = MAP_SHARED;
+#ifndef MADV_POPULATE_WRITE
+  if (populate) flags |= MAP_POPULATE;
+#endif
+  char *addr = mmap(NULL, st->st_size, PROT_READ | PROT_WRITE, flags, fd, 0);
+  bool huge  = false;
+  if (addr != MAP_FAILED) huge = populate ? free_pool_populate(addr, st->st_size) : (madvise(addr, st->st_size, MADV_HUGEPAGE) == 0);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  if (populate) pthread_mutex_lock(&free_lock);
+  free_map_t *entry = free_pool_find(st);  // Our reservation, wherever an unmap has moved it to meanwhile
+  if (addr == MAP_FAILED) {
+    *entry = free_pool[--free_pool_count];
+    close(fd);
+    return NULL;
+  }
+  entry->fd        = fd;
+  entry->addr      = addr;
+  entry->populated = populate;
+  report_substatus("makesub", "free pool: mapped %s (%lu MB%s%s) in %.0f ms, %d of %d", path, st->st_size >> 20, huge ? ", huge pages advised" : "",
+                   populate ? "" : ", not populated yet", elapsed_usec(&t0, &t1) / 1000.0, free_pool_count, free_pool_files);
+  return entry;
+}
+
+// Populate one mapping that was made without, or else map one more .free file if there's room.  Called by makesub while it's waiting for something
+// to do, with free_lock held.
+void free_pool_fill() {
+  free_pool_prune();
+
+  for (int loop = 0; loop < free_pool_count; loop++) {
+    free_map_t *entry = &free_pool[loop];
+    if (entry->addr == NULL || entry->populated || entry->busy) continue;
+    struct stat st = {.st_dev = entry->dev, .st_ino = entry->ino};
+    char *addr     = entry->addr;
+    size_t size    = entry->size;
+    entry->busy    = true;
+    pthread_mutex_unlock(&free_lock);
+    free_pool_populate(addr, size);
+    pthread_mutex_lock(&free_lock);
+    entry            = free_pool_find(&st);  // Busy, so it's still there, but it may have moved
+    entry->busy      = false;
+    entry->populated = true;
+    report_substatus("makesub", "free pool: populated inode %lu", (unsigned long)entry->ino);
+    return;  // One at a time, so we're never away for long
+  }
+
+  if (free_pool_count >= free_pool_files) return;
+  for (int bucket = 0; bucket < free_alloc.nbuckets; bucket++) {
+    for (int loop = 0; loop < free_alloc.buckets[bucket].count; loop++) {
+      free_entry_t *e = free_alloc.buckets[bucket].heap[loop];
+      if (free_pool_find(&e->st) == NULL) {
+        char path[300];
+        struct stat st = e->st;  // The entry may be gone by the time free_pool_add() has the lock back
+        snprintf(path, sizeof(path), "%s/%s", conf.shared_mem_dir, e->name);
+        free_pool_add(path, &st, true);
+        return;  // One at a time, so we're never away for long
+      }
+    }
+  }
+}
+
+void free_pool_destroy() {
+  while (free_pool_count > 0) free_pool_unmap(free_pool_count - 1);
+  free(free_pool);
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+// Next sub file - with -a, makesub picks the .free file for the next sub while it's idle, renames it out of the way (<temp_file_name>.next) and maps
+// it.  A SCHED_IDLE thread then faults every page of it in (MADV_POPULATE_WRITE, or touching each page with an atomic add of 0 on older kernels) so
+// the voltage copy runs against resident pages instead of taking a minor fault per 4K.  The size asked for is the last sub's.  If the next one needs
+// more, or anything goes wrong, the file is renamed back and makesub picks one the usual way.  A file from the free pool is already resident, so
+// that just gets renamed.  "-b prefault" shows the faults and copy time with and without.
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+
+#define PREFAULT_CHUNK (64LL << 20)  // Prefault this much at a time, so a cancel doesn't wait long
+
+// Fault in every page of [addr, addr+size) for writing, stopping early if *cancel is set.  Returns the bytes done.
+size_t prefault_range(char *addr, size_t size, atomic_bool *cancel) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t done = 0;
+  while (done < size && !atomic_load(cancel)) {
+    size_t len = (size - done < PREFAULT_CHUNK) ? size - done : PREFAULT_CHUNK;
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(addr + done, len, MADV_POPULATE_WRITE) != 0)
+#endif
+      for (size_t offset = 0; offset < len; offset += page) __atomic_fetch_add(addr + done + offset, 0, __ATOMIC_RELAXED);  // Safe even if someone's writing it
+    done += len;
+  }
+  return done;
+}
+
+// Page faults taken by the calling thread.  Not RUSAGE_SELF, which would count everyone else's (UDP_parse's, the copy pool's) as well.
+int64_t minor_faults() {
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return usage.ru_minflt;
+}
+
+struct {
+  bool enabled;  // -a
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;  // For the prefault thread, when there's something to do or it's finished
+  bool ready;           // We're holding a .free file, renamed to 'name' and mapped at 'addr'
+  char free_name[300];  // What it was called, so it can be put back
+  char name[300];
+  struct stat st;
+  char *addr;
+  free_map_t *pooled;  // The free pool's mapping, if it was in the pool
+  bool populate;       // Prefault thread: please prefault addr
+  bool populating;
+  atomic_bool cancel;
+  bool shutdown;
+  int64_t faults;  // From the last prefault
+  double usec;
+  size_t done;
+} next_sub = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+
+void *next_sub_prefault_thread() {
+  struct sched_param param = {0};
+  set_cpu_affinity(&conf.place_makesub, "prefault");
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);  // Only ever use otherwise idle cpu time, even if makesub is SCHED_FIFO
+
+  pthread_mutex_lock(&next_sub.lock);
+  while (true) {
+    while (!next_sub.shutdown && !next_sub.populate) pthread_cond_wait(&next_sub.wake, &next_sub.lock);
+    if (next_sub.shutdown) break;
+    next_sub.populate   = false;
+    next_sub.populating = true;
+    pthread_mutex_unlock(&next_sub.lock);
+
+    struct timespec t0, t1;
+    int64_t faults = minor_faults();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    size_t done = prefault_range(next_sub.addr, next_sub.st.st_size, &next_sub.cancel);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    pthread_mutex_lock(&next_sub.lock);
+    next_sub.faults     = minor_faults() - faults;
+    next_sub.usec       = elapsed_usec(&t0, &t1);
+    next_sub.done       = done;
+    next_sub.populating = false;
+    pthread_cond_broadcast(&next_sub.wake);
+  }
+  pthread_mutex_unlock(&next_sub.lock);
+  return NULL;
+}
+
+void next_sub_init() {
+  if (!next_sub.enabled) return;
+  snprintf(next_sub.name, sizeof(next_sub.name), "%s.next", conf.temp_file_name);
+  if (pthread_create(&next_sub.thread, NULL, next_sub_prefault_thread, NULL) != 0) {
+    printf("Failed to start the prefault thread.  Not preparing sub files ahead\n");
+    fflush(stdout);
+    next_sub.enabled = false;
+  }
+}
+
+// Stop any prefault that's under way and wait for the thread to let go
+void next_sub_stop_prefault() {
+  pthread_mutex_lock(&next_sub.lock);
+  atomic_store(&next_sub.cancel, true);
+  next_sub.populate = false;
+  while (next_sub.populating) pthread_cond_wait(&next_sub.wake, &next_sub.lock);
+  atomic_store(&next_sub.cancel, false);
+  pthread_mutex_unlock(&next_sub.lock);
+}
+
+// Give back the file we're holding, under its old name
+void next_sub_release() {
+  if (!next_sub.ready) return;
+  next_sub_stop_prefault();
+  if (next_sub.pooled == NULL) munmap(next_sub.addr, next_sub.st.st_size);
+  rename(next_sub.name, next_sub.free_name);
+  next_sub.ready = false;
+}
+
+// While idle, get a file of at least 'wanted' bytes ready for the next sub
+void next_sub_prepare(size_t wanted) {
+  if (!next_sub.enabled || next_sub.ready || wanted == 0) return;
+  if (!free_alloc_take(wanted, next_sub.free_name, sizeof(next_sub.free_name), &next_sub.st)) return;
+  if (rename(next_sub.free_name, next_sub.name) != 0) {
+    free_alloc_return(next_sub.free_name);
+    return;
+  }
+
+  next_sub.pooled = NULL;
+  if (free_pool_files > 0) {
+    free_pool_prune();
+    next_sub.pooled = free_pool_mapped(&next_sub.st);
+  }
+  if (next_sub.pooled != NULL) {
+    next_sub.addr  = next_sub.pooled->addr;
+    next_sub.ready = true;
+    return;
+  }
+
+  int fd = open(next_sub.name, O_RDWR);
+  next_sub.addr = (fd == -1) ? MAP_FAILED : mmap(NULL, next_sub.st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (fd != -1) close(fd);
+  if (next_sub.addr == MAP_FAILED) {
+    rename(next_sub.name, next_sub.free_name);
+    return;
+  }
+  madvise(next_sub.addr, next_sub.st.st_size, MADV_HUGEPAGE);
+  next_sub.ready = true;
+
+  pthread_mutex_lock(&next_sub.lock);
+  next_sub.populate = true;
+  pthread_cond_broadcast(&next_sub.wake);
+  pthread_mutex_unlock(&next_sub.lock);
+}
+
+// Hand over the prepared file for a sub of 'wanted' bytes, renamed to temp_file_name.  Returns false (and puts it back) if there isn't one or it's
+// too small.
+bool next_sub_claim(size_t wanted, char **addr, size_t *mapped_size, free_map_t **pooled) {
+  if (!next_sub.ready) return false;
+  if ((size_t)next_sub.st.st_size < wanted || rename(next_sub.name, conf.temp_file_name) != 0) {
+    next_sub_release();
+    return false;
+  }
+  next_sub_stop_prefault();
+  if (next_sub.pooled == NULL)
+    report_substatus("makesub", "next sub: prefaulted %lu of %lu MB in %.0f ms (%ld faults)", next_sub.done >> 20, next_sub.st.st_size >> 20, next_sub.usec / 1000.0,
+                     next_sub.faults);
+  *addr          = next_sub.addr;
+  *mapped_size   = next_sub.st.st_size;
+  *pooled        = next_sub.pooled;
+  next_sub.ready = false;
+  return true;
+}
+
+void next_sub_destroy() {
+  if (!next_sub.enabled) return;
+  next_sub_release();
+  pthread_mutex_lock(&next_sub.lock);
+  next_sub.shutdown = true;
+  pthread_cond_broadcast(&next_sub.wake);
+  pthread_mutex_unlock(&next_sub.lock);
+  pthread_join(next_sub.thread, NULL);
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+// Reclaimer - tearing down a 5GB mapping (page tables plus a TLB shootdown to every cpu that ran a copy thread) takes tens of ms.  Nobody needs to
+// wait for that, so once a sub has been fenced and renamed makesub just queues the unmap here and gets on with the next slot.  If the queue is
+// full (or the thread never started) the unmap is done on the spot, as before.  "-b unmap" shows what makesub saves.
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+
+#define RECLAIM_QUEUE 8  // Way more than we should ever have outstanding
+
+struct {
+  bool running;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  struct {
+    void *addr;
+    size_t size;
+  } queue[RECLAIM_QUEUE];
+  int head;  // Next to unmap
+  int count;
+  bool shutdown;
+  double usec;  // Time spent unmapping the last one
+} reclaim = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+
+void *reclaim_thread() {
+  struct sched_param param = {0};
+  set_cpu_affinity(&conf.place_makesub, "reclaim");
+  pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);  // Unmapping can wait, so don't let it hold up a SCHED_FIFO makesub
+
+  pthread_mutex_lock(&reclaim.lock);
+  while (true) {
+    while (!reclaim.shutdown && reclaim.count == 0) pthread_cond_wait(&reclaim.wake, &reclaim.lock);
+    if (reclaim.count == 0) break;  // Only leave once the queue's drained
+    void *addr  = reclaim.queue[reclaim.head].addr;
+    size_t size = reclaim.queue[reclaim.head].size;
+    pthread_mutex_unlock(&reclaim.lock);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    munmap(addr, size);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    pthread_mutex_lock(&reclaim.lock);
+    reclaim.head = (reclaim.head + 1) % RECLAIM_QUEUE;
+    reclaim.count--;
+    reclaim.usec = elapsed_usec(&t0, &t1);
+  }
+  pthread_mutex_unlock(&reclaim.lock);
+  return NULL;
+}
+
+void reclaim_init() {
+  reclaim.running = (pthread_create(&reclaim.thread, NULL, reclaim_thread, NULL) == 0);
+  if (!reclaim.running) {
+    printf("Failed to start the reclaimer thread.  Unmapping sub files in makesub\n");
+    fflush(stdout);
+  }
+}
+
+// Unmap [addr, addr+size) in the background.  Returns the ms the last background unmap took, or -1 if this one had to be done here and now.
+double reclaim_unmap(void *addr, size_t size) {
+  pthread_mutex_lock(&reclaim.lock);
+  bool queued = reclaim.running && reclaim.count < RECLAIM_QUEUE;
+  if (queued) {
+    reclaim.queue[(reclaim.head + reclaim.count) % RECLAIM_QUEUE].addr = addr;
+    reclaim.queue[(reclaim.head + reclaim.count) % RECLAIM_QUEUE].size = size;
+    reclaim.count++;
+  }
+  double last_ms = reclaim.usec / 1000.0;
+  pthread_mutex_unlock(&reclaim.lock);
+
+  if (queued) pthread_cond_signal(&reclaim.wake);  // After unlocking, so it doesn't wake straight into our lock
+  if (!queued) munmap(addr, size);
+  return queued ? last_ms : -1;
+}
+
+void reclaim_destroy() {
+  if (!reclaim.running) return;
+  pthread_mutex_lock(&reclaim.lock);
+  reclaim.shutdown = true;
+  pthread_cond_signal(&reclaim.wake);
+  pthread_mutex_unlock(&reclaim.lock);
+  pthread_join(reclaim.thread, NULL);
+  reclaim.running = false;
+}
+
+void build_subfile_header(char *header, const subobs_udp_meta_t *subm, size_t transfer_size, int ninputs_xgpu, const data_section *data_sections, int n_data_sections);
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+// Writers - with -j, that many makesub threads write subs at once, so a backlog after a stall is caught up on as many cores as we can spare
+// instead of one sub after another.  Each claims a ready slot by swapping its state from 2 to 3, and a finished or abandoned one (to clear it) by
+// swapping it from whatever it was to 3, so no two ever work on the same slot.  Each builds its sub under its own temp name (the lead writer's is
+// temp_file_name, the others add .1, .2 and so on) with its own copy threads.  The .free file allocator and pool are shared, under free_lock.  Only
+// the lead writer keeps them up to date while idle, and only it prepares the next sub's file (-a).
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+
+int makesub_writers = 1;  // -j: How many subs can be written at once
+
+// A makesub thread.  main starts the lead writer (arg NULL, ie writer 0), which sets up what they all share and starts the others.
+void *makesub(void *arg) {
+  int writer = (int)(intptr_t)arg;
+  char name[16];             // For the log
+  char temp_file_name[300];  // Where we build our subs
+  pthread_t *writers = NULL;  // The lead writer's handles for the others
+
+  if (writer == 0) {
+    strcpy(name, "makesub");
+    strcpy(temp_file_name, conf.temp_file_name);
+    printf("Makesub started\n");
+  } else {
+    snprintf(name, sizeof(name), "makesub.%d", writer);
+    snprintf(temp_file_name, sizeof(temp_file_name), "%s.%d", conf.temp_file_name, writer);
+    printf("%s started, building subs in %s\n", name, temp_file_name);
+  }
   fflush(stdout);
 
   //--------------- Set CPU affinity ---------------
-  printf("Set process makesub cpu affinity returned %d\n", set_cpu_affinity(conf.cpu_mask_makesub));
+  printf("Set process %s cpu affinity returned %d\n", name, set_cpu_affinity(&conf.place_makesub, name));
   fflush(stdout);
 
+  copy_pool_t pool;  // Our copy threads
+  copy_pool_init(&pool, makesub_threads);
+
+  if (writer == 0) {
+    printf("Makesub copying with %d threads\n", makesub_threads);
+    free_pool = calloc_or_die(free_pool_files + 1, sizeof(free_map_t), "free file pool");
+    printf("Makesub keeping up to %d .free files mapped\n", free_pool_files);
+    fflush(stdout);
+
+    if (!free_alloc_init()) {  // If the directory doesn't exist we must be running on an incorrectly set up server
+      printf("Fatal error: Directory %s does not exist\n", conf.shared_mem_dir);
+      fflush(stdout);
+      terminate = true;    // Tell every thread to close down
+      pthread_exit(NULL);  // and close down ourselves.
+    }
+    next_sub_init();
+    reclaim_init();
+
+    writers = calloc_or_die(makesub_writers, sizeof(pthread_t), "makesub writers");
+    for (int loop = 1; loop < makesub_writers; loop++) pthread_create(&writers[loop], NULL, makesub, (void *)(intptr_t)loop);
+    printf("Makesub writing up to %d subs at once\n", makesub_writers);
+    fflush(stdout);
+  }
+
   //---------------- Initialize and declare variables ------------------------
 
-  DIR *dir;
-  struct dirent *dp;
-  struct stat filestats;
-  int len_filename;
-  char this_file[300], best_file[300], dest_file[300];  // The name of the file we're looking at, the name of the best file we've found so far, and the sub's final destination name
+  char best_file[300], dest_file[300];  // The name of the .free file we're going to use, and the sub's final destination name
+  char header[SUBFILE_HEADER_SIZE];     // The sub's 4K header, built before it's copied in
+  struct stat best_stats;               // and the stats of the .free file
+  free_map_t *pooled;                   // The free pool's mapping of the file we're writing, or NULL if it's mapped just for this sub
+  size_t mapped_size;                   // How much of it we mapped
+  bool prepared;                        // It was picked and mapped ahead of time by next_sub_prepare()
+  size_t last_desired_size = 0;         // The size of the last sub, which is our guess for the next one
 
-  time_t earliest_file;    // Holding space for the date we need to beat when looking for old .free files
   int free_files     = 0;  // Count of the number of ".free" files available to use for writing out .sub files
   int bad_free_files = 0;  // Count of the number of ".free" files that *cannot* be used for some reason (probably the wrong size)
 
@@ -2020,7 +5033,6 @@ void *makesub() {
   size_t desired_size;  // The total size (including header and zeroth block) that this sub file needs to be
 
   int slot_index;  // index of slot to write out
-  int left_this_line;
   int sub_result;  // Temp storage for the result before we write it back to the array for others to see.  Once we do that, we can't change our mind.
   bool go4sub;
 
@@ -2028,22 +5040,16 @@ void *makesub() {
   void *dummy_volt_ptr       = &dummy_udp.volts[0];  // and we'll remember where we can find UDP_PAYLOAD_SIZE (4096LL) worth of zeros
 
   subobs_udp_meta_t *subm;  // pointer to the sub metadata array I'm working on
-  tile_meta_t *rfm;         // Pointer to the tile metadata for the tile I'm working on
 
-  int block;         // loop variable
   int MandC_rf;      // loop variable
   int ninputs;       // The number of inputs in the sub file
   int ninputs_xgpu;  // The number of inputs in the sub file but padded out to whatever number xgpu needs to deal with them in (not actually padded until done by Ian's code later)
 
-  MandC_meta_t my_MandC_meta[MAX_INPUTS];  // Working copies of the changeable metafits/metabin data for this subobs
-  MandC_meta_t *my_MandC;                  // Make a temporary pointer to the M&C metadata for one rf input
+  MandC_meta_t *my_MandC_meta = calloc_or_die(max_inputs, sizeof(MandC_meta_t), "makesub MandC");  // Working copies of the changeable metafits/metabin data for this subobs
+  MandC_meta_t *my_MandC;                                                                         // Make a temporary pointer to the M&C metadata for one rf input
 
-  delay_table_entry_t block_0_working;  // Construct a single tile's metadata struct to write to the 0th block.  We'll update and write this out as we step through tiles.
 
-  int source_packet;  // which packet (of 5002) contains the first byte of data we need
-  int source_offset;  // what is the offset in that packet of the first byte we need
-  int source_remain;  // How much data is left from that offset to the end of the udp packet
-  int ticks_waited;   // count howmany usleeps we've been wating for a subobservation to write.
+  int ticks_waited;  // count howmany usleeps we've been wating for a subobservation to write.
 
   char *sp;
 
@@ -2062,39 +5068,40 @@ void *makesub() {
 
     //---------- look for a sub to write out ----------
 
-    slot_index = -1;  // Start by assuming there's nothing to write out
+    unsigned seen = stage_seq(&write_work);  // Note where write_work was, so a sub that's ready after we've looked still wakes us
+
+    slot_index = stage_queue_pop(&clear_queue);  // Free up slots first.  These were written (4, 5), had no metadata (2.5) or were abandoned (6)
+    if (slot_index != -1) {
+      report_substatus(name, "subobs %d slot %d. Clearing slot, as we've finished with it", sub[slot_index].subobs, slot_index);
+      slot_state[slot_index] = 3;
+      clear_slot(slot_index);
+      atomic_store(&slot_handoffs[slot_index], 0);
+      meta_state[slot_index] = 0;
+      slot_state[slot_index] = 0;
+      continue;
+    }
 
-    for (int loop = 0; loop < 4; loop++) {                   // Look through all four subobs meta arrays
-      if (slot_state[loop] == 2 && meta_state[loop] == 4) {  // If this sub is ready to write out
-        if (slot_index == -1) {                              // check if we've already found a different one to write out and if we haven't
-          slot_index = loop;                                 // then mark this one as the best so far
-        } else {                                             // otherwise we need to work out
-          if (sub[slot_index].subobs > sub[loop].subobs) {   // if that other one was for a later sub than this one
-            slot_index = loop;                               // in which case, mark this one as the best so far
-          }
-        }
-      } else if ((slot_state[loop] == 2 && meta_state[loop] == 5) ||  // failed to read metadata
-                 (slot_state[loop] == 4 || slot_state[loop] == 5) ||  // finished attempting makesub
-                 (slot_state[loop] == 6 && meta_state[loop] >= 4)     // slot abandoned for taking too long; we wait for metafits read attempt completion before clearing.
-      ) {
-        report_substatus("makesub", "subobs %d slot %d. Clearing slot, as we've finished with it", sub[loop].subobs, loop);
-        clear_slot(loop);
-        meta_state[loop] = 0;
-        slot_state[loop] = 0;
-      }
-    }  // We left this loop with an index to the best sub to write or a -1 if none available.
+    slot_index = stage_queue_pop(&write_queue);  // The oldest sub ready to write out, or -1 if none available.  Popping it makes it ours
+    if (slot_index != -1) slot_state[slot_index] = 3;
 
     if (slot_index == -1) {  // if there is nothing to do
-      usleep(20000);         // Chillax for a bit.
+      if (writer == 0) {
+        pthread_mutex_lock(&free_lock);
+        free_alloc_poll();                    // Keep up with .free files coming and going
+        free_pool_fill();                     // and get another one mapped ready if we're keeping some
+        next_sub_prepare(last_desired_size);  // and the one for the next sub, if we're doing that
+        pthread_mutex_unlock(&free_lock);
+      }
+      stage_wait(&write_work, seen, 20);  // Chillax until there's a sub for us, or a bit, to keep up with the .free files
       ticks_waited += 1;
       if (ticks_waited % (50 * 5) == 0) {  // every few secpnds
-        report_substatus("makesub", "waiting");
+        report_substatus(name, "waiting");
       }
 
     } else {  // or we have some work to do!  Like a whole sub file to write out!
       ticks_waited = 0;
 
-      report_substatus("makesub", "subobs %d slot %d. Starting writing.", sub[slot_index].subobs, slot_index);
+      report_substatus(name, "subobs %d slot %d. Starting writing.", sub[slot_index].subobs, slot_index);
 
       clock_gettime(CLOCK_REALTIME, &started_sub_write_time);  // Record the start time before we actually get started.  The clock starts ticking from here.
       subm = &sub[slot_index];                                 // Temporary pointer to our sub's metadata array
@@ -2102,9 +5109,8 @@ void *makesub() {
       subm->msec_wait = ((started_sub_write_time.tv_sec - ended_sub_write_time.tv_sec) * 1000) +
                         ((started_sub_write_time.tv_nsec - ended_sub_write_time.tv_nsec) / 1000000);  // msec since the last sub ending
       subm->udp_at_start_write =
-          UDP_added_to_buff;       // What's the udp packet number we've received (EVEN IF WE HAVEN'T LOOKED AT IT!) at the time we start to process this sub for writing
-      slot_state[slot_index] = 3;  // Record that we're working on this one!
-      sub_result             = 5;  // Start by assuming we failed  (ie result==5).  If we get everything working later, we'll swap this for a 4.
+          UDP_added_to_buff;  // What's the udp packet number we've received (EVEN IF WE HAVEN'T LOOKED AT IT!) at the time we start to process this sub for writing
+      sub_result = 5;         // Start by assuming we failed  (ie result==5).  If we get everything working later, we'll swap this for a 4.
 
       //---------- Do some last-minute metafits work to prepare ----------
 
@@ -2115,14 +5121,16 @@ void *makesub() {
 
       transfer_size = SUB_LINE_SIZE * (size_t)ninputs * (BLOCKS_PER_SUB + 1);  // Should be 5275648000 for 256T in 160+1 blocks
       desired_size  = transfer_size + SUBFILE_HEADER_SIZE;                     // Should be 5275652096 for 256T in 160+1 blocks plus 4K header (1288001 x 4K for dd to make)
+      last_desired_size = desired_size;
 
       active_rf_inputs = 0;  // The number of rf_inputs that we want in the sub file and sent at least 1 udp packet
 
       for (int loop = 0; loop < ninputs; loop++) {  // populate the metadata array for all rf_inputs in this subobs
-        my_MandC_meta[loop].rf_input   = subm->rf_inp[loop].rf_input;
-        my_MandC_meta[loop].start_byte = (UDP_PAYLOAD_SIZE + (subm->rf_inp[loop].ws_delay * 2));  // NB: Each delay is a sample, ie two bytes, not one!!!
+        my_MandC_meta[loop].rf_input   = subm->hot.rf_input[loop];
+        my_MandC_meta[loop].start_byte = (UDP_PAYLOAD_SIZE + (subm->hot.ws_delay[loop] * 2));  // NB: Each delay is a sample, ie two bytes, not one!!!
         my_MandC_meta[loop].seen_order =
             subm->rf2ndx[my_MandC_meta[loop].rf_input];               // If they weren't seen, they will be 0 which maps to NULL pointers which will be replaced with zeros
+        if (my_MandC_meta[loop].seen_order > max_inputs) my_MandC_meta[loop].seen_order = 0;  // Seen after max_inputs others, so UDP_parse kept no row for it
         if (my_MandC_meta[loop].seen_order != 0) active_rf_inputs++;  // seen_order starts at 1. If it's 0 that means we didn't even get 1 udp packet for this rf_input
       }
 
@@ -2136,78 +5144,52 @@ void *makesub() {
 
       //---------- Look in the shared memory directory and find the oldest .free file of the correct size ----------
 
-      if (go4sub) {      // If everything is okay so far, enter the next block of code
-        go4sub = false;  // but go back to assuming a failure unless we succeed in the next bit
-        report_substatus("makesub", "subobs %d slot %d. Seeking free .free file size %lu or bigger.", sub[slot_index].subobs, slot_index, desired_size);
-        int free_examined = 0;
-
-        dir = opendir(conf.shared_mem_dir);  // Open up the shared memory directory
-
-        if (dir == NULL) {  // If the directory doesn't exist we must be running on an incorrectly set up server
-          printf("Fatal error: Directory %s does not exist\n", conf.shared_mem_dir);
-          fflush(stdout);
-          terminate = true;    // Tell every thread to close down
-          pthread_exit(NULL);  // and close down ourselves.
-        }
-
-        earliest_file  = 0xFFFFFFFFFFFF;  // Pick some ridiculous date in the future.  This is the date we need to beat.
-        free_files     = 0;               // So far, we haven't found any available free files we can reuse
-        bad_free_files = 0;               // nor any free files that we *can't* use (wrong size?)
-
-        size_t last_seen_size    = 0;
-        size_t biggest_seen_size = 0;
-        size_t selected_size     = 0;
-        while ((dp = readdir(dir)) != NULL) {                      // Read an entry and while there are still directory entries to look at
-          if ((dp->d_type == DT_REG) && (dp->d_name[0] != '.')) {  // If it's a regular file (ie not a directory or a named pipe etc) and it's not hidden
-            if (((len_filename = strlen(dp->d_name)) >= 5) &&
-                (strcmp(&dp->d_name[len_filename - 5], ".free") == 0)) {  // If the filename is at least 5 characters long and the last 5 characters are ".free"
-              free_examined++;
-
-              sprintf(this_file, "%s/%s", conf.shared_mem_dir, dp->d_name);  // Construct the full file name including path
-              if (stat(this_file, &filestats) == 0) {                        // Try to read the file statistics and if they are available
-                if (biggest_seen_size < filestats.st_size) {
-                  biggest_seen_size = filestats.st_size;
-                }
-                last_seen_size = filestats.st_size;
-
-                // printf("File %s has size = %11lu and a ctime of %ld\n", this_file, filestats.st_size, filestats.st_ctim.tv_sec);
-                if (filestats.st_size >= desired_size) {  // If the file is at least the size we need
-
-                  free_files++;  // That's one more we can use!
-
-                  if (filestats.st_ctim.tv_sec < earliest_file) {  // and this file has been there longer than the longest one we've found so far (ctime)
-                    earliest_file = filestats.st_ctim.tv_sec;      // We have a new 'oldest' time to beat
-                    strcpy(best_file, this_file);                  // and we'll store its name
-                    selected_size = filestats.st_size;
-                    go4sub        = true;  // We've found at least one file we can reuse.  It may not be the best, but we know we can do this now.
-                  }
-                } else {
-                  bad_free_files++;  // That's one more we can use!
-                }
-              }
-            }
-          }
-        }
-        closedir(dir);
+      pooled      = NULL;
+      mapped_size = desired_size;
+      prepared    = go4sub && writer == 0 && next_sub_claim(desired_size, &ext_shm_buf, &mapped_size, &pooled);  // Already picked, renamed and mapped while we were idle?
+      if (prepared) {
+        pthread_mutex_lock(&free_lock);
+        free_alloc_count(desired_size, &free_files, &bad_free_files);
+        pthread_mutex_unlock(&free_lock);
+        report_substatus(name, "subobs %d slot %d. Using the .free file prepared earlier.", sub[slot_index].subobs, slot_index);
+      }
+
+      if (go4sub && !prepared) {  // If everything is okay so far, enter the next block of code
+        go4sub = false;           // but go back to assuming a failure unless we succeed in the next bit
+        report_substatus(name, "subobs %d slot %d. Seeking free .free file size %lu or bigger.", sub[slot_index].subobs, slot_index, desired_size);
+
+        pthread_mutex_lock(&free_lock);
+        go4sub = free_alloc_take(desired_size, best_file, sizeof(best_file), &best_stats);  // The oldest one that's big enough
+        free_alloc_count(desired_size, &free_files, &bad_free_files);
+        pthread_mutex_unlock(&free_lock);
         if (!go4sub) {
-          report_substatus("makesub", "subobs %d slot %d. Can't find any free files of size %lu to use for subfile. ", sub[slot_index].subobs, slot_index, desired_size);
+          report_substatus(name, "subobs %d slot %d. Can't find any free files of size %lu to use for subfile. ", sub[slot_index].subobs, slot_index, desired_size);
         } else {
-          report_substatus("makesub", "subobs %d slot %d. Using free file of size %lu to use for subfile. ", sub[slot_index].subobs, slot_index, selected_size);
+          report_substatus(name, "subobs %d slot %d. Using free file of size %lu to use for subfile. ", sub[slot_index].subobs, slot_index, best_stats.st_size);
         }
-        report_substatus("makesub", "subobs %d slot %d. (last size seen = %lu, biggest size seen = %lu, free_examined = %d)", sub[slot_index].subobs, slot_index, last_seen_size,
-                         biggest_seen_size, free_examined);
+        report_substatus(name, "subobs %d slot %d. (%d more free files big enough, %d too small)", sub[slot_index].subobs, slot_index, free_files, bad_free_files);
       }
 
       //---------- Try to mmap that file (assuming we found one) so we can treat it like RAM (which it actually is) ----------
 
-      if (go4sub) {      // If everything is okay so far, enter the next block of code
-        go4sub = false;  // but go back to assuming a failure unless we succeed in the next bit
+      if (go4sub && !prepared) {  // If everything is okay so far, enter the next block of code
+        go4sub = false;           // but go back to assuming a failure unless we succeed in the next bit
 
         // printf( "The winner is %s\n", best_file );
 
-        if (rename(best_file, conf.temp_file_name) != -1) {  // If we can rename the file to our temporary name
+        if (rename(best_file, temp_file_name) != -1) {  // If we can rename the file to our temporary name
+
+          if (free_pool_files > 0) {  // Use (or make) the pool's mapping of it if we're keeping them
+            pthread_mutex_lock(&free_lock);
+            free_pool_prune();
+            if ((pooled = free_pool_mapped(&best_stats)) == NULL) pooled = free_pool_add(temp_file_name, &best_stats, false);  // Populated later, not now
+            if (pooled != NULL) ext_shm_buf = pooled->addr;  // Before letting go of the lock, as a prune by another writer can move the entry
+            pthread_mutex_unlock(&free_lock);
+          }
 
-          if ((ext_shm_fd = shm_open(&conf.temp_file_name[8], O_RDWR, 0666)) != -1) {  // Try to open the shmem file (after removing "/dev/shm" ) and if it opens successfully
+          if (pooled != NULL) {
+            go4sub = true;
+          } else if ((ext_shm_fd = shm_open(&temp_file_name[8], O_RDWR, 0666)) != -1) {  // Try to open the shmem file (after removing "/dev/shm" ) and if it opens successfully
 
             if ((ext_shm_buf = (char *)mmap(NULL, desired_size, PROT_READ | PROT_WRITE, MAP_SHARED, ext_shm_fd, 0)) != ((char *)(-1))) {  // and if we can mmap it successfully
               go4sub = true;  // Then we are all ready to use the buffer so remember that
@@ -2226,6 +5208,9 @@ void *makesub() {
         } else {
           printf("Failed rename\n");
           fflush(stdout);
+          pthread_mutex_lock(&free_lock);
+          free_alloc_return(best_file);  // It's still a .free file, so it shouldn't drop out of the allocator
+          pthread_mutex_unlock(&free_lock);
         }
       }
 
@@ -2246,33 +5231,7 @@ void *makesub() {
 
         char *delay_table_start = dest;
 
-        for (MandC_rf = 0; MandC_rf < ninputs; MandC_rf++) {  // The zeroth block is the size of the number of inputs times SUB_LINE_SIZE.
-
-          rfm = &subm->rf_inp[MandC_rf];  // Get a temp pointer for this tile's metadata
-
-          block_0_working.rf_input         = rfm->rf_input;  // Copy the tile's ID and polarization into the structure we're about to write to the sub file's 0th block
-          block_0_working.ws_delay_applied = rfm->ws_delay;  // Copy the tile's whole sample delay value into the structure we're about to write to the sub file's 0th block
-
-          double w_initial_delay = rfm->initial_delay;  // Copy the tile's initial fractional delay to a working copy we can update as we step through the delays
-          double w_delta_delay   = rfm->delta_delay;    // Copy the tile's initial fractional delay step to a working copy we can update as we step through the delays
-
-          block_0_working.initial_delay = w_initial_delay;  // Copy the tile's initial fractional delay to the structure we're about to write to the 0th block
-          block_0_working.delta_delay   = w_delta_delay;  // Copy the tile's initial fractional delay step (~ 1st derivative) to the structure we're about to write to the 0th block
-          block_0_working.delta_delta_delay  = rfm->delta_delta_delay;  // Copy the tile's fractional delay step's step  to the structure we're about to write to the 0th block
-          block_0_working.start_total_delay  = rfm->start_total_delay;
-          block_0_working.middle_total_delay = rfm->middle_total_delay;
-          block_0_working.end_total_delay    = rfm->end_total_delay;
-          block_0_working.num_pointings      = 1;  // Initially 1, but might grow to 10 or more if beamforming.  The first pointing is for delay tracking in the correlator.
-
-          for (int loop = 0; loop < POINTINGS_PER_SUB; loop++) {  // populate the fractional delay lookup table for this tile (one for each 5ms)
-            block_0_working.frac_delay[loop] = w_initial_delay;   // Rounding and everything was all included when we did the original maths in the other thread
-            w_initial_delay += w_delta_delay;                     // update our *TEMP* copies as we cycle through
-            w_delta_delay += block_0_working.delta_delta_delay;   // and update out *TEMP* delta.  We need to do this using temp values, so we don't 'use up'
-                                                                  // the initial values we want to write out.
-          }
-
-          dest = mempcpy(dest, &block_0_working, sizeof(block_0_working));  // write them out one at a time
-        }
+        dest = mempcpy(dest, subm->delay_table, sizeof(delay_table_entry_t) * ninputs);  // Already built by add_meta_fits
 
         char *delay_table_end  = dest;
         int delay_table_offset = delay_table_start - block0_add;
@@ -2282,27 +5241,14 @@ void *makesub() {
 
         delay_table2_entry_t *delay_table2_entry = (delay_table2_entry_t *)dest;
         for (MandC_rf = 0; MandC_rf < ninputs; MandC_rf++) {
-          rfm                                    = &subm->rf_inp[MandC_rf];
-          delay_table2_entry->rf_input           = rfm->rf_input;  // the tile's ID and polarization
-          delay_table2_entry->ws_delay           = rfm->ws_delay;  // the tile's whole sample delay value
-          delay_table2_entry->start_total_delay  = (float)rfm->start_total_delay;
-          delay_table2_entry->middle_total_delay = (float)rfm->middle_total_delay;
-          delay_table2_entry->end_total_delay    = (float)rfm->end_total_delay;
+          delay_table2_entry->rf_input           = subm->hot.rf_input[MandC_rf];  // the tile's ID and polarization
+          delay_table2_entry->ws_delay           = subm->hot.ws_delay[MandC_rf];  // the tile's whole sample delay value
+          delay_table2_entry->start_total_delay  = (float)subm->hot.start_total_delay[MandC_rf];
+          delay_table2_entry->middle_total_delay = (float)subm->hot.middle_total_delay[MandC_rf];
+          delay_table2_entry->end_total_delay    = (float)subm->hot.end_total_delay[MandC_rf];
           delay_table2_entry++;
         }
-        for (int i = 0; i < subm->ncoherant_beams; i++) {
-          for (MandC_rf = 0; MandC_rf < ninputs; MandC_rf++) {
-            rfm = &subm->rf_inp[MandC_rf];
-
-            delay_table2_entry->rf_input           = rfm->rf_input;
-            delay_table2_entry->ws_delay           = 0;
-            delay_table2_entry->start_total_delay  = rfm->delay_offset_in_samples[0][i];
-            delay_table2_entry->middle_total_delay = rfm->delay_offset_in_samples[1][i];
-            delay_table2_entry->end_total_delay    = rfm->delay_offset_in_samples[2][i];
-            delay_table2_entry++;
-          }
-        }
-        dest = (char *)delay_table2_entry;
+        dest = mempcpy(delay_table2_entry, subm->beam_delays, sizeof(delay_table2_entry_t) * subm->ncoherant_beams * ninputs);  // Coherent beams, prepared by add_meta_fits
 
         char *delay_table2_end       = dest;
         int delay_table2_offset      = delay_table2_start - block0_add;
@@ -2310,10 +5256,11 @@ void *makesub() {
         uint8_t *arrival_times_start = (uint8_t *)dest;
 
         for (MandC_rf = 0; MandC_rf < ninputs; MandC_rf++) {
-          rfm             = &subm->rf_inp[MandC_rf];  // Tile metadata
-          uint16_t row    = subm->rf2ndx[rfm->rf_input];
-          float *arrivals = sub[slot_index].udp_arrivals[row];
-          dest            = mempcpy(dest, arrivals, sizeof(float) * UDP_PER_RF_PER_SUB);
+          uint16_t row       = my_MandC_meta[MandC_rf].seen_order;  // rf2ndx[rf_input], looked up once above
+          uint16_t *arrivals = sub[slot_index].udp_arrivals[row];
+          float *out         = (float *)dest;
+          for (int t = 0; t < UDP_PER_RF_PER_SUB; t++) out[t] = arrival_decode(arrivals[t]);  // Still floats in seconds in the sub file
+          dest += sizeof(float) * UDP_PER_RF_PER_SUB;
         }
 
         uint8_t *arrival_times_end = (uint8_t *)dest;
@@ -2328,12 +5275,12 @@ void *makesub() {
         uint32_t packet_map_stride = (UDP_PER_RF_PER_SUB - 2 + 7) / 8;  // round up the row size to ensure all the bits will still fit if UDP_PER_RF_PER_SUB%8 stops being 0
 
         for (MandC_rf = 0; MandC_rf < ninputs; MandC_rf++) {
-          rfm            = &subm->rf_inp[MandC_rf];  // Tile metadata
-          uint16_t row   = subm->rf2ndx[rfm->rf_input];
-          char **packets = sub[slot_index].udp_volts[row];
+          uint16_t row       = my_MandC_meta[MandC_rf].seen_order;
+          uint32_t *packets  = sub[slot_index].udp_volts[row];
           for (int t = 0; t < UDP_PER_RF_PER_SUB - 2; t += 8) {
-            uint8_t bitmap = (packets[t + 1] != NULL) << 7 | (packets[t + 2] != NULL) << 6 | (packets[t + 3] != NULL) << 5 | (packets[t + 4] != NULL) << 4 |
-                             (packets[t + 5] != NULL) << 3 | (packets[t + 6] != NULL) << 2 | (packets[t + 7] != NULL) << 1 | (packets[t + 8] != NULL);
+            uint8_t bitmap = (packets[t + 1] != NO_PACKET) << 7 | (packets[t + 2] != NO_PACKET) << 6 | (packets[t + 3] != NO_PACKET) << 5 |
+                             (packets[t + 4] != NO_PACKET) << 4 | (packets[t + 5] != NO_PACKET) << 3 | (packets[t + 6] != NO_PACKET) << 2 |
+                             (packets[t + 7] != NO_PACKET) << 1 | (packets[t + 8] != NO_PACKET);
             dest[t / 8] = (char)bitmap;
           }
           dest += packet_map_stride;
@@ -2354,18 +5301,18 @@ void *makesub() {
         for (MandC_rf = 0; MandC_rf < ninputs; MandC_rf++) {
           my_MandC = &my_MandC_meta[MandC_rf];
 
-          char **packets = sub[slot_index].udp_volts[my_MandC->seen_order];
+          uint32_t *packets = sub[slot_index].udp_volts[my_MandC->seen_order];
 
-          sp   = packets[0];
+          sp   = packet_payload(subm->ring, packets[0]);
           dest = mempcpy(dest, sp ? sp : dummy_volt_ptr, UDP_PAYLOAD_SIZE);
 
-          sp   = packets[1];
+          sp   = packet_payload(subm->ring, packets[1]);
           dest = mempcpy(dest, sp ? sp : dummy_volt_ptr, UDP_PAYLOAD_SIZE);
 
-          sp   = packets[UDP_PER_RF_PER_SUB - 2];
+          sp   = packet_payload(subm->ring, packets[UDP_PER_RF_PER_SUB - 2]);
           dest = mempcpy(dest, sp ? sp : dummy_volt_ptr, UDP_PAYLOAD_SIZE);
 
-          sp   = packets[UDP_PER_RF_PER_SUB - 1];
+          sp   = packet_payload(subm->ring, packets[UDP_PER_RF_PER_SUB - 1]);
           dest = mempcpy(dest, sp ? sp : dummy_volt_ptr, UDP_PAYLOAD_SIZE);
         }
 
@@ -2389,48 +5336,23 @@ void *makesub() {
           };
           // clang-format on
           int lds = sizeof(data_sections) / sizeof(data_sections[0]);
-          build_subfile_header(subm, transfer_size, ninputs_xgpu, data_sections, lds);
-          memcpy(ext_shm_buf, sub_header, SUBFILE_HEADER_SIZE);  // Do the memory copy from the preprepared 4K subfile header to the beginning of the sub file
+          build_subfile_header(header, subm, transfer_size, ninputs_xgpu, data_sections, lds);
+          memcpy(ext_shm_buf, header, SUBFILE_HEADER_SIZE);  // Do the memory copy from the preprepared 4K subfile header to the beginning of the sub file
         }
 
         //---------- Write out the voltage data blocks ----------
         dest = block1_add;  // Set our write pointer to the beginning of block 1
 
-        for (block = 1; block <= BLOCKS_PER_SUB; block++) {     // We have 160 (or whatever) blocks of real data to write out. We'll do them in time order (50ms each)
-          for (MandC_rf = 0; MandC_rf < ninputs; MandC_rf++) {  // Now step through the M&C ordered rf inputs for the inputs the M&C says should be included in the sub file.
-                                                                // This is likely to be similar to the list we actually saw, but may not be identical!
-            my_MandC = &my_MandC_meta[MandC_rf];  // Make a temporary pointer to the M&C metadata for this rf input.  NB these are sorted in order they need to be written out as
-                                                  // opposed to the order the packets arrived.
-
-            left_this_line = SUB_LINE_SIZE;
-
-            while (left_this_line > 0) {  // Keep going until we've finished writing out a whole line of the sub file
-              int bytes2copy;
-
-              source_packet = my_MandC->start_byte / UDP_PAYLOAD_SIZE;
-              source_offset = my_MandC->start_byte % UDP_PAYLOAD_SIZE;
-              source_remain = UDP_PAYLOAD_SIZE - source_offset;  // How much of the packet is left in bytes?
-                                                                 // It should be an even number and at least 2 or I have a bug in the logic or code
-
-              sp = sub[slot_index].udp_volts[my_MandC->seen_order][source_packet];  // Pick up the pointer to the udp volt data we need (assuming we ever saw it arrive)
-              if (sp == NULL) {                                                     // but if it never arrived
-                sp = dummy_volt_ptr;                                                // point to our pre-prepared, zero filled, fake packet we use when the real one isn't available
-                subm->udp_dummy++;  // The number of dummy packets we needed to insert to pad things out. Make a note for reporting and debug purposes
-                monitor.udp_dummy++;
-              }
-
-              bytes2copy =
-                  ((source_remain < left_this_line) ? source_remain
-                                                    : left_this_line);  // Get the minimum of the remaining length of the udp volt payload or the length of line left to populate
-
-              dest = mempcpy(dest, sp + source_offset, bytes2copy);  // Do the memory copy from the udp payload to the sub file and update the destination pointer
-
-              left_this_line -= bytes2copy;        // Keep up to date with the remaining amount of work needed on this line
-              my_MandC->start_byte += bytes2copy;  // and where we are up to in reading them
-
-            }  // We've finished the udp packet
-          }  // We've finished the signal chain for this block
-        }  // We've finished the block
+        struct timespec copy_start, copy_end;
+        clock_gettime(CLOCK_MONOTONIC, &copy_start);
+        int64_t faults = copy_pool_run(&pool, subm, my_MandC_meta, ninputs, block1_add);  // All 160 (or whatever) blocks, split over the copy threads
+        clock_gettime(CLOCK_MONOTONIC, &copy_end);
+        report_substatus(name, "subobs %d slot %d. Voltage blocks took %.0f ms with %ld page faults (%s).", sub[slot_index].subobs, slot_index,
+                         elapsed_usec(&copy_start, &copy_end) / 1000.0, faults, pooled ? "pooled" : (prepared ? "prefaulted" : "mapped now"));
+        int64_t udp_dummy = packet_map_dummies((uint8_t *)packet_map_start, ninputs, packet_map_stride);
+        subm->udp_dummy += udp_dummy;  // The number of dummy packets we needed to insert to pad things out. Make a note for reporting and debug purposes
+        __atomic_fetch_add(&monitor.udp_dummy, udp_dummy, __ATOMIC_RELAXED);  // Other writers may be adding theirs
+        dest = block1_add + (size_t)BLOCKS_PER_SUB * ninputs * SUB_LINE_SIZE;
 
         // By here, the entire sub has been written out to shared memory and it's time to close it out and rename it so it becomes available for other programs
 
@@ -2438,15 +5360,20 @@ void *makesub() {
           printf("Memory pointer error in writing sub file!\n");  // before we do that, let's just do a quick check to see we ended up exactly at the end, so we can confirm all our
                                                                   // maths is right.
 
-        munmap(ext_shm_buf, desired_size);  // Release the mmap for the whole sub file
+        copy_fence();  // Every store (ours and the copy threads') is visible before anyone can open the file under its new name
 
-        if (rename(conf.temp_file_name, dest_file) != -1) {  // Rename my temporary file to a final sub file name, thus releasing it to other programs
+        if (rename(temp_file_name, dest_file) != -1) {  // Rename my temporary file to a final sub file name, thus releasing it to other programs
           sub_result = 4;                                    // This was our last check.  If we got to here, the sub file worked, so prepare to write that to monitoring system
         } else {
           printf("Final rename failed.\n");  // This was our last check.  If we got to here, the sub file rename failed, so prepare to write that to monitoring system
           fflush(stdout);                    // but if that fails, I'm not really sure what to do.  Let's just note it and see if it ever happens
         }
 
+        if (pooled == NULL) {  // Release the mmap for the whole sub file, unless the pool is keeping it.  The reclaimer does the slow part.
+          double unmap_ms = reclaim_unmap(ext_shm_buf, mapped_size);
+          if (unmap_ms >= 0) report_substatus(name, "subobs %d slot %d. Unmap queued (the last one took %.0f ms).", sub[slot_index].subobs, slot_index, unmap_ms);
+        }
+
       }  // We've finished the sub file writing and closed and renamed the file.
 
       //---------- We're finished or we've given up.  Either way record the new state and elapsed time ----------
@@ -2459,33 +5386,43 @@ void *makesub() {
       subm->msec_took = ((ended_sub_write_time.tv_sec - started_sub_write_time.tv_sec) * 1000) +
                         ((ended_sub_write_time.tv_nsec - started_sub_write_time.tv_nsec) / 1000000);  // msec since this sub started
 
-      slot_state[slot_index] = sub_result;  // Record that we've finished working on this one even if we gave up.  Will be a 4 or a 5 depending on whether it worked or not.
-
-      report_substatus("makesub", "subobs %d slot %d. Finished writing.", sub[slot_index].subobs, slot_index);
+      // Log before handing the slot back.  Once it's on clear_queue another writer may clear it, and UDP_parse may claim it for a new subobs.
+      report_substatus(name, "subobs %d slot %d. Finished writing.", subm->subobs, slot_index);
       printf("now=%ld,so=%d,ob=%ld,%s,st=%d,free=%d:%d,wait=%d,took=%d,used=%ld,count=%d,dummy=%d,rf_inps=w%d:s%d:c%d,skipped (undersampled)=%d\n",
-             (int64_t)(ended_sub_write_time.tv_sec - GPS_offset), subm->subobs, subm->GPSTIME, subm->MODE, slot_state[slot_index], free_files, bad_free_files, subm->msec_wait,
+             (int64_t)(ended_sub_write_time.tv_sec - GPS_offset), subm->subobs, subm->GPSTIME, subm->MODE, sub_result, free_files, bad_free_files, subm->msec_wait,
              subm->msec_took, subm->udp_at_end_write - subm->first_udp, subm->udp_count, subm->udp_dummy, subm->NINPUTS, subm->rf_seen, active_rf_inputs,
              subm->ignored_packet_count);
-
       fflush(stdout);
+
+      slot_state[slot_index] = sub_result;  // Record that we've finished working on this one even if we gave up.  Will be a 4 or a 5 depending on whether it worked or not.
+      stage_queue_push(&clear_queue, slot_index);
     }
   }  // Jump up to the top and look again (as well as checking if we need to shut down)
 
   //---------- We've been told to shut down ----------
-  printf("Exiting makesub\n");
+  copy_pool_destroy(&pool);
+  free(my_MandC_meta);
+  if (writer == 0) {
+    for (int loop = 1; loop < makesub_writers; loop++) pthread_join(writers[loop], NULL);
+    free(writers);
+    next_sub_destroy();
+    reclaim_destroy();
+    free_pool_destroy();
+    printf("Exiting makesub\n");
+  }
   pthread_exit(NULL);
 }
 
-void build_subfile_header(const subobs_udp_meta_t *subm, size_t transfer_size, int ninputs_xgpu, const data_section *data_sections, int n_data_sections) {
+void build_subfile_header(char *header, const subobs_udp_meta_t *subm, size_t transfer_size, int ninputs_xgpu, const data_section *data_sections, int n_data_sections) {
   int64_t obs_offset = subm->subobs - subm->GPSTIME;  // How long since the observation started?
   char utc_start[30];
   time_t observation_start = subm->UNIXTIME;
   strftime(utc_start, sizeof(utc_start), "%Y-%m-%d-%H:%M:%S", gmtime(&observation_start));
 
-  memset(sub_header, 0, SUBFILE_HEADER_SIZE);  // Pre fill with null chars just to ensure we don't leave junk anywhere in the header
+  memset(header, 0, SUBFILE_HEADER_SIZE);  // Pre fill with null chars just to ensure we don't leave junk anywhere in the header
 
-  char *bp = sub_header;
-  char *ep = sub_header + SUBFILE_HEADER_SIZE;
+  char *bp = header;
+  char *ep = header + SUBFILE_HEADER_SIZE;
   bp += snprintf(bp, ep - bp, "HDR_SIZE %lld\n", SUBFILE_HEADER_SIZE);
   bp += snprintf(bp, ep - bp, "POPULATED 1\n");
   bp += snprintf(bp, ep - bp, "OBS_ID %ld\n", subm->GPSTIME);
@@ -2615,10 +5552,23 @@ void usage(char *err)  // Bad command line.  Report the supported usage.
   printf("                    -F <file.conf> Configuration file to use for shared settings\n");
   printf("                    -i <number>    Instance number on server, if multiple copies per server in use\n");
   printf("                    -c <channel>   Coarse channel override\n");
-  printf("                    -D <count>     make up delays for <count> coherent beams (development only, maximum %d)\n", COHERENT_BEAMS_MAX);
+  printf("                    -D <count>     make up delays for <count> coherent beams (development only, maximum %d)\n", max_coherent_beams());
   printf("                    -C force cable delays\n");
   printf("                    -G force geometric delays\n");
   printf("                    -d Debug mode.  Write to .free files\n");
+  printf("                    -x cross-check every metafits read against cfitsio\n");
+  printf("                    -b <name>      run the named benchmark and exit (metafits, delays, makesub, copy, rates, prefault, unmap, slots, wakeups, pinned)\n");
+  printf("                    -m <file>      metafits file to use for benchmarks (optional for delays)\n");
+  printf("                    -M <file>      compile the sidecar (.u2s) for a metafits file and exit\n");
+  printf("                    -K don't read or write metafits sidecars\n");
+  printf("                    -w <threads>   threads to copy voltages into each sub file with (default 1)\n");
+  printf("                    -k <kernel>    voltage copy kernel: auto (default), avx512, avx2, sse2 or memcpy\n");
+  printf("                    -z             .free files are handed back zero filled, so don't write missing data\n");
+  printf("                    -p <files>     keep up to this many .free files mapped between uses (default 0)\n");
+  printf("                    -a             pick, map and prefault the next sub's .free file ahead of time\n");
+  printf("                    -j <writers>   subs that can be written at once, each by its own makesub thread (default 1)\n");
+  printf("                    -n <slots>     subobs that can be open at once (default 4, from 3 to %d)\n", MAX_SUB_SLOTS);
+  printf("                    -t             log every slot passed between stages\n");
   fflush(stdout);
 }
 
@@ -2639,6 +5589,7 @@ int delaygen(uint32_t obs_id, uint32_t subobs_idx) {
   slot_state[0]           = 1;
   meta_state[0]           = 1;
   sub[0].subobs           = subobs_start & ~7;
+  stage_queue_push(&meta_queue, 0);
 
   fprintf(stderr, "obs ID: %d\n", obs_id);
   fprintf(stderr, "subobs ID: %d\n", sub[0].subobs);
@@ -2674,45 +5625,22 @@ int delaygen(uint32_t obs_id, uint32_t subobs_idx) {
   }
   fflush(stderr);
 
-  tile_meta_t *rfm;
-  delay_table_entry_t dt_entry_working;
+  const tile_hot_t *hot = &subm->hot;
   int MandC_rf;
   int ninputs_pad = sub[0].NINPUTS;
-  double w_initial_delay;
-  double w_delta_delay;
 
-  /// Copied and pasted from `makesub`:
   for (MandC_rf = 0; MandC_rf < ninputs_pad; MandC_rf++) {  // The zeroth block is the size of the padded number of inputs times SUB_LINE_SIZE.  NB: We dodn't pad any more!
 
-    rfm = &subm->rf_inp[MandC_rf];  // Get a pointer for this tile's metadata
-
-    dt_entry_working.rf_input         = rfm->rf_input;       // Copy the tile's ID and polarization into the structure we're about to write to the sub file's 0th block
-    dt_entry_working.ws_delay_applied = rfm->ws_delay;       // Copy the tile's whole sample delay value into the structure we're about to write to the sub file's 0th block
-    w_initial_delay                   = rfm->initial_delay;  // Copy the tile's initial fractional delay (times 2^20) to a working copy we can update as we step through the delays
-    w_delta_delay = rfm->delta_delay;  // Copy the tile's initial fractional delay step (like its 1st derivative) to a working copy we can update as we step through the delays
-
-    dt_entry_working.initial_delay = w_initial_delay;  // Copy the tile's initial fractional delay (times 2^20) to the structure we're about to write to the 0th block
-    dt_entry_working.delta_delay = w_delta_delay;  // Copy the tile's initial fractional delay step (like its 1st derivative) to the structure we're about to write to the 0th block
-    dt_entry_working.delta_delta_delay =
-        rfm->delta_delta_delay;          // Copy the tile's fractional delay step's step (like its 2nd derivative) to the structure we're about to write to the 0th block
-    dt_entry_working.num_pointings = 1;  // Initially 1, but might grow to 10 or more if beamforming.  The first pointing is for delay tracking in the correlator.
-
-    for (int loop = 0; loop < POINTINGS_PER_SUB; loop++) {  // populate the fractional delay lookup table for this tile (one for each 5ms)
-      dt_entry_working.frac_delay[loop] = w_initial_delay;  // Rounding and everything was all included when we did the original maths in the other thread
-      w_initial_delay += w_delta_delay;                     // update our *TEMP* copies as we cycle through
-      w_delta_delay +=
-          dt_entry_working.delta_delta_delay;  // and update out *TEMP* delta.  We need to do this using temp values, so we don't 'use up' the initial values we want to write out.
-    }
+    const delay_table_entry_t *dt_entry = &subm->delay_table[MandC_rf];  // Exactly what makesub will copy into block 0
 
     printf("%d,%d,%.*f,%.*f,%.*f,%.*f,%.*f,%.*f,%d,%d,",
 
-           rfm->rf_input, rfm->ws_delay, DECIMAL_DIG, rfm->start_total_delay, DECIMAL_DIG, rfm->middle_total_delay, DECIMAL_DIG, rfm->end_total_delay, DECIMAL_DIG,
-           rfm->initial_delay, DECIMAL_DIG, rfm->delta_delay, DECIMAL_DIG, rfm->delta_delta_delay, 1, 0);
+           hot->rf_input[MandC_rf], hot->ws_delay[MandC_rf], DECIMAL_DIG, hot->start_total_delay[MandC_rf], DECIMAL_DIG, hot->middle_total_delay[MandC_rf], DECIMAL_DIG,
+           hot->end_total_delay[MandC_rf], DECIMAL_DIG, hot->initial_delay[MandC_rf], DECIMAL_DIG, hot->delta_delay[MandC_rf], DECIMAL_DIG, hot->delta_delta_delay[MandC_rf], 1, 0);
     for (int loop = 0; loop < POINTINGS_PER_SUB - 1; loop++) {
-      printf("%.*f,", DECIMAL_DIG, dt_entry_working.frac_delay[loop]);
+      printf("%.*f,", DECIMAL_DIG, dt_entry->frac_delay[loop]);
     }
-    printf("%.*f\n", DECIMAL_DIG, dt_entry_working.frac_delay[POINTINGS_PER_SUB - 1]);
-    memset(&dt_entry_working, 0, sizeof(delay_table_entry_t));
+    printf("%.*f\n", DECIMAL_DIG, dt_entry->frac_delay[POINTINGS_PER_SUB - 1]);
   }
 
   // for(int i=0; i<sub[0].NINPUTS; i++) {
@@ -2726,14 +5654,796 @@ int delaygen(uint32_t obs_id, uint32_t subobs_idx) {
   return 0;
 }
 
-void *calloc_or_die(size_t nmemb, size_t size, char *name) {
-  void *res = calloc(nmemb, size);
-  if (!res) {
-    printf("%s calloc failed\n", name);
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+// Benchmarks - standalone timing runs selected with -b <name>.  They don't need a config file and exit when done.
+//---------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Time the delay engine against the long double get_path_difference() path it replaced, and measure the worst case difference between them.
+int benchmark_delays(const char *metafits_file) {
+  const int beam_counts[] = {0, 30, 300};
+  const int repeats       = 20;
+  int ninputs             = max_inputs;
+
+  long double *ld_north  = calloc_or_die(max_inputs, sizeof(long double), "benchmark north");
+  long double *ld_east   = calloc_or_die(max_inputs, sizeof(long double), "benchmark east");
+  long double *ld_height = calloc_or_die(max_inputs, sizeof(long double), "benchmark height");
+  double *north          = calloc_or_die(max_inputs, sizeof(double), "benchmark north");
+  double *east           = calloc_or_die(max_inputs, sizeof(double), "benchmark east");
+  double *height         = calloc_or_die(max_inputs, sizeof(double), "benchmark height");
+
+  srand48(8);
+  if (metafits_file != NULL) {  // Real tile positions if we've been given a metafits, otherwise something like the extended array
+    subobs_udp_meta_t *subm = alloc_subobs(1, "benchmark subm");
+    if (conf.coarse_chan == 0) conf.coarse_chan = 1;
+    subm->subobs = 0x7fffffff;
+    if (!read_metafits_mmap(metafits_file, subm)) {
+      fprintf(stderr, "mmap reader failed to read %s\n", metafits_file);
+      return EXIT_FAILURE;
+    }
+    ninputs = subm->NINPUTS;
+    for (int loop = 0; loop < ninputs; loop++) {
+      ld_north[loop]  = subm->rf_inp[loop].North;
+      ld_east[loop]   = subm->rf_inp[loop].East;
+      ld_height[loop] = subm->rf_inp[loop].Height;
+    }
+    free_subobs(subm, 1);
+  } else {
+    for (int loop = 0; loop < ninputs; loop++) {
+      ld_north[loop]  = roundl((drand48() - 0.5) * 10e6);  // +/- 5km, whole mm like the metafits gives us
+      ld_east[loop]   = roundl((drand48() - 0.5) * 10e6);
+      ld_height[loop] = roundl(377000.0 + (drand48() - 0.5) * 10e3);
+    }
+  }
+  for (int loop = 0; loop < ninputs; loop++) {
+    north[loop]  = ld_north[loop];
+    east[loop]   = ld_east[loop];
+    height[loop] = ld_height[loop];
+  }
+
+  long double mm2s_conv_factor = (long double)SAMPLES_PER_SEC / (long double)LIGHTSPEED;
+  printf("%d inputs, %lld samples/sec\n", ninputs, SAMPLES_PER_SEC);
+
+  for (size_t bc = 0; bc < sizeof(beam_counts) / sizeof(beam_counts[0]); bc++) {
+    int npointings           = (1 + beam_counts[bc]) * 3;
+    float *alt               = calloc_or_die(npointings, sizeof(float), "benchmark alt");
+    float *az                = calloc_or_die(npointings, sizeof(float), "benchmark az");
+    pointing_vec_t *vecs     = calloc_or_die(npointings, sizeof(pointing_vec_t), "benchmark pointings");
+    double *path_mm          = calloc_or_die((size_t)npointings * ninputs, sizeof(double), "benchmark path_mm");
+    long double *ref_mm      = calloc_or_die((size_t)npointings * ninputs, sizeof(long double), "benchmark ref_mm");
+    double old_best          = DBL_MAX;
+    double new_best          = DBL_MAX;
+
+    for (int loop = 0; loop < npointings; loop++) {
+      alt[loop] = 20.0 + drand48() * 70.0;
+      az[loop]  = drand48() * 360.0;
+    }
+
+    for (int rep = 0; rep < repeats; rep++) {
+      struct timespec t0, t1, t2;
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      for (int p = 0; p < npointings; p++) {
+        for (int loop = 0; loop < ninputs; loop++) ref_mm[(size_t)p * ninputs + loop] = get_path_difference(ld_north[loop], ld_east[loop], ld_height[loop], alt[p], az[p]);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      for (int p = 0; p < npointings; p++) vecs[p] = pointing_vector(alt[p], az[p]);
+      path_differences(ninputs, north, east, height, npointings, vecs, path_mm);
+      clock_gettime(CLOCK_MONOTONIC, &t2);
+      if (elapsed_usec(&t0, &t1) < old_best) old_best = elapsed_usec(&t0, &t1);
+      if (elapsed_usec(&t1, &t2) < new_best) new_best = elapsed_usec(&t1, &t2);
+    }
+
+    long double max_err_mm = 0.0L;  // Error in the absolute path differences
+    long double max_err_s  = 0.0L;  // Error in a beam's delay relative to the tile pointing, in samples, which is what ends up in DELAY_TABLE2
+    for (int p = 0; p < npointings; p++) {
+      for (int loop = 0; loop < ninputs; loop++) {
+        size_t i        = (size_t)p * ninputs + loop;
+        size_t i0       = (size_t)(p % 3) * ninputs + loop;
+        long double err = fabsl(path_mm[i] - ref_mm[i]);
+        long double es  = fabsl(((path_mm[i] - path_mm[i0]) - (ref_mm[i] - ref_mm[i0])) * mm2s_conv_factor);
+        if (err > max_err_mm) max_err_mm = err;
+        if (es > max_err_s) max_err_s = es;
+      }
+    }
+    printf("%3d beams: long double %9.1f us, engine %7.1f us (best of %d).  max error %.3Le mm, %.3Le samples\n", beam_counts[bc], old_best, new_best, repeats, max_err_mm,
+           max_err_s);
+
+    free(alt);
+    free(az);
+    free(vecs);
+    free(path_mm);
+    free(ref_mm);
+  }
+
+  free(ld_north);
+  free(ld_east);
+  free(ld_height);
+  free(north);
+  free(east);
+  free(height);
+  return EXIT_SUCCESS;
+}
+
+uint64_t checksum64(const void *buf, size_t len) {  // FNV-1a over 64 bit words.  len must be a multiple of 8.
+  const uint64_t *wp = buf;
+  uint64_t sum       = 0xcbf29ce484222325ULL;
+  for (size_t loop = 0; loop < len / 8; loop++) sum = (sum ^ wp[loop]) * 0x100000001b3ULL;
+  return sum;
+}
+
+// A synthetic subobs for the makesub benchmarks: ninputs inputs with random whole sample delays, about 1% of packets missing and one input
+// that never sent anything.  With 'undelayed' every fourth input has no whole sample delay, so its lines are packet aligned at the oversampled
+// rate.  The payloads are drawn from a small ring of random packets so it doesn't need gigabytes of source data.
+subobs_udp_meta_t *make_test_subobs(int ninputs, MandC_meta_t *MandC, char **payloads, bool undelayed) {
+  const int npayloads     = 257;
+  subobs_udp_meta_t *subm = alloc_subobs(1, "test subm");
+  mwa_udp_packet_t *ring  = calloc_or_die(npayloads, sizeof(mwa_udp_packet_t), "test packet ring");
+  *payloads               = (char *)ring;
+
+  srand48(31);
+  for (int packet = 0; packet < npayloads; packet++)
+    for (int loop = 0; loop < UDP_PAYLOAD_SIZE; loop++) ((char *)ring[packet].volts)[loop] = (char)lrand48();
+
+  subm->NINPUTS   = ninputs;
+  subm->ring      = ring;
+  subm->udp_volts = calloc_or_die(ninputs + 1, sizeof(uint32_t *), "test udp_volts");
+  for (int row = 0; row <= ninputs; row++) {
+    subm->udp_volts[row] = calloc_or_die(UDP_PER_RF_PER_SUB, sizeof(uint32_t), "test udp_volts row");
+    for (int packet = 0; row > 0 && packet < UDP_PER_RF_PER_SUB; packet++) {
+      if (lrand48() % 100 != 0) subm->udp_volts[row][packet] = lrand48() % npayloads + 1;
+    }
+  }
+  for (int loop = 0; loop < ninputs; loop++) {
+    MandC[loop].rf_input   = loop;
+    MandC[loop].seen_order = (loop == ninputs / 2) ? 0 : loop + 1;             // One input never seen
+    MandC[loop].start_byte = UDP_PAYLOAD_SIZE + (lrand48() % 4001 - 2000) * 2;  // +/- 2000 samples
+    if (undelayed && loop % 4 == 0) MandC[loop].start_byte = UDP_PAYLOAD_SIZE;  // and every fourth one undelayed
+  }
+  return subm;
+}
+
+void free_test_subobs(subobs_udp_meta_t *subm, char *payloads) {
+  for (int row = 0; row <= subm->NINPUTS; row++) free(subm->udp_volts[row]);
+  free(subm->udp_volts);
+  free_subobs(subm, 1);
+  free(payloads);
+}
+
+// Assemble the same synthetic subobs with one copy thread and with a pool, and check the bytes and dummy counts come out identical.
+int benchmark_makesub() {
+  const int ninputs = 32;
+  const int threads = (makesub_threads > 1) ? makesub_threads : 4;
+  size_t size       = (size_t)ninputs * SUB_LINE_SIZE * BLOCKS_PER_SUB;
+
+  MandC_meta_t MandC[ninputs];
+  char *payloads;
+  subobs_udp_meta_t *subm = make_test_subobs(ninputs, MandC, &payloads, false);
+
+  char *single = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  char *pooled = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (single == MAP_FAILED || pooled == MAP_FAILED) {
+    fprintf(stderr, "benchmark makesub couldn't map %lu bytes of output\n", size);
+    return EXIT_FAILURE;
+  }
+
+  struct {
+    int threads;
+    char *out;
+    double best;
+  } runs[] = {{1, single, DBL_MAX}, {threads, pooled, DBL_MAX}};
+
+  for (int r = 0; r < 2; r++) {
+    copy_pool_t pool;
+    copy_pool_init(&pool, runs[r].threads);
+    for (int rep = 0; rep < 5; rep++) {
+      struct timespec t0, t1;
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      copy_pool_run(&pool, subm, MandC, ninputs, runs[r].out);
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      if (elapsed_usec(&t0, &t1) < runs[r].best) runs[r].best = elapsed_usec(&t0, &t1);
+    }
+    copy_pool_destroy(&pool);
+    printf("%2d thread(s): %8.1f ms, %6.2f GB/s, checksum %016lx\n", runs[r].threads, runs[r].best / 1000.0, size / runs[r].best / 1000.0,
+           checksum64(runs[r].out, size));
+  }
+
+  bool same = (memcmp(single, pooled, size) == 0);
+  printf("%d inputs, %lu bytes: %s\n", ninputs, size, same ? "identical" : "MISMATCH");
+
+  munmap(single, size);
+  munmap(pooled, size);
+  free_test_subobs(subm, payloads);
+  return same ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Stands in for UDP_parse in benchmark_copy: a random pointer chase, one cache line per step, over a working set about the size of the ring
+// buffer headers and pointer tables it keeps hot.  Counts its own cache misses if perf events are available.
+typedef struct cache_walker {
+  atomic_bool stop;
+  uint64_t *chain;  // chain[i * 8] is the index of the next line to visit
+  size_t nlines;
+  uint64_t steps;
+  uint64_t last;  // Where the chase ended up, so it can't be optimised away
+  uint64_t misses;
+  bool counted;  // misses is valid
+} cache_walker_t;
+
+void *cache_walker_thread(void *arg) {
+  cache_walker_t *w = arg;
+  struct perf_event_attr pe;
+  memset(&pe, 0, sizeof(pe));
+  pe.type           = PERF_TYPE_HARDWARE;
+  pe.size           = sizeof(pe);
+  pe.config         = PERF_COUNT_HW_CACHE_MISSES;
+  pe.exclude_kernel = 1;
+  pe.exclude_hv     = 1;
+  int fd            = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);  // This thread, any cpu
+
+  uint64_t next  = 0;
+  uint64_t steps = 0;
+  while (!atomic_load_explicit(&w->stop, memory_order_relaxed)) {
+    for (int loop = 0; loop < 1024; loop++) next = w->chain[next * 8];
+    steps += 1024;
+  }
+  w->steps   = steps;
+  w->last    = next;
+  w->counted = (fd != -1) && (read(fd, &w->misses, sizeof(w->misses)) == sizeof(w->misses));
+  if (fd != -1) close(fd);
+  return NULL;
+}
+
+// Copy a synthetic subobs with each copy kernel while a pointer chasing thread stands in for UDP_parse, and see how much each kernel slows it down.
+int benchmark_copy() {
+  const int ninputs    = 32;
+  const size_t hot_set = 8 << 20;
+  size_t size          = (size_t)ninputs * SUB_LINE_SIZE * BLOCKS_PER_SUB;
+
+  MandC_meta_t MandC[ninputs];
+  char *payloads;
+  subobs_udp_meta_t *subm = make_test_subobs(ninputs, MandC, &payloads, false);
+  char *out               = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (out == MAP_FAILED) {
+    fprintf(stderr, "benchmark copy couldn't map %lu bytes of output\n", size);
+    return EXIT_FAILURE;
+  }
+
+  cache_walker_t walker = {.nlines = hot_set / 64};
+  walker.chain          = calloc_or_die(walker.nlines * 8, sizeof(uint64_t), "walker chain");
+  for (size_t loop = 0; loop < walker.nlines; loop++) walker.chain[loop * 8] = loop;
+  for (size_t loop = walker.nlines - 1; loop > 0; loop--) {  // Sattolo's shuffle, so it's one cycle through every line
+    size_t other            = lrand48() % loop;
+    uint64_t swap           = walker.chain[loop * 8];
+    walker.chain[loop * 8]  = walker.chain[other * 8];
+    walker.chain[other * 8] = swap;
+  }
+
+  copy_pool_t pool;
+  copy_pool_init(&pool, makesub_threads);
+  uint64_t reference = 0;
+
+  printf("%d inputs, %lu bytes per copy, %d copy thread(s), %lu MB parse working set\n", ninputs, size, makesub_threads, hot_set >> 20);
+  for (int k = -1; k < NUM_COPY_KERNELS; k++) {  // -1 is the parse thread on its own
+    if (k >= 0 && !copy_kernels[k].supported()) continue;
+    pthread_t walker_thread;
+    atomic_store(&walker.stop, false);
+    pthread_create(&walker_thread, NULL, cache_walker_thread, &walker);
+
+    struct timespec t0, t1;
+    double copy_us  = 0.0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (k >= 0) {
+      copy_kernel = copy_kernels[k].kernel;
+      for (int rep = 0; rep < 5; rep++) copy_pool_run(&pool, subm, MandC, ninputs, out);
+    } else {
+      usleep(500000);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    copy_us = elapsed_usec(&t0, &t1);
+
+    atomic_store(&walker.stop, true);
+    pthread_join(walker_thread, NULL);
+
+    uint64_t sum = checksum64(out, size);
+    if (k >= 0 && reference == 0) reference = sum;
+    char misses[40] = "n/a";
+    if (walker.counted) snprintf(misses, sizeof(misses), "%.1f", walker.misses * 1000.0 / walker.steps);
+    if (k < 0) {
+      printf("%-7s:                   parse %6.1f ns/step, %s misses per 1000 steps\n", "idle", copy_us * 1000.0 / walker.steps, misses);
+    } else {
+      printf("%-7s: %6.2f GB/s copy, parse %6.1f ns/step, %s misses per 1000 steps, %s\n", copy_kernels[k].name, 5.0 * size / copy_us / 1000.0,
+             copy_us * 1000.0 / walker.steps, misses, sum == reference ? "same bytes" : "DIFFERENT BYTES");
+    }
+  }
+
+  copy_pool_destroy(&pool);
+  munmap(out, size);
+  free(walker.chain);
+  free_test_subobs(subm, payloads);
+  return EXIT_SUCCESS;
+}
+
+// Compile the sidecar for a metafits and exit (-M).  For running ahead of time, e.g. when the metafits is created.
+int compile_sidecar(const char *metafits_file) {
+  char sidecar_file[340];
+  sidecar_name(metafits_file, sidecar_file, sizeof(sidecar_file));
+  sidecar_header_t *h = compile_metafits(metafits_file);
+  if (h == NULL) {
+    fprintf(stderr, "Failed to compile %s\n", metafits_file);
+    return EXIT_FAILURE;
+  }
+  bool ok = write_sidecar(h, sidecar_file);
+  fprintf(stderr, "%s %s (%lu bytes, %d inputs, %d pointings, %d beams)\n", ok ? "Wrote" : "Failed to write", sidecar_file, (unsigned long)h->file_size, h->NINPUTS, h->ntimes,
+          h->nbeams);
+  free(h);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Time per-file parse of a metafits with the sidecar, the mmap reader and cfitsio, and check they agree.
+int benchmark_metafits(const char *metafits_file) {
+  const int iterations = 200;
+
+  if (metafits_file == NULL) {
+    fprintf(stderr, "benchmark metafits needs a metafits file (-m <file>)\n");
+    return EXIT_FAILURE;
+  }
+  if (conf.coarse_chan == 0) conf.coarse_chan = 1;
+
+  subobs_udp_meta_t *subm  = alloc_subobs(1, "benchmark subm");
+  subobs_udp_meta_t *check = alloc_subobs(1, "benchmark check");
+
+  subm->subobs = 0x7fffffff;  // Read once to find GPSTIME, then benchmark the first subobs of the observation so the pointing tables get used
+  if (!read_metafits_mmap(metafits_file, subm)) {
+    fprintf(stderr, "mmap reader failed to read %s\n", metafits_file);
+    return EXIT_FAILURE;
+  }
+  uint32_t subobs = subm->GPSTIME;
+  free_subobs(subm, 1);
+  subm = alloc_subobs(1, "benchmark subm");
+  subm->subobs  = subobs;
+  check->subobs = subobs;
+
+  subobs_udp_meta_t *sidecar = alloc_subobs(1, "benchmark sidecar");
+  sidecar->subobs            = subobs;
+  if (compile_sidecar(metafits_file) != EXIT_SUCCESS) return EXIT_FAILURE;
+
+  struct {
+    char *name;
+    bool (*reader)(const char *, subobs_udp_meta_t *);
+    subobs_udp_meta_t *subm;
+  } readers[] = {{"mmap", read_metafits_mmap, subm}, {"sidecar", read_metafits_sidecar, sidecar}, {"cfitsio", read_metafits, check}};
+
+  int saved_stdout = dup(STDOUT_FILENO);  // Keep the readers' logging out of the way while timing
+  int devnull      = open("/dev/null", O_WRONLY);
+  for (int r = 0; r < 3; r++) {
+    double total = 0.0;
+    double best  = DBL_MAX;
+    int failures = 0;
+    for (int loop = 0; loop < iterations; loop++) {
+      struct timespec t0, t1;
+      fflush(stdout);
+      dup2(devnull, STDOUT_FILENO);
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      if (!readers[r].reader(metafits_file, readers[r].subm)) failures++;
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      fflush(stdout);
+      dup2(saved_stdout, STDOUT_FILENO);
+      double us = elapsed_usec(&t0, &t1);
+      total += us;
+      if (us < best) best = us;
+    }
+    printf("%-8s: %d reads, mean %9.1f us, best %9.1f us per file, %d failed\n", readers[r].name, iterations, total / iterations, best, failures);
+  }
+  close(devnull);
+  close(saved_stdout);
+
+  int mismatches = compare_metafits(subm, sidecar);
+  printf("sidecar check: %d mismatched fields\n", mismatches);
+  int cfitsio_mismatches = compare_metafits(subm, check);
+  printf("cross-check: %d mismatched fields\n", cfitsio_mismatches);
+  mismatches += cfitsio_mismatches;
+  free_subobs(subm, 1);
+  free_subobs(sidecar, 1);
+  free_subobs(check, 1);
+  return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// A ring buffer of 'npackets' packets for the parse benchmarks and checks to fill with fill_test_packets(), and fresh slots (all free) for them
+// to go in.  close_test_ring() frees both.
+void open_test_ring(int64_t npackets, char *name) {
+  UDP_num_slots = npackets;
+  UDPbuf        = calloc_or_die(npackets, sizeof(mwa_udp_packet_t), name);
+  alloc_sub_slots();
+  for (int slot = 0; slot < sub_slots; slot++) slot_state[slot] = meta_state[slot] = 0;
+  UDP_removed_from_buff = UDP_added_to_buff = 0;
+}
+
+void close_test_ring() {
+  free_sub_slots();
+  free(UDPbuf);
+}
+
+// 'npackets' packets as the receivers send them (network byte order): 'ninputs' inputs in turn for each packet time from the start of 'subobs'.
+// Parsing rewrites the headers in place, so they have to be filled again before each parse.
+void fill_test_packets(mwa_udp_packet_t *buf, int64_t npackets, int ninputs, uint32_t subobs, bool oversampled) {
+  for (int64_t loop = 0; loop < npackets; loop++) {
+    int64_t tick          = loop / ninputs;  // Packets since the start of the subobs
+    buf[loop].packet_type = oversampled ? MWA_PACKET_TYPE_OVERSAMPLING : MWA_PACKET_TYPE_LEGACY;
+    buf[loop].GPS_time    = htonl(subobs + tick / SUBSECSPERSEC_AT(oversampled));
+    buf[loop].subsec_time = htons(tick % SUBSECSPERSEC_AT(oversampled));
+    buf[loop].rf_input    = htons(loop % ninputs);
+  }
+}
+
+// Compare the rate specialised kernels against the generic ones at both sample rates: parse_packets() over a subobs of synthetic packets from
+// 'ninputs' inputs in arrival order, and the voltage block copy (one thread) of a test subobs.  Both must leave identical slots and sub files.
+int benchmark_rates() {
+  const int ninputs = 16;
+  bool same         = true;
+
+  for (int run = 0; run < 3; run++) {  // Legacy, oversampled, and oversampled with some packet aligned lines for the whole packet copy
+    bool oversampled              = (run > 0);
+    bool undelayed                = (run == 2);
+    conf.oversampling             = oversampled;
+    const rate_kernels_t *sets[2] = {&generic_kernels, oversampled ? &oversampled_kernels : &legacy_kernels};
+    double parse_ns[2]            = {DBL_MAX, DBL_MAX};
+    double copy_ms[2]             = {DBL_MAX, DBL_MAX};
+    uint64_t slot_sum[2], file_sum[2];
+
+    // The last packet of each input is left out, so none are duplicated into the next subobs (which would close our slot)
+    int64_t npackets = ninputs * (SUBSECSPERSUB - 1);
+    open_test_ring(npackets, "benchmark UDPbuf");
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint32_t subobs = (uint32_t)(now.tv_sec - GPS_offset) & 0xFFFFFFF8;
+    int slot        = 0;  // Every slot is free when the parse starts, so it takes the first
+
+    size_t size = (size_t)ninputs * SUB_LINE_SIZE * BLOCKS_PER_SUB;
+    MandC_meta_t MandC[ninputs];
+    char *payloads;
+    subobs_udp_meta_t *subm = make_test_subobs(ninputs, MandC, &payloads, undelayed);
+    char *out               = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (out == MAP_FAILED) {
+      fprintf(stderr, "benchmark rates couldn't map %lu bytes of output\n", size);
+      return EXIT_FAILURE;
+    }
+    copy_pool_t pool;
+    copy_pool_init(&pool, 1);
+
+    for (int k = 0; k < 2; k++) {
+      rate_kernels = sets[k];
+      for (int rep = 0; rep < 3; rep++) {
+        fill_test_packets(UDPbuf, npackets, ninputs, subobs, oversampled);
+        for (int loop = 0; loop < sub_slots; loop++) {
+          clear_slot(loop);
+          slot_state[loop] = 0;
+          meta_state[loop] = 0;
+        }
+        stage_queues_reset();
+        UDP_removed_from_buff = 0;
+        UDP_added_to_buff     = npackets;
+        parse_state_t ps      = {0};
+
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int64_t passes = rate_kernels->parse(&ps);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (elapsed_usec(&t0, &t1) * 1000.0 / passes < parse_ns[k]) parse_ns[k] = elapsed_usec(&t0, &t1) * 1000.0 / passes;
+      }
+      slot_sum[k] = checksum64(sub[slot].udp_volts[1], ninputs * UDP_PER_RF_PER_SUB * sizeof(uint32_t)) ^ (uint64_t)sub[slot].udp_count;
+
+      for (int rep = 0; rep < 5; rep++) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        copy_pool_run(&pool, subm, MandC, ninputs, out);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (elapsed_usec(&t0, &t1) / 1000.0 < copy_ms[k]) copy_ms[k] = elapsed_usec(&t0, &t1) / 1000.0;
+      }
+      file_sum[k] = checksum64(out, size);
+    }
+
+    bool ok = (slot_sum[0] == slot_sum[1]) && (file_sum[0] == file_sum[1]);
+    printf("%-26s%s parse %6.1f -> %6.1f ns/packet (%.2fx), copy %7.1f -> %7.1f ms (%.2fx): %s\n", sets[1]->name, undelayed ? " undelayed" : "",
+           parse_ns[0], parse_ns[1], parse_ns[0] / parse_ns[1], copy_ms[0], copy_ms[1], copy_ms[0] / copy_ms[1], ok ? "identical" : "MISMATCH");
     fflush(stdout);
-    exit(EXIT_FAILURE);
+    same = same && ok;
+
+    copy_pool_destroy(&pool);
+    munmap(out, size);
+    free_test_subobs(subm, payloads);
+    close_test_ring();
   }
-  return res;
+
+  rate_kernels      = &generic_kernels;
+  conf.oversampling = false;
+  return same ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Feed UDP_parse one subobs of packets during its last second, as they'd normally arrive, and return the ARRIVAL_TIMES entry (in seconds, as
+// makesub would write it) of the furthest from zero of the last packets carried into the next subobs as its start margin.  They arrive before
+// that subobs starts, so it's negative: up to a second early.  (Before the arrival times were kept in milliseconds it was now - GPS_time in
+// uint32_t, which wrapped to about 4.29e9.)
+float margin_arrival(int ninputs) {
+  int64_t per_sub = ninputs * SUBSECSPERSUB;
+  open_test_ring(per_sub, "margin test UDPbuf");
+
+  uint32_t gps_offset_save = GPS_offset;
+  uint32_t subobs          = 1400000000;
+  parse_state_t ps         = {0};
+  GPS_offset               = time(NULL) - (subobs + 7);  // In its last second
+  fill_test_packets(UDPbuf, per_sub, ninputs, subobs, false);
+  UDP_added_to_buff = per_sub;
+  rate_kernels->parse(&ps);
+  GPS_offset = gps_offset_save;
+
+  float furthest = 0.0f;
+  int slot       = slot_find(subobs + 8);
+  if (slot != -1)
+    for (int row = 1; row <= ninputs; row++) {
+      float arrival = arrival_decode(sub[slot].udp_arrivals[row][0]);
+      if (fabsf(arrival) > fabsf(furthest)) furthest = arrival;
+    }
+
+  close_test_ring();
+  return furthest;
+}
+
+// Feed UDP_parse 'stall' + 1 whole subobs of packets with makesub (and add_meta_fits) not running at all, faking the clock so each one arrives in
+// its own 8 seconds.  By the end the first 'stall' subobs should be waiting to be written and two more collecting.  Returns how many packets
+// (including the margin packets copied into the neighbouring subobs) didn't make it into a slot.
+int64_t stall_packets_lost(int stall, int ninputs) {
+  int64_t per_sub = ninputs * SUBSECSPERSUB;
+  open_test_ring(per_sub, "stall test UDPbuf");  // Reused for each subobs.  We only count the references afterwards, not what they refer to
+
+  uint32_t gps_offset_save = GPS_offset;
+  uint32_t first           = 1400000000;  // Any subobs will do
+  parse_state_t ps         = {0};
+  for (int k = 0; k <= stall; k++) {
+    uint32_t subobs = first + 8 * k;
+    GPS_offset      = time(NULL) - (subobs + 4);  // Half way through this subobs
+    fill_test_packets(UDPbuf, per_sub, ninputs, subobs, false);  // The whole ring, which the last subobs has finished with
+    UDP_added_to_buff += per_sub;
+    rate_kernels->parse(&ps);
+  }
+  GPS_offset = gps_offset_save;
+
+  int64_t lost = 0;
+  for (int k = 0; k <= stall + 1; k++) {  // The one after the last just gets the last one's last packets as its start margin
+    int64_t expected = ninputs * ((k <= stall) * SUBSECSPERSUB + (k > 0) + (k < stall));  // Our packets, the last subobs' last and the next one's first
+    int slot         = sub_slots - 1;
+    while (slot >= 0 && !(sub[slot].subobs == first + 8 * k && slot_state[slot] == (k < stall ? 2 : 1))) slot--;
+    if (slot >= 0)
+      for (int row = 1; row <= ninputs; row++)
+        for (int t = 0; t < UDP_PER_RF_PER_SUB; t++) expected -= (sub[slot].udp_volts[row][t] != NO_PACKET);
+    lost += expected;
+  }
+
+  close_test_ring();
+  return lost;
+}
+
+// Stall makesub for 1 to 6 subobs and count the packets lost with the old 4 slots and with just enough (stall + 2).
+int benchmark_slots() {
+  const int ninputs = 4;
+  int sub_slots_arg = sub_slots;
+  bool ok           = true;
+
+  conf.oversampling = false;
+  printf("makesub stalled, %d inputs, %lld packets per subobs.  Packets lost:\n", ninputs, ninputs * SUBSECSPERSUB);
+  for (int stall = 1; stall <= 6; stall++) {
+    sub_slots    = 4;
+    int64_t old  = stall_packets_lost(stall, ninputs);
+    sub_slots    = stall + 2;
+    int64_t lost = stall_packets_lost(stall, ninputs);
+    printf("stalled for %d subobs: 4 slots lost %6ld, %d slots lost %6ld\n", stall, old, sub_slots, lost);
+    fflush(stdout);
+    ok = ok && (lost == 0);
+  }
+
+  sub_slots     = 4;
+  float arrival = margin_arrival(ninputs);  // The clock might just tick over into the next subobs while we're parsing, hence up to +1 s
+  printf("margin packets carried into the next subobs arrived at %.3f s\n", arrival);
+  ok        = ok && (arrival >= -1.0f) && (arrival <= 1.0f) && (arrival != 0.0f);
+  sub_slots = sub_slots_arg;
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Copy a test subobs into a freshly mapped shared memory file (so every page is resident in tmpfs but not yet in our page tables, like a .free
+// file), first as it comes and then after prefault_range(), and report the page faults and times of each.
+int benchmark_prefault() {
+  const int ninputs = 32;
+  size_t size       = (size_t)ninputs * SUB_LINE_SIZE * BLOCKS_PER_SUB;
+
+  int fd = memfd_create("u2s_prefault", 0);
+  if (fd == -1 || ftruncate(fd, size) != 0) {
+    fprintf(stderr, "benchmark prefault couldn't make a %lu byte shared memory file\n", size);
+    return EXIT_FAILURE;
+  }
+  MandC_meta_t MandC[ninputs];
+  char *payloads;
+  subobs_udp_meta_t *subm = make_test_subobs(ninputs, MandC, &payloads, false);
+  copy_pool_t pool;
+  copy_pool_init(&pool, makesub_threads);
+  atomic_bool cancel = false;
+
+  printf("%d inputs, %lu MB, %d copy thread(s), %s copy kernel\n", ninputs, size >> 20, makesub_threads, copy_kernel_name);
+  for (int pass = 0; pass < 3; pass++) {  // Pass 0 just gets the file's pages allocated
+    char *out = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (out == MAP_FAILED) {
+      fprintf(stderr, "benchmark prefault couldn't map the file\n");
+      return EXIT_FAILURE;
+    }
+    struct timespec t0, t1, t2;
+    int64_t f0 = minor_faults();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (pass == 2) prefault_range(out, size, &cancel);
+    int64_t f1 = minor_faults();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    int64_t copy_faults = copy_pool_run(&pool, subm, MandC, ninputs, out);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    if (pass > 0)
+      printf("%-10s: prefault %7.1f ms %8ld faults, copy %7.1f ms %8ld faults\n", pass == 1 ? "cold" : "prefaulted", elapsed_usec(&t0, &t1) / 1000.0, f1 - f0,
+             elapsed_usec(&t1, &t2) / 1000.0, copy_faults);
+    munmap(out, size);
+  }
+
+  copy_pool_destroy(&pool);
+  free_test_subobs(subm, payloads);
+  close(fd);
+  return EXIT_SUCCESS;
+}
+
+// Time what makesub used to wait for at the end of every sub - unmapping a fully faulted in sub file sized mapping - against handing it to the
+// reclaimer.
+int benchmark_unmap() {
+  size_t size = (size_t)256 * SUB_LINE_SIZE * (BLOCKS_PER_SUB + 1);  // 256T
+
+  int fd = memfd_create("u2s_unmap", 0);
+  if (fd == -1 || ftruncate(fd, size) != 0) {
+    fprintf(stderr, "benchmark unmap couldn't make a %lu byte shared memory file\n", size);
+    return EXIT_FAILURE;
+  }
+  atomic_bool cancel = false;
+  reclaim_init();
+
+  printf("%lu MB mapping\n", size >> 20);
+  for (int pass = 0; pass < 4; pass++) {
+    char *out = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (out == MAP_FAILED) {
+      fprintf(stderr, "benchmark unmap couldn't map the file\n");
+      return EXIT_FAILURE;
+    }
+    prefault_range(out, size, &cancel);
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (pass % 2 == 0) {
+      munmap(out, size);
+    } else {
+      reclaim_unmap(out, size);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("%-10s: makesub waited %8.3f ms\n", pass % 2 == 0 ? "munmap" : "reclaimer", elapsed_usec(&t0, &t1) / 1000.0);
+  }
+
+  reclaim_destroy();
+  printf("reclaimer : background unmap took %.1f ms\n", reclaim.usec / 1000.0);
+  close(fd);
+  return EXIT_SUCCESS;
+}
+
+// Stands in for the stage handing work on in benchmark_wakeups: makes work available at random moments and notes when.
+typedef struct handoff_test {
+  stage_event_t event;
+  atomic_int work;  // Bumped for each hand-off
+  struct timespec handed[64];
+  int count;
+  bool poll;  // The consumer naps rather than waiting on event, so don't bother signalling
+} handoff_test_t;
+
+void *handoff_producer(void *arg) {
+  handoff_test_t *test = arg;
+  srand48(47);
+  for (int loop = 0; loop < test->count; loop++) {
+    usleep(5000 + lrand48() % 20000);
+    while (atomic_load(&test->work) != loop) usleep(1000);  // Don't hand over more until the last has been noticed
+    clock_gettime(CLOCK_MONOTONIC, &test->handed[loop]);
+    atomic_store(&test->work, loop + 1);
+    if (!test->poll) stage_signal(&test->event);
+  }
+  return NULL;
+}
+
+// Hand-off latency between stages: how long after work is handed over does the next stage notice?  The consumer either naps for each stage's
+// old usleep() or waits on a stage_event_t with the timeout it now uses.  Also reports the consumer's CPU time per hand-off.
+int benchmark_wakeups() {
+  const struct {
+    char *stage;
+    int msec;     // The usleep() it used to poll with
+    int timeout;  // and its stage_wait() timeout
+  } stages[] = {{"UDP_recv (ring full)", 1, 100}, {"UDP_parse", 10, 100}, {"makesub", 20, 20}, {"add_meta_fits", 100, 100}};
+
+  for (int stage = 0; stage < 4; stage++) {
+    double mean_ms[2], max_ms[2], cpu_us[2];
+    for (int poll = 1; poll >= 0; poll--) {
+      handoff_test_t test = {.count = 40, .poll = poll};
+      struct rusage r0, r1;
+      getrusage(RUSAGE_THREAD, &r0);
+      pthread_t producer;
+      pthread_create(&producer, NULL, handoff_producer, &test);
+
+      double total = 0.0, worst = 0.0;
+      for (int seen_work = 0; seen_work < test.count;) {
+        unsigned seen = stage_seq(&test.event);
+        if (atomic_load(&test.work) > seen_work) {
+          struct timespec now;
+          clock_gettime(CLOCK_MONOTONIC, &now);
+          double ms = elapsed_usec(&test.handed[seen_work], &now) / 1000.0;
+          total += ms;
+          if (ms > worst) worst = ms;
+          seen_work++;
+        } else if (poll) {
+          usleep(stages[stage].msec * 1000);
+        } else {
+          stage_wait(&test.event, seen, stages[stage].timeout);
+        }
+      }
+      pthread_join(producer, NULL);
+      getrusage(RUSAGE_THREAD, &r1);
+
+      mean_ms[poll] = total / test.count;
+      max_ms[poll]  = worst;
+      cpu_us[poll]  = ((r1.ru_utime.tv_sec - r0.ru_utime.tv_sec + r1.ru_stime.tv_sec - r0.ru_stime.tv_sec) * 1e6 + (r1.ru_utime.tv_usec - r0.ru_utime.tv_usec) +
+                      (r1.ru_stime.tv_usec - r0.ru_stime.tv_usec)) /
+                     test.count;
+    }
+    printf("%-21s usleep(%3d ms): mean %7.3f ms, max %7.3f ms, %6.1f us cpu   futex: mean %7.3f ms, max %7.3f ms, %6.1f us cpu\n", stages[stage].stage,
+           stages[stage].msec, mean_ms[1], max_ms[1], cpu_us[1], mean_ms[0], max_ms[0], cpu_us[0]);
+    fflush(stdout);
+  }
+  return EXIT_SUCCESS;
+}
+
+// What the first pass over a freshly allocated packet ring costs (as UDP_recv's first observation pays it), for a calloc()ed ring and a pinned one,
+// which pays it at startup instead.
+int benchmark_pinned() {
+  const int64_t npackets = 100000;
+  size_t bytes           = npackets * sizeof(mwa_udp_packet_t);
+
+  printf("%ld packet ring, %lu MB\n", npackets, bytes >> 20);
+  for (int pinned_ring = 0; pinned_ring < 2; pinned_ring++) {
+    struct timespec t0, t1, t2;
+    int64_t f0 = minor_faults();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    mwa_udp_packet_t *ring = pinned_ring ? alloc_pinned_or_die(npackets, sizeof(mwa_udp_packet_t), -1, "benchmark ring")
+                                         : calloc_or_die(npackets, sizeof(mwa_udp_packet_t), "benchmark ring");
+    int64_t f1 = minor_faults();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for (int64_t packet = 0; packet < npackets; packet++) memset(&ring[packet], packet, sizeof(mwa_udp_packet_t));  // As recvmmsg() would
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    int64_t f2 = minor_faults();
+    printf("%-7s: startup %7.1f ms %7ld faults, first pass %7.1f ms %7ld faults\n", pinned_ring ? "pinned" : "calloc", elapsed_usec(&t0, &t1) / 1000.0,
+           f1 - f0, elapsed_usec(&t1, &t2) / 1000.0, f2 - f1);
+    if (pinned_ring)
+      free_pinned(ring);
+    else
+      free(ring);
+  }
+  report_pinned();
+  return EXIT_SUCCESS;
+}
+
+int run_benchmark(const char *name, const char *metafits_file) {
+  if (strcmp(name, "metafits") == 0) return benchmark_metafits(metafits_file);
+  if (strcmp(name, "delays") == 0) return benchmark_delays(metafits_file);
+  if (strcmp(name, "makesub") == 0) return benchmark_makesub();
+  if (strcmp(name, "copy") == 0) return benchmark_copy();
+  if (strcmp(name, "rates") == 0) return benchmark_rates();
+  if (strcmp(name, "prefault") == 0) return benchmark_prefault();
+  if (strcmp(name, "unmap") == 0) return benchmark_unmap();
+  if (strcmp(name, "slots") == 0) return benchmark_slots();
+  if (strcmp(name, "wakeups") == 0) return benchmark_wakeups();
+  if (strcmp(name, "pinned") == 0) return benchmark_pinned();
+  fprintf(stderr, "Unknown benchmark '%s'.  Available: metafits delays makesub copy rates prefault unmap slots wakeups pinned\n", name);
+  return EXIT_FAILURE;
 }
 
 // ------------------------ Start of world -------------------------
@@ -2752,6 +6462,11 @@ int main(int argc, char **argv) {
   uint32_t delaygen_subobs_idx = 0;  // The n-th subobservation
   bool delaygen_enable         = false;
 
+  char *benchmark_name = NULL;  // Run this benchmark instead of capturing
+  char *metafits_arg   = NULL;  // Metafits file for benchmarks
+  char *sidecar_arg    = NULL;  // Compile a sidecar for this metafits and exit
+  char *copy_kernel_arg = "auto";  // Voltage copy kernel
+
   while (argc > 1 && argv[1][0] == '-') {
     switch (argv[1][1]) {
       case 'd':
@@ -2776,9 +6491,9 @@ int main(int argc, char **argv) {
         ++argv;
         --argc;
         dummy_beams = atoi(argv[1]);
-        if (dummy_beams > COHERENT_BEAMS_MAX) {
+        if (dummy_beams > max_coherent_beams()) {
           char err[80];
-          snprintf(err, sizeof(err), "Maximum number of dummy beams is %d", COHERENT_BEAMS_MAX);
+          snprintf(err, sizeof(err), "Maximum number of dummy beams is %d", max_coherent_beams());
           usage(err);
           exit(EXIT_FAILURE);
         }
@@ -2835,6 +6550,98 @@ int main(int argc, char **argv) {
         fflush(stderr);
         break;
 
+      case 'x':
+        metafits_cross_check = true;
+        fprintf(stderr, "Cross-checking metafits reads against cfitsio.\n");
+        fflush(stderr);
+        break;
+
+      case 'b':
+        ++argv;
+        --argc;
+        benchmark_name = argv[1];
+        break;
+
+      case 'm':
+        ++argv;
+        --argc;
+        metafits_arg = argv[1];
+        break;
+
+      case 'M':
+        ++argv;
+        --argc;
+        sidecar_arg = argv[1];
+        break;
+
+      case 'k':
+        ++argv;
+        --argc;
+        copy_kernel_arg = argv[1];
+        break;
+
+      case 'z':
+        free_files_zeroed = true;
+        break;
+
+      case 'a':
+        next_sub.enabled = true;
+        break;
+
+      case 't':
+        trace_queues = true;
+        break;
+
+      case 'j':
+        ++argv;
+        --argc;
+        makesub_writers = atoi(argv[1]);
+        if (makesub_writers < 1 || makesub_writers > MAX_SUB_SLOTS) {
+          char err[80];
+          snprintf(err, sizeof(err), "makesub writers must be from 1 to %d", MAX_SUB_SLOTS);
+          usage(err);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'n':
+        ++argv;
+        --argc;
+        sub_slots = atoi(argv[1]);
+        if (sub_slots < 3 || sub_slots > MAX_SUB_SLOTS) {
+          char err[80];
+          snprintf(err, sizeof(err), "subobs slots must be from 3 to %d", MAX_SUB_SLOTS);
+          usage(err);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'p':
+        ++argv;
+        --argc;
+        free_pool_files = atoi(argv[1]);
+        if (free_pool_files < 0) {
+          usage("free pool size must be 0 or more");
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'w':
+        ++argv;
+        --argc;
+        makesub_threads = atoi(argv[1]);
+        if (makesub_threads < 1 || makesub_threads > BLOCKS_PER_SUB) {
+          usage("makesub threads must be from 1 to the number of blocks");
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'K':
+        use_sidecars = false;
+        fprintf(stderr, "Not using metafits sidecars.\n");
+        fflush(stderr);
+        break;
+
       default:
         usage("unknown option");
         exit(EXIT_FAILURE);
@@ -2849,6 +6656,20 @@ int main(int argc, char **argv) {
   }
   printf("configured for %d dummy beams\n", dummy_beams);
 
+  if (!select_copy_kernel(copy_kernel_arg)) {
+    usage("copy kernel unknown or not supported by this cpu");
+    exit(EXIT_FAILURE);
+  }
+  printf("using %s copy kernel\n", copy_kernel_name);
+
+  if (benchmark_name != NULL) {  // Benchmarks don't need any configuration, so run them and leave
+    return run_benchmark(benchmark_name, metafits_arg);
+  }
+
+  if (sidecar_arg != NULL) {  // Likewise for compiling a sidecar
+    return compile_sidecar(sidecar_arg);
+  }
+
   //---------------- Look up our configuration options ------------------------
 
   char hostname[300];  // Long enough to fit a 255 host name.  Probably it will only be short, but -hey- it's just a few bytes
@@ -2859,6 +6680,8 @@ int main(int argc, char **argv) {
 
   // Use the config file, the host name and the instance number (if there is one) to look up all our configuration and settings
   read_config(conf_file, shared_conf_file, hostname, instance, chan_override, &conf);
+  select_rate_kernels();
+  printf("using the %s packet parse and assembly kernels\n", rate_kernels->name);
 
   printf("after read_config, UDP_PER_RF_PER_SUB = %lld\n", UDP_PER_RF_PER_SUB);
   if (conf.udp2sub_id == 0) {  // If the lookup returned an id of 0, we don't have enough information to continue
@@ -2880,15 +6703,26 @@ int main(int argc, char **argv) {
   //---------------- Allocate the RAM we need for the incoming udp buffer and initialise it ------------------------
 
   UDP_num_slots = conf.UDP_num_slots;  // We moved this to a config variable, but most of the code still assumes the old name so make both names valid
+  if (UDP_num_slots < 1 || UDP_num_slots >= UINT32_MAX) {  // Slots refer to packets by a 32 bit ring index (plus one)
+    printf("UDP_num_slots %ld must be from 1 to %u\n", UDP_num_slots, UINT32_MAX - 1);
+    fflush(stdout);
+    exit(EXIT_FAILURE);
+  }
 
   // In delay geneator mode, we don't really need to buffer any packets, but we'll let the structures be populated
   if (delaygen_enable == true) {
     UDP_num_slots = 10;
   }
 
-  msgvecs = calloc_or_die(2 * UDP_num_slots, sizeof(struct mmsghdr), "msgvecs");  // NB Make twice as big an array as the number of actual UDP packets we are going to buffer
-  iovecs  = calloc_or_die(UDP_num_slots, sizeof(struct iovec), "iovecs");         // NB Make the *same* number of entries as the number of actual UDP packets we are going to buffer
-  UDPbuf  = calloc_or_die(UDP_num_slots, sizeof(mwa_udp_packet_t), "UDPbuf");     // NB Make the *same* number of entries as the number of actual UDP packets we are going to buffer
+  raise_memlock_limit();  // So we can lock the ring and slot tables
+
+  int ring_node = nic_node(conf.local_if);                          // Keep the ring on the NIC's node, where the packets land
+  if (ring_node < 0) ring_node = place_node(&conf.place_UDP_recv);  // or if we can't tell, with UDP_recv
+
+  // NB Make msgvecs twice as big an array as the number of actual UDP packets we are going to buffer, and iovecs and UDPbuf the *same* number
+  msgvecs = alloc_pinned_or_die(2 * UDP_num_slots, sizeof(struct mmsghdr), ring_node, "msgvecs");
+  iovecs  = alloc_pinned_or_die(UDP_num_slots, sizeof(struct iovec), ring_node, "iovecs");
+  UDPbuf  = alloc_pinned_or_die(UDP_num_slots, sizeof(mwa_udp_packet_t), ring_node, "UDPbuf");
 
   //---------- Now initialize the arrays
 
@@ -2905,29 +6739,10 @@ int main(int argc, char **argv) {
 
   //---------------- Allocate the RAM we need for the subobs pointers and metadata and initialise it ------------------------
 
-  sub = calloc_or_die(SUB_SLOTS, sizeof(subobs_udp_meta_t), "sub");  // Make 4 slots to store the metadata against the maximum 4 subobs that can be open at one time
-
-  for (int slot = 0; slot < SUB_SLOTS; slot++) {
-    sub[slot].udp_volts = calloc_or_die(MAX_INPUTS + 1, sizeof(char **), "packet payload pointer pointer array");
-    char **cursor       = calloc_or_die(UDP_PER_RF_PER_SUB * (MAX_INPUTS + 1), sizeof(char *), "packet payload pointer array");
-    // sub[slot].udp_volts[0] is only dereferenced for writing out dummy data
-    for (int input = 0; input < MAX_INPUTS + 1; input++) {
-      sub[slot].udp_volts[input] = cursor;
-      cursor += UDP_PER_RF_PER_SUB;
-    }
-  }
-
-  for (int slot = 0; slot < SUB_SLOTS; slot++) {
-    sub[slot].udp_arrivals = calloc_or_die(MAX_INPUTS + 1, sizeof(float *), "packet arrival time pointer array");
-    float *cursor          = calloc_or_die(UDP_PER_RF_PER_SUB * (MAX_INPUTS + 1), sizeof(float), "packet arrival time array");
-    // sub[slot].udp_arrivals[0] is only dereferenced for wriring out dummy data
-    for (int input = 0; input < MAX_INPUTS + 1; input++) {
-      sub[slot].udp_arrivals[input] = cursor;
-      cursor += UDP_PER_RF_PER_SUB;
-    }
-  }
-
-  sub_header = calloc_or_die(SUBFILE_HEADER_SIZE, sizeof(char), "sub_header");  // Make ourselves a buffer that's initially of zeros that's the size of a sub file header.
+  set_memory_node(place_node(&conf.place_UDP_parse));  // The slot tables are mostly UDP_parse's to write, so put them on its node
+  alloc_sub_slots();
+  set_memory_node(-1);
+  report_pinned();  // Everything on the packet path is now faulted in, so the first observation doesn't pay for it
 
   // Enter delay generator if enabled, then quit
   if (delaygen_enable == true) {
@@ -2958,7 +6773,7 @@ int main(int argc, char **argv) {
 
   //--------------- Set CPU affinity ---------------
 
-  printf("Set process parent cpu affinity returned %d\n", set_cpu_affinity(conf.cpu_mask_parent));
+  printf("Set process parent cpu affinity returned %d\n", set_cpu_affinity(&conf.place_parent, "meta"));
   fflush(stdout);
 
   add_meta_fits();
@@ -2994,7 +6809,7 @@ int main(int argc, char **argv) {
 
   subobs_udp_meta_t *subm;  // pointer to the sub metadata array I'm looking at
 
-  for (int loop = 0; loop < SUB_SLOTS; loop++) {  // Look through all four subobs meta arrays
+  for (int loop = 0; loop < sub_slots; loop++) {  // Look through all the subobs meta arrays
     subm = &sub[loop];                            // Temporary pointer to our sub's metadata array
 
     printf("slot=%d,so=%d,st=%d,wait=%d,took=%d,first=%ld,last=%ld,startw=%ld,endw=%ld,count=%d,seen=%d\n", loop, subm->subobs, slot_state[loop], subm->msec_wait, subm->msec_took,
@@ -3014,8 +6829,10 @@ int main(int argc, char **argv) {
   if (UDP_closelog < 0) UDP_closelog = 0;  // In case we haven't really started yet
 
   while (UDP_closelog <= UDP_removed_from_buff) {
-    my_udp = &UDPbuf[UDP_closelog % UDP_num_slots];
-    printf("num=%ld,slot=%d,freq=%d,rf=%d,time=%d:%d,e2u=%d:%d\n", UDP_closelog, ((my_udp->GPS_time >> 3) & 0b11), my_udp->freq_channel, my_udp->rf_input, my_udp->GPS_time,
+    my_udp   = &UDPbuf[UDP_closelog % UDP_num_slots];
+    int slot = sub_slots - 1;  // Whichever slot last held its subobs, or -1
+    while (slot >= 0 && sub[slot].subobs != (my_udp->GPS_time & 0xFFFFFFF8)) slot--;
+    printf("num=%ld,slot=%d,freq=%d,rf=%d,time=%d:%d,e2u=%d:%d\n", UDP_closelog, slot, my_udp->freq_channel, my_udp->rf_input, my_udp->GPS_time,
            my_udp->subsec_time, my_udp->edt2udp_id, my_udp->edt2udp_token);
 
     UDP_closelog++;
@@ -3027,11 +6844,11 @@ int main(int argc, char **argv) {
 
   //---------- Free up everything from the heap ----------
 
-  free(msgvecs);  // The threads are dead, so nobody needs this memory now. Let it be free!
-  free(iovecs);   // Give back to OS (heap)
-  free(UDPbuf);   // This is the big one.  Probably many GB!
+  free_pinned(msgvecs);  // The threads are dead, so nobody needs this memory now. Let it be free!
+  free_pinned(iovecs);   // Give back to OS
+  free_pinned(UDPbuf);   // This is the big one.  Probably many GB!
 
-  free(sub);  // Free the metadata array storage area
+  free_sub_slots();  // Free the metadata array storage area
 
   printf("Exiting process\n");
   fflush(stdout);